@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <string.h>
+#include <math.h>
+#include <algorithm>
 #include "btree.h"
 
 KeyValuePair::KeyValuePair()
@@ -28,17 +30,52 @@ KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 BTreeIndex::BTreeIndex(SIZE_T keysize, 
                        SIZE_T valuesize,
                        BufferCache *cache,
-                       bool unique) 
+                       bool unique,
+                       SIZE_T format) 
 {
   superblock.info.keysize=keysize;
   superblock.info.valuesize=valuesize;
+  superblock.info.format=format;
   buffercache=cache;
-  // note: ignoring unique now
+  searchtype=BTREE_SEARCH_SIMD;
+  overflowpolicy=BTREE_OVERFLOW_SPLIT;
+  appendsplits=true;
+  nodesearches=0;
+  keycompares=0;
+  pinnedlevels=0;
+  pinnedbytes=0;
+  lastleaf=0;
+  bloombits=0;
+  indexfiltered=false;
+  filteredlookups=0;
+  learned=false;
+  modelsearches=0;
+  bufferbytes=0;
+  bufferedmessages=0;
+  flushing=false;
+  if (!unique) { 
+    superblock.info.format|=BTREE_FORMAT_POSTINGS;
+  }
 }
 
 BTreeIndex::BTreeIndex()
 {
-  // shouldn't have to do anything
+  searchtype=BTREE_SEARCH_SIMD;
+  overflowpolicy=BTREE_OVERFLOW_SPLIT;
+  appendsplits=true;
+  nodesearches=0;
+  keycompares=0;
+  pinnedlevels=0;
+  pinnedbytes=0;
+  lastleaf=0;
+  bloombits=0;
+  indexfiltered=false;
+  filteredlookups=0;
+  learned=false;
+  modelsearches=0;
+  bufferbytes=0;
+  bufferedmessages=0;
+  flushing=false;
 }
 
 
@@ -50,6 +87,26 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
   buffercache=rhs.buffercache;
   superblock_index=rhs.superblock_index;
   superblock=rhs.superblock;
+  searchtype=rhs.searchtype;
+  overflowpolicy=rhs.overflowpolicy;
+  appendsplits=rhs.appendsplits;
+  nodesearches=0;
+  keycompares=0;
+  // The pins are rhs's own
+  pinnedlevels=rhs.pinnedlevels;
+  pinnedbytes=rhs.pinnedbytes;
+  lastleaf=0;
+  // The filters are built again as they are needed
+  bloombits=rhs.bloombits;
+  indexfiltered=false;
+  filteredlookups=0;
+  // and so are the models
+  learned=rhs.learned;
+  modelsearches=0;
+  // Messages still buffered are rhs's own
+  bufferbytes=rhs.bufferbytes;
+  bufferedmessages=0;
+  flushing=false;
 }
 
 BTreeIndex::~BTreeIndex()
@@ -64,7 +121,7 @@ BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 }
 
 
-ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
+ERROR_T BTreeIndex::AllocateNode(SIZE_T &n, const bool writesuperblock)
 {
   n=superblock.info.freelist;
 
@@ -72,15 +129,24 @@ ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
     return ERROR_NOSPACE;
   }
 
-  BTreeNode node;
+  BTreeNodeView node;
+  ERROR_T rc;
 
-  node.Unserialize(buffercache,n);
+  rc=node.Pin(buffercache,n);
+  if (rc) { return rc; }
 
-  assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+  assert(node.info->nodetype==BTREE_UNALLOCATED_BLOCK);
 
-  superblock.info.freelist=node.info.freelist;
+  superblock.info.freelist=node.info->freelist;
 
-  superblock.Serialize(buffercache,superblock_index);
+  node.Unpin();
+  ForgetLeafFilter(n);
+  DropModel(n);
+  DropBuffer(n);
+
+  if (writesuperblock) { 
+    superblock.Serialize(buffercache,superblock_index);
+  }
 
   buffercache->NotifyAllocateBlock(n);
 
@@ -88,10 +154,44 @@ ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 }
 
 
+ERROR_T BTreeIndex::AllocateNode(SIZE_T &n, BTreeNodeView &node, const int nodetype)
+{
+  ERROR_T rc;
+
+  rc=AllocateNode(n);
+  if (rc) { return rc; }
+
+  rc=node.Pin(buffercache,n);
+  if (rc) { return rc; }
+
+  // Fresh, empty node of the requested type
+  node.info->nodetype=nodetype;
+  node.info->keysize=superblock.info.keysize;
+  node.info->valuesize=superblock.info.valuesize;
+  node.info->blocksize=superblock.info.blocksize;
+  node.info->rootnode=superblock.info.rootnode;
+  node.info->freelist=0;
+  node.info->numkeys=0;
+  node.info->format=superblock.info.format;
+  node.info->prefixlen=0;
+  node.info->heapbytes=0;
+  memset(node.data,0,node.info->GetNumDataBytes());
+  node.MarkDirty();
+
+  return ERROR_NOERROR;
+}
+
+
 ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 {
   BTreeNode node;
 
+  UnpinUpperNode(n);
+  ForgetLastLeaf();
+  ForgetLeafFilter(n);
+  DropModel(n);
+  DropBuffer(n);
+
   node.Unserialize(buffercache,n);
 
   assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
@@ -112,14 +212,334 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 
 }
 
+
+Block *BTreeIndex::GetPinnedNode(const SIZE_T &node)
+{
+  map<SIZE_T, Block *>::const_iterator i=pinned.find(node);
+
+  return i==pinned.end() ? 0 : (*i).second;
+}
+
+
+ERROR_T BTreeIndex::PinUpperNode(const SIZE_T &node, const SIZE_T depth)
+{
+  Block *frame;
+  ERROR_T rc;
+
+  if (depth>=pinnedlevels || pinned.count(node) ||
+      (pinnedbytes>0 && (pinned.size()+1)*buffercache->GetBlockSize()>pinnedbytes)) { 
+    return ERROR_NOERROR;
+  }
+
+  rc=buffercache->PinBlock(node,frame);
+  if (rc) { return rc; }
+
+  NodeMetadata *info=(NodeMetadata *)(frame->data);
+  if (info->nodetype!=BTREE_ROOT_NODE && info->nodetype!=BTREE_INTERIOR_NODE) { 
+    return buffercache->UnpinBlock(frame);
+  }
+  pinned[node]=frame;
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::UnpinUpperNode(const SIZE_T &node)
+{
+  map<SIZE_T, Block *>::iterator i=pinned.find(node);
+
+  if (i!=pinned.end()) { 
+    // Changes were made through views, which mark the frame dirty themselves
+    buffercache->UnpinBlock((*i).second);
+    pinned.erase(i);
+  }
+}
+
+
+void BTreeIndex::UnpinUpperNodes()
+{
+  for (map<SIZE_T, Block *>::iterator i=pinned.begin();i!=pinned.end();++i) { 
+    buffercache->UnpinBlock((*i).second);
+  }
+  pinned.clear();
+}
+
+
+void BTreeIndex::SetPinnedLevels(const SIZE_T levels, const SIZE_T bytes)
+{
+  UnpinUpperNodes();
+  pinnedlevels=levels;
+  pinnedbytes=bytes;
+}
+
+// Keys and values are exactly keysize/valuesize bytes, or up to that
+// many in the varlen format
+static bool LengthFits(const SIZE_T len, const SIZE_T size, const SIZE_T format)
+{
+  return (format & BTREE_FORMAT_VARLEN) ? len<=size : len==size;
+}
+
+static SIZE_T CommonPrefixLength(const KEY_T &a, const KEY_T &b)
+{
+  SIZE_T n=0;
+  while (n<a.length && n<b.length && a.data[n]==b.data[n]) { 
+    n++;
+  }
+  return n;
+}
+
+// Puts key and value into a new slot at offset
+static ERROR_T PutLeafSlot(BTreeNodeView &b, const SIZE_T offset, const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+
+  rc = b.InsertSlot(offset);
+  if (rc) { return rc; }
+  rc = b.SetKey(offset,key);
+  if (rc) { return rc; }
+  return b.SetVal(offset,value);
+}
+
+
+// Puts key and the pointer to its right, with the pointer's subtree
+// count, into a new slot at offset
+static ERROR_T PutInteriorSlot(BTreeNodeView &b, const SIZE_T offset, const KEY_T &key,
+			       const SIZE_T ptr, const SIZE_T count)
+{
+  ERROR_T rc;
+
+  rc = b.InsertSlot(offset);
+  if (rc) { return rc; }
+  rc = b.SetKey(offset,key);
+  if (rc) { return rc; }
+  rc = b.SetPtr(offset+1,ptr);
+  if (rc) { return rc; }
+  return b.SetCount(offset+1,count);
+}
+
+
+// memcmp style, with a shorter key before any longer one it begins
+static int CompareKeys(const KEY_T &a, const KEY_T &b)
+{
+  int cmp=memcmp(a.data,b.data,min(a.length,b.length));
+  if (cmp) { 
+    return cmp;
+  }
+  return a.length<b.length ? -1 : a.length>b.length ? 1 : 0;
+}
+
+
+// The first byte of a posting list (BTREE_FORMAT_POSTINGS)
+#define POSTING_INLINE   0
+#define POSTING_OVERFLOW 1
+
+static bool IsOverflow(const VALUE_T &list)
+{
+  return list.length>0 && list.data[0]==POSTING_OVERFLOW;
+}
+
+
+// Bytes a value of len bytes takes in a posting list or block
+static SIZE_T PostingBytes(const SIZE_T format, const SIZE_T len)
+{
+  return ((format & BTREE_FORMAT_VARLEN) ? sizeof(unsigned short) : 0)+len;
+}
+
+
+// Writes v at p, returning the bytes it took
+static SIZE_T PutPosting(char *p, const SIZE_T format, const VALUE_T &v)
+{
+  SIZE_T n=0;
+
+  if (format & BTREE_FORMAT_VARLEN) { 
+    unsigned short len=v.length;
+    memcpy(p,&len,sizeof(len));
+    n=sizeof(len);
+  }
+  memcpy(p+n,v.data,v.length);
+  return n+v.length;
+}
+
+
+// Reads the value at p into v, returning the bytes it took
+static SIZE_T GetPosting(const char *p, const SIZE_T format, const SIZE_T valuesize, VALUE_T &v)
+{
+  SIZE_T n=0;
+  SIZE_T len=valuesize;
+
+  if (format & BTREE_FORMAT_VARLEN) { 
+    unsigned short x;
+    memcpy(&x,p,sizeof(x));
+    len=x;
+    n=sizeof(x);
+  }
+  v.Resize(len,false);
+  memcpy(v.data,p+n,len);
+  return n+len;
+}
+
+
+// A posting list of just value, which always fits in the leaf
+static const VALUE_T &MakePosting(const VALUE_T &value, const SIZE_T format, VALUE_T &list)
+{
+  list.Resize(1+PostingBytes(format,value.length),false);
+  list.data[0]=POSTING_INLINE;
+  PutPosting((char *)list.data+1,format,value);
+  return list;
+}
+
+
+// The COUNT FIRST LAST of an overflow posting list
+static void GetChain(const VALUE_T &list, SIZE_T &count, SIZE_T &first, SIZE_T &last)
+{
+  memcpy(&count,list.data+1,sizeof(SIZE_T));
+  memcpy(&first,list.data+1+sizeof(SIZE_T),sizeof(SIZE_T));
+  memcpy(&last,list.data+1+2*sizeof(SIZE_T),sizeof(SIZE_T));
+}
+
+
+static void SetChain(VALUE_T &list, const SIZE_T count, const SIZE_T first, const SIZE_T last)
+{
+  list.Resize(1+3*sizeof(SIZE_T),false);
+  list.data[0]=POSTING_OVERFLOW;
+  memcpy(list.data+1,&count,sizeof(SIZE_T));
+  memcpy(list.data+1+sizeof(SIZE_T),&first,sizeof(SIZE_T));
+  memcpy(list.data+1+2*sizeof(SIZE_T),&last,sizeof(SIZE_T));
+}
+
+
+// The NEXT of a posting block
+static SIZE_T GetNextPostings(const BTreeNodeView &block)
+{
+  SIZE_T next;
+  memcpy(&next,block.data,sizeof(SIZE_T));
+  return next;
+}
+
+
+static void SetNextPostings(BTreeNodeView &block, const SIZE_T next)
+{
+  memcpy(block.data,&next,sizeof(SIZE_T));
+  block.MarkDirty();
+}
+
+
+// Puts v on the end of a posting block, if it has room
+static bool AppendPosting(BTreeNodeView &block, const VALUE_T &v)
+{
+  SIZE_T n=PostingBytes(block.info->format,v.length);
+
+  if (sizeof(SIZE_T)+block.info->heapbytes+n > block.info->GetNumDataBytes()) { 
+    return false;
+  }
+  PutPosting(block.data+sizeof(SIZE_T)+block.info->heapbytes,block.info->format,v);
+  block.info->heapbytes+=n;
+  block.info->numkeys++;
+  block.MarkDirty();
+  return true;
+}
+
+
+ERROR_T BTreeIndex::LeafSeparator(const BTreeNodeView &left, const BTreeNodeView &right,
+				  KEY_T &separator) const
+{
+  ERROR_T rc;
+  KEY_T last;
+
+  rc=right.GetKey(0,separator);
+  if (rc) { return rc; }
+
+  if ((superblock.info.format & BTREE_FORMAT_TRUNCATE) && left.info->numkeys>0) { 
+    rc=left.GetKey(left.info->numkeys-1,last);
+    if (rc) { return rc; }
+    separator.Resize(CommonPrefixLength(last,separator)+1);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SplitPrefixes(const BTreePath &path, BTreeNodeView &left,
+				  BTreeNodeView &right, const KEY_T &split_key)
+{
+  BTreeNodeView parent;
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T ptr;
+  KEY_T fence;
+
+  // Each half can always keep the prefix the whole node had
+  SIZE_T leftlen=left.info->prefixlen;
+  SIZE_T rightlen=left.info->prefixlen;
+
+  if (!(left.info->format & BTREE_FORMAT_PREFIX) || path.depth<2) { 
+    // The root is unbounded, so its halves share nothing more
+    return ERROR_NOERROR;
+  }
+
+  rc=parent.Pin(buffercache,path.node[path.depth-2]);
+  if (rc) { return rc; }
+
+  // The separators either side of node in its parent bound every key
+  // that can ever be routed to it, and split_key bounds the halves
+  // from each other.  Any key between two bounds begins with their
+  // common prefix.
+  offset=path.slot[path.depth-2];
+  rc=parent.GetPtr(offset,ptr);
+  if (rc) { return rc; }
+  if (ptr!=left.GetBlockNum()) { 
+    return ERROR_INSANE;
+  }
+
+  if (offset>0) { 
+    rc=parent.GetKey(offset-1,fence);
+    if (rc) { return rc; }
+    leftlen=max(leftlen,CommonPrefixLength(fence,split_key));
+  }
+  if (offset<parent.info->numkeys) { 
+    rc=parent.GetKey(offset,fence);
+    if (rc) { return rc; }
+    rightlen=max(rightlen,CommonPrefixLength(split_key,fence));
+  }
+
+  // Keys in a node with two or more keys differ somewhere
+  leftlen=min(leftlen,left.info->keysize-1);
+  rightlen=min(rightlen,left.info->keysize-1);
+
+  // split_key begins with both prefixes
+  rc=left.SetPrefix((const char *)split_key.data,leftlen);
+  if (rc) { return rc; }
+  return right.SetPrefix((const char *)split_key.data,rightlen);
+}
+
+
 ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 {
   ERROR_T rc;
 
+  UnpinUpperNodes();
+  ForgetLastLeaf();
+  ForgetFilters();
+  models.clear();
+  buffers.clear();
+  bufferedmessages=0;
+
   superblock_index=initblock;
   assert(superblock_index==0);
 
   if (create) {
+    if (superblock.info.format & ~BTREE_FORMAT_ALL) { 
+      return ERROR_BADCONFIG;
+    }
+    if ((superblock.info.format & (BTREE_FORMAT_TRUNCATE|BTREE_FORMAT_VARLEN|BTREE_FORMAT_POSTINGS)) && 
+	buffercache->GetBlockSize()>65536) { 
+      // Slotted nodes use 16 bit offsets
+      return ERROR_BADCONFIG;
+    }
+    if ((superblock.info.format & BTREE_FORMAT_COLUMNAR) && 
+	(superblock.info.format & (BTREE_FORMAT_VARLEN|BTREE_FORMAT_POSTINGS))) { 
+      // A slotted leaf has no fixed columns
+      return ERROR_BADCONFIG;
+    }
+
     // build a super block, root node, and a free space list
     //
     // Superblock at superblock_index
@@ -132,6 +552,7 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     newsuperblock.info.rootnode=superblock_index+1;
     newsuperblock.info.freelist=superblock_index+2;
     newsuperblock.info.numkeys=0;
+    newsuperblock.info.format=superblock.info.format;
 
     buffercache->NotifyAllocateBlock(superblock_index);
 
@@ -148,6 +569,7 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     newrootnode.info.rootnode=superblock_index+1;
     newrootnode.info.freelist=superblock_index+2;
     newrootnode.info.numkeys=0;
+    newrootnode.info.format=superblock.info.format;
 
     buffercache->NotifyAllocateBlock(superblock_index+1);
 
@@ -182,106 +604,193 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 
 ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
 {
+  ERROR_T rc;
+
+  rc = FlushMessages();
+  if (rc) { return rc; }
+  UnpinUpperNodes();
+  ForgetLastLeaf();
+  ForgetFilters();
+  models.clear();
   return superblock.Serialize(buffercache,superblock_index);
 }
  
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-                                           const BTreeOp op,
-                                           const KEY_T &key,
-                                           VALUE_T &value)
+SIZE_T BTreeIndex::SearchNode(const BTreeNodeView &b, const KEY_T &key, bool &found,
+			      const SIZE_T node)
 {
-  BTreeNode b;
-  ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
+  nodesearches++;
+  if (!learned || node==0 || b.info->nodetype==BTREE_LEAF_NODE || b.info->numkeys==0) { 
+    return b.Search(key,found,searchtype,keycompares);
+  }
 
-  rc= b.Unserialize(buffercache,node);
+  map<SIZE_T, BTreeNodeModel>::iterator m=models.find(node);
+  if (m==models.end()) { 
+    // The node has just been read, so modelling it costs no reads
+    BTreeNodeModel model;
+    if (model.Train(b)) { 
+      return b.Search(key,found,searchtype,keycompares);
+    }
+    m=models.insert(make_pair(node,model)).first;
+  }
+  if ((*m).second.stale || (*m).second.numkeys!=b.info->numkeys) { 
+    // Changed since it was trained
+    return b.Search(key,found,searchtype,keycompares);
+  }
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
+  SIZE_T from, to;
+  (*m).second.Predict(key,from,to);
+  if (from>0 || to<b.info->numkeys) { 
+    modelsearches++;
   }
+  return b.SearchRange(key,from,to,found,searchtype,keycompares);
+}
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey) {
-        // OK, so we now have the first key that's larger
-        // so we ned to recurse on the ptr immediately previous to 
-        // this one, if it exists
-        rc=b.GetPtr(offset,ptr);
-        if (rc) { return rc; }
-        return LookupOrUpdateInternal(ptr,op,key,value);
-      }
+
+ERROR_T BTreeIndex::FindLeaf(const KEY_T &key, BTreeNodeView &leaf, BTreePath &path,
+			     KEY_T *fence, KEY_T *lo)
+{
+  BTreeNodeView upper;
+  BTreeNodeView *b;
+  Block *frame;
+  ERROR_T rc;
+  SIZE_T node=superblock.info.rootnode;
+  SIZE_T offset;
+  bool found;
+
+  leaf.Unpin();
+  path.depth=0;
+
+  for (;;) { 
+    if (path.depth>=BTREE_MAX_DEPTH) { 
+      return ERROR_INSANE;
     }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) { 
-      rc=b.GetPtr(b.info.numkeys,ptr);
+    path.node[path.depth]=node;
+    path.slot[path.depth]=0;
+
+    // A pinned upper level node is read in place; anything else is
+    // pinned in leaf, which is left on the last one
+    if ((frame=GetPinnedNode(node))) { 
+      upper.info=(NodeMetadata *)(frame->data);
+      upper.data=(char *)(frame->data)+sizeof(NodeMetadata);
+      b=&upper;
+    } else { 
+      rc = leaf.Pin(buffercache,node);
       if (rc) { return rc; }
-      return LookupOrUpdateInternal(ptr,op,key,value);
-    } else {
+      rc = PinUpperNode(node,path.depth);
+      if (rc) { return rc; }
+      b=&leaf;
+    }
+    path.depth++;
+
+    if (b->info->nodetype==BTREE_LEAF_NODE) { 
+      break;
+    }
+    if (b->info->nodetype!=BTREE_ROOT_NODE && b->info->nodetype!=BTREE_INTERIOR_NODE) { 
+      // We can't be looking at anything other than a root, internal, or leaf
+      return ERROR_INSANE;
+    }
+    if (b->info->numkeys==0) { 
       // There are no keys at all on this node, so nowhere to go
+      leaf.Unpin();
       return ERROR_NONEXISTENT;
     }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) { 
-	if (op==BTREE_OP_LOOKUP) { 
-	  return b.GetVal(offset,value);
-	} else { 
-	  // BTREE_OP_UPDATE
-	  rc =  b.SetVal(offset,value);
-	  if (rc) { return rc; }
-	  return b.Serialize(buffercache,node);
-	}
-      }
+    // Find the first key that's larger and go down the ptr
+    // immediately previous to it.  An equal key belongs to the
+    // right.  An empty key is below every separator.
+    offset=key.length>0 ? SearchNode(*b,key,found,node)+found : 0;
+    if (fence && offset<b->info->numkeys) { 
+      rc = b->GetKey(offset,*fence);
+      if (rc) { return rc; }
     }
-    return ERROR_NONEXISTENT;
-    break;
-  default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
-  }  
+    if (lo && offset>0) { 
+      rc = b->GetKey(offset-1,*lo);
+      if (rc) { return rc; }
+    }
+    rc = b->GetPtr(offset,node);
+    if (rc) { return rc; }
+    path.slot[path.depth-1]=offset;
+  }
 
-  return ERROR_INSANE;
+  return ERROR_NOERROR;
 }
 
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+ERROR_T BTreeIndex::LookupOrUpdateInternal(const BTreeOp op,
+                                           const KEY_T &key,
+                                           VALUE_T &value)
 {
-  KEY_T key;
-  VALUE_T value;
-  SIZE_T ptr;
-  SIZE_T offset;
+  BTreeNodeView b;
+  BTreePath path;
   ERROR_T rc;
-  unsigned i;
+  SIZE_T offset;
+  bool found;
+  bool maybe;
 
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << nodenum << " [ label=\""<<nodenum<<": ";
-  } else if (dt==BTREE_DEPTH) {
-    os << nodenum << ": ";
-  } else {
+  rc = IndexMayContain(key,maybe);
+  if (rc) { return rc; }
+  if (!maybe) { 
+    return ERROR_NONEXISTENT;
   }
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (dt==BTREE_SORTED_KEYVAL) {
-    } else {
-      if (dt==BTREE_DEPTH_DOT) { 
-      } else { 
-        os << "Interior: ";
+  rc = FindLeaf(key,b,path);
+  if (rc) { return rc; }
+
+  rc = LeafMayContain(b,key,maybe);
+  if (rc) { return rc; }
+  if (!maybe) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  // Search the keys for a matching value
+  offset=SearchNode(b,key,found);
+  if (!found) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (op==BTREE_OP_LOOKUP) { 
+    return GetLeafValue(b,offset,value);
+  }
+
+  // BTREE_OP_UPDATE
+  // The view writes straight into the cached block
+  rc = SetLeafValue(b,offset,value);
+  if (rc) { return rc; }
+  if (b.IsFull()) { 
+    // A longer varlen value can leave the leaf without room for another slot
+    b.Unpin();
+    return Split(path);
+  }
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt,
+			 BufferCache *cache)
+{
+  KEY_T key;
+  VALUE_T value;
+  VALUE_T list;
+  BTreePostingCursor postings;
+  SIZE_T ptr;
+  SIZE_T offset;
+  ERROR_T rc;
+  unsigned i;
+
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << nodenum << " [ label=\""<<nodenum<<": ";
+  } else if (dt==BTREE_DEPTH) {
+    os << nodenum << ": ";
+  } else {
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (dt==BTREE_SORTED_KEYVAL) {
+    } else {
+      if (dt==BTREE_DEPTH_DOT) { 
+      } else { 
+        os << "Interior: ";
       }
       for (offset=0;offset<=b.info.numkeys;offset++) { 
         rc=b.GetPtr(offset,ptr);
@@ -291,7 +800,7 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
         if (offset==b.info.numkeys) break;
         rc=b.GetKey(offset,key);
         if (rc) {  return rc; }
-        for (i=0;i<b.info.keysize;i++) { 
+        for (i=0;i<key.length;i++) { 
           os << key.data[i];
         }
         os << " ";
@@ -312,29 +821,35 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
 	  os << "*" << ptr << " ";
 	}
       }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << "(";
-      }
       rc=b.GetKey(offset,key);
       if (rc) {  return rc; }
-      for (i=0;i<b.info.keysize;i++) { 
-	os << key.data[i];
-      }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ",";
-      } else {
-	os << " ";
-      }
-      rc=b.GetVal(offset,value);
+      rc=b.GetVal(offset,list);
       if (rc) {  return rc; }
-      for (i=0;i<b.info.valuesize;i++) { 
-	os << value.data[i];
-      }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ")\n";
-      } else {
-	os << " ";
+      // A key of a non-unique index is shown with each of its values
+      rc=postings.Open(cache,b.info,list);
+      if (rc) {  return rc; }
+      while ((rc=postings.Next(value))==ERROR_NOERROR) { 
+	if (dt==BTREE_SORTED_KEYVAL) { 
+	  os << "(";
+	}
+	for (i=0;i<key.length;i++) { 
+	  os << key.data[i];
+	}
+	if (dt==BTREE_SORTED_KEYVAL) { 
+	  os << ",";
+	} else {
+	  os << " ";
+	}
+	for (i=0;i<value.length;i++) { 
+	  os << value.data[i];
+	}
+	if (dt==BTREE_SORTED_KEYVAL) { 
+	  os << ")\n";
+	} else {
+	  os << " ";
+	}
       }
+      if (rc!=ERROR_NONEXISTENT) {  return rc; }
     }
     break;
   default:
@@ -352,227 +867,391 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
   
 ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
 {
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  if (!LengthFits(key.length,superblock.info.keysize,superblock.info.format)) { 
+    return ERROR_SIZE;
+  }
+  if (bufferedmessages>0) { 
+    // A buffered message is newer than anything in the leaf
+    BTreeMessage message;
+    bool found;
+    ERROR_T rc = FindMessage(key,message,found);
+    if (rc) { return rc; }
+    if (found) { 
+      if (message.remove) { 
+	return ERROR_NONEXISTENT;
+      }
+      value=message.value;
+      return ERROR_NOERROR;
+    }
+  }
+  return LookupOrUpdateInternal(BTREE_OP_LOOKUP, key, value);
 }
 
-ERROR_T BTreeIndex::Inserter(list<SIZE_T> crumbs, const SIZE_T &node, const KEY_T &key, const VALUE_T &value)
-{
-  BTreeNode b;
-  BTreeNode& b_ref = b;
-  ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
+// Orders keys, and equal keys by where they are in the batch
+struct KeyOrder {
+  const vector<KEY_T> &keys;
 
-  // Push current node 
-  crumbs.push_front(node);
+  KeyOrder(const vector<KEY_T> &keys) : keys(keys) {}
 
-  rc = b.Unserialize(buffercache,node);
-  if (rc) { return rc; }
+  bool operator()(const SIZE_T a, const SIZE_T b) const {
+    int cmp=CompareKeys(keys[a],keys[b]);
+    return cmp<0 || (cmp==0 && a<b);
+  }
+};
 
-  switch (b.info.nodetype) {
-    case BTREE_ROOT_NODE:
-      if (b.info.numkeys==0) {
-        //
-        // Special case where rootnode is empty
-
-        SIZE_T left_block_loc;
-        SIZE_T& left_block_ref = left_block_loc;
-        SIZE_T right_block_loc;
-        SIZE_T& right_block_ref = right_block_loc;
-
-        // Left node
-        //
-        // Get block offset from AllocateNode
-        rc = AllocateNode(left_block_ref);
-        if (rc) { cout<<rc<<endl; return rc; }
-
-        // Unserialize from block offset into left_node
-        BTreeNode left_node;
-        rc = left_node.Unserialize(buffercache,left_block_loc);	
-        if (rc) { return rc; }
 
-        // left_node is a leaf node
-        left_node.info.nodetype = BTREE_LEAF_NODE;
-        left_node.data = new char [left_node.info.GetNumDataBytes()];
-        memset(left_node.data,0,left_node.info.GetNumDataBytes());
+ERROR_T BTreeIndex::MultiLookup(const vector<KEY_T> &keys, vector<VALUE_T> &values,
+				vector<ERROR_T> &results)
+{
+  vector<SIZE_T> order;
+  bool maybe;
+  ERROR_T rc;
 
-        // Set number of keys in left_node to 0
-        left_node.info.numkeys = 0;
+  values.clear();
+  values.resize(keys.size());
+  results.assign(keys.size(),ERROR_NONEXISTENT);
 
-        // Serialize left_node back into buffer
-        rc = left_node.Serialize(buffercache,left_block_loc);
-        if (rc) { return rc; }
+  for (SIZE_T i=0;i<keys.size();i++) { 
+    if (!LengthFits(keys[i].length,superblock.info.keysize,superblock.info.format)) { 
+      results[i]=ERROR_SIZE;
+      continue;
+    }
+    if (bufferedmessages>0) { 
+      // As in Lookup, but each such key takes a descent of its own
+      BTreeMessage message;
+      bool found;
+      rc = FindMessage(keys[i],message,found);
+      if (rc) { return rc; }
+      if (found) { 
+	if (!message.remove) { 
+	  values[i]=message.value;
+	  results[i]=ERROR_NOERROR;
+	}
+	continue;
+      }
+    }
+    // Keys the index surely hasn't got go no further
+    rc = IndexMayContain(keys[i],maybe);
+    if (rc) { return rc; }
+    if (maybe) { 
+      order.push_back(i);
+    }
+  }
+  if (order.empty()) { 
+    return ERROR_NOERROR;
+  }
+  sort(order.begin(),order.end(),KeyOrder(keys));
 
+  return MultiLookupNode(superblock.info.rootnode,0,keys,order,0,order.size(),values,results);
+}
 
-        // Right node
-        //
-        // Get block offset from AllocateNode
-        rc = AllocateNode(right_block_ref);
-        if (rc) { cout<<rc<<endl; return rc; }
 
-        // Unserialize from block offset into right_node
-        BTreeNode right_node;
-        rc = right_node.Unserialize(buffercache,right_block_loc);	
-        if (rc) { return rc; }
+ERROR_T BTreeIndex::MultiLookupNode(const SIZE_T node, const SIZE_T depth,
+				    const vector<KEY_T> &keys, const vector<SIZE_T> &order,
+				    const SIZE_T first, const SIZE_T last,
+				    vector<VALUE_T> &values, vector<ERROR_T> &results)
+{
+  BTreeNodeView pinnedview;
+  BTreeNodeView upper;
+  BTreeNodeView *b;
+  Block *frame;
+  SIZE_T offset;
+  SIZE_T child;
+  bool found;
+  bool maybe;
+  ERROR_T rc;
 
-        // right_node is a leaf node
-        right_node.info.nodetype = BTREE_LEAF_NODE;
-        right_node.data = new char [right_node.info.GetNumDataBytes()];
-        memset(right_node.data,0,right_node.info.GetNumDataBytes());
+  if (depth>=BTREE_MAX_DEPTH) { 
+    return ERROR_INSANE;
+  }
 
-        // Set number of keys in right_node to 1
-        right_node.info.numkeys = 1;
+  // As in FindLeaf, a pinned upper level node is read in place
+  if ((frame=GetPinnedNode(node))) { 
+    upper.info=(NodeMetadata *)(frame->data);
+    upper.data=(char *)(frame->data)+sizeof(NodeMetadata);
+    b=&upper;
+  } else { 
+    rc = pinnedview.Pin(buffercache,node);
+    if (rc) { return rc; }
+    rc = PinUpperNode(node,depth);
+    if (rc) { return rc; }
+    b=&pinnedview;
+  }
 
-        // Set key of right_node
-        rc = right_node.SetKey(0,key);
-        if (rc) { return rc; }
+  if (b->info->nodetype==BTREE_LEAF_NODE) { 
+    for (SIZE_T i=first;i<last;i++) { 
+      rc = LeafMayContain(*b,keys[order[i]],maybe);
+      if (rc) { return rc; }
+      if (!maybe) { 
+	continue;
+      }
+      offset=SearchNode(*b,keys[order[i]],found);
+      if (found) { 
+	rc = GetLeafValue(*b,offset,values[order[i]]);
+	if (rc) { return rc; }
+	results[order[i]]=ERROR_NOERROR;
+      }
+    }
+    return ERROR_NOERROR;
+  }
+  if (b->info->nodetype!=BTREE_ROOT_NODE && b->info->nodetype!=BTREE_INTERIOR_NODE) { 
+    return ERROR_INSANE;
+  }
+  if (b->info->numkeys==0) { 
+    // An empty tree, so every key stays ERROR_NONEXISTENT
+    return ERROR_NOERROR;
+  }
 
-        // Set value in right_node
-        rc = right_node.SetVal(0,value);
-        if (rc) { return rc; }
+  // Hand each child the run of keys that belong to it: those from the
+  // next one on that are below the separator right of the child
+  SIZE_T i=first;
+  while (i<last) { 
+    const KEY_T &key=keys[order[i]];
+    child=key.length>0 ? SearchNode(*b,key,found,node)+found : 0;
+
+    SIZE_T j=i+1;
+    if (child<b->info->numkeys) { 
+      while (j<last && b->CompareKey(child,keys[order[j]])>0) { 
+	j++;
+      }
+    } else {
+      j=last;
+    }
 
-        // Serialize right_node back into buffer
-        rc = right_node.Serialize(buffercache,right_block_loc);
-        if (rc) { return rc; }
+    SIZE_T ptr;
+    rc = b->GetPtr(child,ptr);
+    if (rc) { return rc; }
+    rc = MultiLookupNode(ptr,depth+1,keys,order,i,j,values,results);
+    if (rc) { return rc; }
+    i=j;
+  }
 
+  return ERROR_NOERROR;
+}
 
-        // Root node
-        //
-        // Set number of keys in root to 1
-        b.info.numkeys = 1;
+ERROR_T BTreeIndex::Scan(const KEY_T &lo, const KEY_T &hi, BTreeCursor &cursor)
+{
+  BTreePath path;
+  bool found;
+  ERROR_T rc;
 
-        // Set key in root
-        rc = b.SetKey(0,key);
-        if (rc) { return rc; }
+  if ((lo.length>0 && !LengthFits(lo.length,superblock.info.keysize,superblock.info.format)) ||
+      (hi.length>0 && !LengthFits(hi.length,superblock.info.keysize,superblock.info.format))) { 
+    return ERROR_SIZE;
+  }
 
-        // Set left pointer of root to point at left_node
-        rc = b.SetPtr(0,left_block_ref);
-        if (rc) { return rc; }
+  cursor.Close();
+  rc = FlushMessages();
+  if (rc) { return rc; }
+  cursor.cache=buffercache;
+  cursor.hi=hi;
+  cursor.bounded=hi.length>0;
+  cursor.offset=0;
+
+  // Walk down to the leaf that holds lo, or the first leaf
+  rc = FindLeaf(lo,cursor.leaf,path);
+  if (rc==ERROR_NONEXISTENT) { 
+    // Empty tree, so the cursor is left closed
+    return ERROR_NOERROR;
+  }
+  if (rc) { 
+    cursor.Close();
+    return rc;
+  }
 
-        // Set right pointer of root to point at right_node
-        rc = b.SetPtr(1,right_block_ref);
-        if (rc) { return rc; }
+  if (lo.length>0) { 
+    cursor.offset=SearchNode(cursor.leaf,lo,found);
+  }
+  return ERROR_NOERROR;
+}
 
-        // Serialize root node
-        rc = b.Serialize(buffercache,node);
-        if (rc) { return rc; }
 
-        return ERROR_NOERROR;
-        break;
-      } 
+BTreeCursor::BTreeCursor() : cache(0), offset(0), bounded(false)
+{}
 
-    case BTREE_INTERIOR_NODE:
-      // Scan through key/ptr pairs
-      //and recurse if possible
-      for (offset=0;offset<b.info.numkeys;offset++) { 
-        rc=b.GetKey(offset,testkey);
-        if (rc) {  return rc; }
-        if (key<testkey) {
-          // OK, so we now have the first key that's larger
-          // so we ned to recurse on the ptr immediately previous to 
-          // this one, if it exists
-          rc=b.GetPtr(offset,ptr);
-          if (rc) { return rc; }
-          return Inserter(crumbs,ptr,key,value);
-        }
+
+ERROR_T BTreeCursor::Next(KEY_T &key, VALUE_T &value)
+{
+  SIZE_T next;
+  ERROR_T rc;
+
+  while (leaf.IsPinned()) { 
+    if (postings.IsOpen()) { 
+      // The rest of a non-unique key's values
+      rc = postings.Next(value);
+      if (rc) { return rc; }
+      key=this->key;
+      return ERROR_NOERROR;
+    }
+    if (offset<leaf.info->numkeys) { 
+      if (bounded && leaf.CompareKey(offset,hi)>=0) { 
+	break;
       }
-      // if we got here, we need to go to the next pointer, if it exists
-      if (b.info.numkeys>0) { 
-        rc=b.GetPtr(b.info.numkeys,ptr);
-        if (rc) { return rc; }
-        return Inserter(crumbs,ptr,key,value);
-      } else {
-        // There are no keys at all on this node, so nowhere to go
-        return ERROR_NONEXISTENT;
+      rc = leaf.GetKey(offset,key);
+      if (rc) { return rc; }
+      rc = leaf.GetVal(offset,value);
+      if (rc) { return rc; }
+      offset++;
+      if (leaf.info->format & BTREE_FORMAT_POSTINGS) { 
+	this->key=key;
+	rc = postings.Open(cache,*leaf.info,value);
+	if (rc) { return rc; }
+	continue;
       }
+      return ERROR_NOERROR;
+    }
+    // Off the end of this leaf, so on to the next one
+    rc = leaf.GetPtr(0,next);
+    if (rc) { return rc; }
+    if (next==0) { 
       break;
+    }
+    rc = leaf.Pin(cache,next);
+    if (rc) { return rc; }
+    offset=0;
+  }
 
-    case BTREE_LEAF_NODE:
-      return LeafNodeInsert(crumbs, node ,b_ref, key, value);
+  Close();
+  return ERROR_NONEXISTENT;
+}
 
-    default:
-      return ERROR_INSANE;
-      break;
-   }
 
-   return ERROR_INSANE;
+void BTreeCursor::Close()
+{
+  leaf.Unpin();
+  postings.Close();
 }
 
-ERROR_T BTreeIndex::LeafNodeInsert(list<SIZE_T> crumbs, const SIZE_T &node, BTreeNode &b, const KEY_T &key, const VALUE_T &value)
+
+ERROR_T BTreeIndex::InsertFirst(const KEY_T &key, const VALUE_T &value)
 {
+  BTreeNodeView b;
+  SIZE_T left_block_loc;
+  SIZE_T right_block_loc;
+  BTreeNodeView left_node;
+  BTreeNodeView right_node;
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
 
-  // Iterator and temporary keys and values, used to copy data
-  SIZE_T iter;
-  KEY_T temp_key;
-  KEY_T& temp_key_ref = temp_key;
-  VALUE_T temp_val;
-  VALUE_T& temp_val_ref = temp_val;
+  rc = b.Pin(buffercache,superblock.info.rootnode);
+  if (rc) { return rc; }
+  if (b.info->nodetype!=BTREE_ROOT_NODE || b.info->numkeys!=0) { 
+    return ERROR_INSANE;
+  }
 
-  //---------------//
+  // Left node
+  //
+  // Get a fresh, empty leaf from AllocateNode
+  rc = AllocateNode(left_block_loc,left_node,BTREE_LEAF_NODE);
+  if (rc) { cout<<rc<<endl; return rc; }
 
-  if (b.info.nodetype!=BTREE_LEAF_NODE) {
-    // If we aren't in a leaf node, something bad has happened.
-    return ERROR_BADNODETYPE;
-  }
+  // Right node
+  //
+  // Get a fresh, empty leaf from AllocateNode
+  rc = AllocateNode(right_block_loc,right_node,BTREE_LEAF_NODE);
+  if (rc) { cout<<rc<<endl; return rc; }
 
-  if (b.info.numkeys==0) {
-    // Special case where leaf node is empty. Insert at beginning.
+  // Chain left_node to right_node
+  rc = left_node.SetPtr(0,right_block_loc);
+  if (rc) { return rc; }
 
-    //Increment numkeys
-    b.info.numkeys++;
+  // Set number of keys in right_node to 1
+  right_node.info->numkeys = 1;
 
-    rc = b.SetKey(0,key);
-    if (rc) { return rc; }
+  // Set key of right_node
+  rc = right_node.SetKey(0,key);
+  if (rc) { return rc; }
 
-    rc = b.SetVal(0,value);
-    if (rc) { return rc; }
+  // Set value in right_node
+  rc = right_node.SetVal(0,value);
+  if (rc) { return rc; }
 
-    rc = b.Serialize(buffercache,node);
-    if (rc) { return rc; }
 
-    return ERROR_NOERROR;
+  // Root node
+  //
+  // Set number of keys in root to 1
+  b.info->numkeys = 1;
+
+  // Set key in root
+  rc = b.SetKey(0,key);
+  if (rc) { return rc; }
+
+  // Set left pointer of root to point at left_node
+  rc = b.SetPtr(0,left_block_loc);
+  if (rc) { return rc; }
+
+  // Set right pointer of root to point at right_node
+  rc = b.SetPtr(1,right_block_loc);
+  if (rc) { return rc; }
+
+  // and only the right one has a key
+  rc = b.SetCount(0,0);
+  if (rc) { return rc; }
+  rc = b.SetCount(1,1);
+  if (rc) { return rc; }
+
+  FilterInsert(right_block_loc,key);
+
+  // The views write through to the cache as they are unpinned
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::LeafNodeInsert(BTreePath &path, BTreeNodeView &b, const KEY_T &key, const VALUE_T &value)
+{
+  SIZE_T offset;
+  bool found;
+
+  //---------------//
+
+  if (b.info->nodetype!=BTREE_LEAF_NODE) {
+    // If we aren't in a leaf node, something bad has happened.
+    return ERROR_BADNODETYPE;
   }
 
+  // Find the first key larger than the input key
+  offset = SearchNode(b,key,found);
   //
-  // Node has keys and values in it
+  // If key exists, can't insert. Return conflict error.
+  if (found && IsUnique()) { return ERROR_CONFLICT; }
 
-  for (offset=0;offset<b.info.numkeys;offset++) {
-    // move through keys until we find one larger than input key
-    rc = b.GetKey(offset,testkey);
-    if (rc) {  return rc; }
-    //
-    // If key exists, can't insert. Return conflict error.
-    if (key == testkey) { return ERROR_CONFLICT; }
-    // Otherwise, break loop and continue
-    if (key<testkey) { break; }
+  if (IsUnique()) { 
+    return LeafInsertAt(path,b,offset,key,value);
   }
 
-  // Increment numkeys
-  b.info.numkeys++;
-
-  // Move back from largest key to offset key, shifting keys and values one to
-  // the right
-  for(iter=(b.info.numkeys-2);iter>=offset;iter--) {
+  // A non-unique index adds the value to the key's posting list, or
+  // gives a new key a list of one
+  VALUE_T list;
+  ERROR_T rc;
 
-    // Shift key
-    rc = b.GetKey(iter,temp_key_ref);
-    if (rc) { return rc; }
-    rc = b.SetKey(iter+1,temp_key_ref);
+  if (!found) { 
+    return LeafInsertAt(path,b,offset,key,MakePosting(value,superblock.info.format,list));
+  }
+  path.slot[path.depth-1]=offset;
+  rc = AddPosting(b,offset,value);
+  if (rc==ERROR_NOSPACE && b.info->numkeys>1) { 
+    // The longer list doesn't fit beside the leaf's other keys, so
+    // split the leaf and try again in whichever half has the key
+    b.Unpin();
+    rc = Split(path);
     if (rc) { return rc; }
+    return Insert(key,value);
+  }
+  if (rc) { return rc; }
+  if (b.IsFull()) { 
+    b.Unpin();
+    return Split(path);
+  }
+  return ERROR_NOERROR;
+}
 
-    // Shift value
-    rc = b.GetVal(iter,temp_val_ref);
-    if (rc) { return rc; }
-    rc = b.SetVal(iter+1,temp_val_ref);
-    if (rc) { return rc; }
+ERROR_T BTreeIndex::LeafInsertAt(BTreePath &path, BTreeNodeView &b, const SIZE_T offset,
+				 const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
 
-  // Test if pointers are equal, since >= doesn't work with pointers. Break loop if they are
-    if (iter == offset) { break; }
-  }
+  // Shift the larger keys and values one slot to the right and
+  // increment numkeys
+  rc = b.InsertSlot(offset);
+  if (rc) { return rc; }
 
   // Set input key
   rc = b.SetKey(offset,key);
@@ -581,396 +1260,2897 @@ ERROR_T BTreeIndex::LeafNodeInsert(list<SIZE_T> crumbs, const SIZE_T &node, BTre
   // Set input value
   rc = b.SetVal(offset,value);
   if (rc) { return rc; }
+  path.slot[path.depth-1]=offset;
+  FilterInsert(b.GetBlockNum(),key);
 
-  // Serialize block
-  rc = b.Serialize(buffercache,node);
+  rc = AdjustCounts(path,1);
   if (rc) { return rc; }
 
-  if (b.info.numkeys >= b.info.GetNumSlotsAsLeaf()) {
+  if (b.IsFull()) {
     // We're at or over the slot upper bound
-    rc = Split(crumbs);
+    b.Unpin();
+    rc = Split(path);
     if (rc) { return rc; }
   }
 
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::Split(list<SIZE_T> crumbs)
+// Bytes in the largest slot b could be given
+static SIZE_T LargestSlot(const BTreeNodeView &b)
 {
-  SIZE_T orig_block_loc;
-  ERROR_T rc;
-
-  // First node offset on list is current node. Pop it for when we recurse.
-  if (crumbs.empty()) { return ERROR_INSANE; }
-  orig_block_loc = crumbs.front();
-  SIZE_T& orig_block_ref = orig_block_loc;
-  crumbs.pop_front();
+  if (!b.IsSlotted()) { 
+    return b.GetSlotSize();
+  }
+  return b.GetSlotSize()+b.info->GetStoredKeySize()+
+    (b.info->nodetype==BTREE_LEAF_NODE ? b.info->valuesize : 0);
+}
 
-  // Unserialize node
-  BTreeNode orig_node;
-  rc = orig_node.Unserialize(buffercache,orig_block_ref);
-  if (rc) { return rc; }
 
-  // To hold the key sizes for the split blocks
-  SIZE_T k2;
-  SIZE_T k1;
+// true if b could take count of its largest slots
+static bool HasRoomForSlots(const BTreeNodeView &b, const SIZE_T count)
+{
+  return b.GetFreeBytes()>=count*LargestSlot(b);
+}
 
-  // Pointer to new block location and reference to it and new node
-  SIZE_T new_block_loc;
-  SIZE_T& new_block_ref = new_block_loc;
-  BTreeNode new_node;
-  
 
-  // Iterator and temporary keys and values, used to copy data
-  SIZE_T iter;
-  KEY_T temp_key;
-  KEY_T& temp_key_ref = temp_key;
-  SIZE_T temp_ptr;
-  SIZE_T& temp_ptr_ref = temp_ptr;
-  VALUE_T temp_val;
-  VALUE_T& temp_val_ref = temp_val;
+// The slot of b that splits it with about bytes of slots in front of
+// it, leaving a slot on either side, and for an interior node one
+// more to promote
+static SIZE_T SlotAtBytes(const BTreeNodeView &b, const SIZE_T bytes)
+{
+  SIZE_T n=b.info->numkeys;
+  SIZE_T last = b.info->nodetype==BTREE_LEAF_NODE ? n-1 : n-2;
+  SIZE_T sum=0;
+  SIZE_T k;
 
-  unsigned int i;
-  string null_key_str;
-  for (i = 0; i < superblock.info.keysize; i++) {
-    null_key_str = "0" + null_key_str;
+  for (k=0;k<last && sum<bytes;k++) { 
+    sum+=b.GetSlotBytes(k);
   }
+  return max(k,(SIZE_T)1);
+}
+
+
+// The slot to split b at when keys are being appended to it: as far
+// right as leaves the new node a slot (and an interior node one more
+// to promote), but far enough left that b is no longer full
+static SIZE_T AppendSlot(const BTreeNodeView &b)
+{
+  SIZE_T n=b.info->numkeys;
+  SIZE_T k = b.info->nodetype==BTREE_LEAF_NODE ? n-1 : n-2;
+  SIZE_T free=b.GetFreeBytes();
 
-  string null_val_str;
+  // Slots k..n-1 all leave b, key k into the parent if it is interior
+  for (SIZE_T i=k;i<n;i++) { 
+    free+=b.GetSlotBytes(i);
+  }
+  while (k>1 && free<LargestSlot(b)) { 
+    k--;
+    free+=b.GetSlotBytes(k);
+  }
+  return k;
+}
 
-  // Null pointer used to set copied values to NULL in old_node
-  SIZE_T null_ptr = 0;
-  SIZE_T& null_ptr_ref = null_ptr;
 
+ERROR_T BTreeIndex::SplitNode(const BTreePath &path, BTreeNodeView &orig_node, const SIZE_T k1,
+			      SIZE_T &new_block_loc, BTreeNodeView &new_node, KEY_T &split_key)
+{
+  ERROR_T rc;
+  SIZE_T k2;
+  SIZE_T ptr;
+  SIZE_T count;
 
-  switch (orig_node.info.nodetype) { 
+  switch (orig_node.info->nodetype) { 
     case BTREE_ROOT_NODE:
       // Falls through into interior node
     case BTREE_INTERIOR_NODE:
 
+      // Number of keys for new_node.  Key k1 moves up into the parent.
+      if (k1>=orig_node.info->numkeys) { return ERROR_INSANE; }
+      k2 = orig_node.info->numkeys-k1-1;
+
+      // Get a fresh interior node from AllocateNode
+      rc = AllocateNode(new_block_loc,new_node,BTREE_INTERIOR_NODE);
+      if (rc) { cout<<rc<<endl; return rc; }
+      // Same layout as orig_node so the slots can be copied as they are
+      rc = new_node.SetPrefix(orig_node.ResolvePrefix(),orig_node.info->prefixlen);
+      if (rc) { return rc; }
+
+      // The pointer right of key k1 becomes new_node's first pointer,
+      // and the key/pointer slots after it follow
+      rc = orig_node.GetPtr(k1+1,ptr);
+      if (rc) { return rc; }
+      rc = new_node.SetPtr(0,ptr);
+      if (rc) { return rc; }
+      rc = orig_node.GetCount(k1+1,count);
+      if (rc) { return rc; }
+      rc = new_node.SetCount(0,count);
+      if (rc) { return rc; }
+      rc = new_node.AppendSlots(orig_node,k1+1,k2);
+      if (rc) { return rc; }
+
+      // Remember key k1 before it is cleared. It is unneeded in orig_node after the split.
+      rc = orig_node.GetKey(k1,split_key);
+      if (rc) { return rc; }
+
+      // Drop key k1 and the moved slots from orig_node
+      rc = orig_node.TruncateSlots(k1);
+      if (rc) { return rc; }
+      break;
+
+    case BTREE_LEAF_NODE:
+
+      // Number of keys for new_node
+      if (k1>orig_node.info->numkeys) { return ERROR_INSANE; }
+      k2 = orig_node.info->numkeys-k1;
+
+      // Get a fresh leaf from AllocateNode
+      rc = AllocateNode(new_block_loc,new_node,BTREE_LEAF_NODE);
+      if (rc) { cout<<rc<<endl; return rc; }
+      rc = new_node.SetPrefix(orig_node.ResolvePrefix(),orig_node.info->prefixlen);
+      if (rc) { return rc; }
+
+      // new_node goes into the leaf chain right after orig_node
+      rc = orig_node.GetPtr(0,ptr);
+      if (rc) { return rc; }
+      rc = new_node.SetPtr(0,ptr);
+      if (rc) { return rc; }
+      rc = orig_node.SetPtr(0,new_block_loc);
+      if (rc) { return rc; }
+
+      // Move the upper k2 key/value slots into new_node
+      rc = new_node.AppendSlots(orig_node,k1,k2);
+      if (rc) { return rc; }
+      rc = orig_node.TruncateSlots(k1);
+      if (rc) { return rc; }
+
+      // Get the first key in the new_node (or as much of it as it takes
+      // to be above orig_node's last key). This is the key we'll insert into the parent.
+      rc = LeafSeparator(orig_node,new_node,split_key);
+      if (rc) { return rc; }
+
+      // A filtered leaf passes its filter on to both halves, each of
+      // just its own keys
+      if (leaffilters.count(orig_node.GetBlockNum())) { 
+        rc = FilterLeaf(orig_node);
+        if (rc) { return rc; }
+        rc = FilterLeaf(new_node);
+        if (rc) { return rc; }
+      }
+      break;
+
+    default:
+      return ERROR_INSANE;
+      break;
+  }
+
+  return SplitPrefixes(path,orig_node,new_node,split_key);
+}
+
+
+ERROR_T BTreeIndex::IsAppend(const BTreePath &path, const BTreeNodeView &b, bool &append)
+{
+  ERROR_T rc;
+  SIZE_T n=b.info->numkeys;
+  SIZE_T ptr;
+
+  append=false;
+
+  // The key last put into b must be its last key, and b must have
+  // enough keys to leave both halves a valid node
+  if (path.slot[path.depth-1]+1!=n || 
+      n < (b.info->nodetype==BTREE_LEAF_NODE ? 2 : 3)) { 
+    return ERROR_NOERROR;
+  }
+
+  // and b must be the last node on its level.  For a leaf that is the
+  // end of the leaf chain; otherwise every node above must have been
+  // left by its last pointer.
+  if (b.info->nodetype==BTREE_LEAF_NODE) { 
+    rc = b.GetPtr(0,ptr);
+    if (rc) { return rc; }
+    append = ptr==0;
+    return ERROR_NOERROR;
+  }
+  for (SIZE_T i=0;i+1<path.depth;i++) { 
+    BTreeNodeView upper;
+    rc = upper.Pin(buffercache,path.node[i]);
+    if (rc) { return rc; }
+    if (path.slot[i]!=upper.info->numkeys) { 
+      return ERROR_NOERROR;
+    }
+  }
+  append=true;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Split(BTreePath &path)
+{
+  ERROR_T rc;
+
+  // Keys are about to move between nodes
+  ForgetLastLeaf();
+
+  // Each pass splits the last node on the path and puts a pointer to
+  // the new half into its parent, going on up while that fills the
+  // parent too
+  while (path.depth>0) { 
+    SIZE_T orig_block_loc = path.node[path.depth-1];
+    ForgetModel(orig_block_loc);
+
+    // Pin node
+    BTreeNodeView orig_node;
+    rc = orig_node.Pin(buffercache,orig_block_loc);
+    if (rc) { return rc; }
+
+    if (!orig_node.IsFull()) { return ERROR_INSANE; }
+
+    // Keys going onto the end of the tree would leave every node they
+    // pass half empty, so the node keeps all it can
+    bool append=false;
+    if (appendsplits) { 
+      rc = IsAppend(path,orig_node,append);
+      if (rc) { return rc; }
+    }
+
+    if (!append && overflowpolicy==BTREE_OVERFLOW_SHARE && orig_node.info->nodetype!=BTREE_ROOT_NODE) { 
+      bool shared;
+      bool parentfull;
+      orig_node.Unpin();
+      rc = ShareOverflow(path,shared,parentfull);
+      if (rc) { return rc; }
+      if (shared) { 
+        if (!parentfull) { 
+          return ERROR_NOERROR;
+        }
+        path.depth--;
+        continue;
+      }
+      rc = orig_node.Pin(buffercache,orig_block_loc);
+      if (rc) { return rc; }
+    }
+
+    // New block location and the node in it
+    SIZE_T new_block_loc;
+    BTreeNodeView new_node;
+
+    // Key that is pushed up into the parent
+    KEY_T split_key;
+
+    rc = SplitNode(path,orig_node,append ? AppendSlot(orig_node) : orig_node.GetMiddleSlot(),
+		   new_block_loc,new_node,split_key);
+    if (rc) { return rc; }
+
+    //
+    // Different ending depending on ROOT_NODE vs INTERIOR NODE
+    if (orig_node.info->nodetype == BTREE_ROOT_NODE) {
+      // orig_node is now an interior node, so set it as such
+      orig_node.info->nodetype=BTREE_INTERIOR_NODE;
+
+      //
+      // We need to create a new root node, set the superblock to point at it, and insert both
+      // orig_node and new_node into it.
+      SIZE_T new_root_loc;
+      BTreeNodeView new_root;
+
+      // Allocate new root node
+      rc = AllocateNode(new_root_loc,new_root,BTREE_ROOT_NODE);
+      if (rc) { cout<<rc<<endl; return rc; }
+      new_root.info->numkeys=1;
+
+      // Set superblock to point to new_root
+      superblock.info.rootnode = new_root_loc;
+      rc = superblock.Serialize(buffercache,superblock_index);
+      if (rc) { return rc; }
+      // Every pinned node is a level further down now
+      UnpinUpperNodes();
+
+      // Must insert manually into new_root
+      //
+      // The split key is the first key in new_root
+      rc = new_root.SetKey(0,split_key);
+      if (rc) { return rc; }
+      // Insert pointers to orig_node and new_node
+      rc = new_root.SetPtr(0,orig_block_loc);
+      if (rc) { return rc; }
+      rc = new_root.SetPtr(1,new_block_loc);
+      if (rc) { return rc; }
+      rc = new_root.SetCount(0,orig_node.GetSubtreeCount());
+      if (rc) { return rc; }
+      rc = new_root.SetCount(1,new_node.GetSubtreeCount());
+      if (rc) { return rc; }
+
+      // The old root's messages are split between the halves
+      return RerouteMessages(new_root,0,1);
+    }
+
+    // The keys under the parent's pointer to orig_node are now split
+    // between the two
+    SIZE_T orig_count=orig_node.GetSubtreeCount();
+    SIZE_T new_count=new_node.GetSubtreeCount();
+    orig_node.Unpin();
+    new_node.Unpin();
+
+    // Only the root has no parent
+    if (path.depth<2) { return ERROR_INSANE; }
+    path.depth--;
+
+    // The parent's pointer to orig_node is at the slot we came down,
+    // so the pointer to new_node goes right after it, with split_key
+    // between them
+    BTreeNodeView parent;
+    rc = parent.Pin(buffercache,path.node[path.depth-1]);
+    if (rc) { return rc; }
+    ForgetModel(path.node[path.depth-1]);
+
+    // Check nodetype. If it isn't an interior node or the root node, error.
+    if (parent.info->nodetype != BTREE_INTERIOR_NODE && parent.info->nodetype != BTREE_ROOT_NODE) {
+      return ERROR_BADNODETYPE;
+    }
+
+    // split_key went in at the slot we came down, which is now where
+    // a key was last put into the parent
+    rc = PutInteriorSlot(parent,path.slot[path.depth-1],split_key,new_block_loc,new_count);
+    if (rc) { return rc; }
+    rc = parent.SetCount(path.slot[path.depth-1],orig_count);
+    if (rc) { return rc; }
+    rc = RerouteMessages(parent,path.slot[path.depth-1],path.slot[path.depth-1]+1);
+    if (rc) { return rc; }
+
+    if (!parent.IsFull()) { 
+      return ERROR_NOERROR;
+    }
+  }
+
+  // The path should never be empty
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::ShareOverflow(BTreePath &path, bool &shared, bool &parentfull)
+{
+  BTreeNodeView parent;
+  BTreeNodeView left;
+  BTreeNodeView middle;
+  BTreeNodeView right;
+  BTreeNodeView *sibling;
+  SIZE_T node=path.node[path.depth-1];
+  SIZE_T slot=path.slot[path.depth-2];
+  SIZE_T leftloc;
+  SIZE_T middleloc;
+  SIZE_T rightloc;
+  SIZE_T moved;
+  KEY_T separator;
+  KEY_T split_key;
+  ERROR_T rc;
+
+  shared=false;
+  parentfull=false;
+
+  if (path.depth<2) { return ERROR_INSANE; }
+
+  rc = parent.Pin(buffercache,path.node[path.depth-2]);
+  if (rc) { return rc; }
+  rc = left.Pin(buffercache,node);
+  if (rc) { return rc; }
+
+  // Sharing can lengthen two separators in the parent and add three
+  // slots to it.  A three way split leaves each node about two thirds
+  // full, which only keeps it clear of full if it holds a good number
+  // of its largest slots.
+  if (!HasRoomForSlots(parent,5) ||
+      left.GetFreeBytes()+left.GetUsedBytes() < 8*LargestSlot(left) ||
+      (left.info->nodetype!=BTREE_LEAF_NODE && left.info->numkeys<3)) { 
+    return ERROR_NOERROR;
+  }
+
+  // Pair the node with whichever sibling has more room
+  bool toright=slot<parent.info->numkeys;
+
+  if (toright && slot>0) { 
+    rc = parent.GetPtr(slot+1,rightloc);
+    if (rc) { return rc; }
+    rc = right.Pin(buffercache,rightloc);
+    if (rc) { return rc; }
+    rc = parent.GetPtr(slot-1,leftloc);
+    if (rc) { return rc; }
+    rc = left.Pin(buffercache,leftloc);
+    if (rc) { return rc; }
+    toright=right.GetFreeBytes()>=left.GetFreeBytes();
+  }
+  if (!toright) { 
+    slot--;
+  }
+  rc = parent.GetPtr(slot,leftloc);
+  if (rc) { return rc; }
+  rc = parent.GetPtr(slot+1,rightloc);
+  if (rc) { return rc; }
+  rc = left.Pin(buffercache,leftloc);
+  if (rc) { return rc; }
+  rc = right.Pin(buffercache,rightloc);
+  if (rc) { return rc; }
+  sibling = leftloc==node ? &right : &left;
+  ForgetModel(path.node[path.depth-2]);
+  ForgetModel(leftloc);
+  ForgetModel(rightloc);
+
+  rc = parent.GetKey(slot,separator);
+  if (rc) { return rc; }
+
+  // Pointers slot..slot+1 of the parent, and any it gains, have keys
+  // moved under them
+  SIZE_T numkeys=parent.info->numkeys;
+
+  if (HasRoomForSlots(*sibling,2)) { 
+    // Even the pair out
+    rc = Redistribute(left,right,separator,moved);
+    if (rc) { return rc; }
+    if (moved>0) { 
+      rc = parent.SetKey(slot,separator);
+      if (rc) { return rc; }
+    }
+    if (!left.IsFull() && !right.IsFull()) { 
+      shared=true;
+      parentfull=parent.IsFull();
+      rc = RerouteMessages(parent,slot,slot+1);
+      if (rc) { return rc; }
+      return RecountSlots(parent,slot,slot+1);
+    }
+  }
+
+  // Split the pair three ways.  A third of it stays in left, and the
+  // rest of left goes to a new node between them...
+  BTreePath leftpath=path;
+  leftpath.node[leftpath.depth-1]=leftloc;
+  leftpath.slot[leftpath.depth-2]=slot;
+
+  rc = SplitNode(leftpath,left,SlotAtBytes(left,(left.GetUsedBytes()+right.GetUsedBytes())/3),
+		 middleloc,middle,split_key);
+  if (rc) { return rc; }
+  rc = PutInteriorSlot(parent,slot,split_key,middleloc,0);
+  if (rc) { return rc; }
+
+  // ...which then evens out with right
+  rc = parent.GetKey(slot+1,separator);
+  if (rc) { return rc; }
+  rc = Redistribute(middle,right,separator,moved);
+  if (rc) { return rc; }
+  if (moved>0) { 
+    rc = parent.SetKey(slot+1,separator);
+    if (rc) { return rc; }
+  }
+
+  // A node whose prefix was cut back to share slots can still be
+  // full; split any that are as usual, from the right so the parent
+  // slots of the others stay put
+  BTreeNodeView *nodes[3] = {&left, &middle, &right};
+  for (int i=2;i>=0;i--) { 
+    if (!nodes[i]->IsFull()) { 
+      continue;
+    }
+    SIZE_T newloc;
+    BTreeNodeView newnode;
+    BTreePath nodepath=path;
+    nodepath.node[nodepath.depth-1]=nodes[i]->GetBlockNum();
+    nodepath.slot[nodepath.depth-2]=slot+i;
+
+    rc = SplitNode(nodepath,*nodes[i],nodes[i]->GetMiddleSlot(),newloc,newnode,split_key);
+    if (rc) { return rc; }
+    rc = PutInteriorSlot(parent,slot+i,split_key,newloc,0);
+    if (rc) { return rc; }
+  }
+
+  shared=true;
+  parentfull=parent.IsFull();
+  rc = RerouteMessages(parent,slot,slot+1+parent.info->numkeys-numkeys);
+  if (rc) { return rc; }
+  return RecountSlots(parent,slot,slot+1+parent.info->numkeys-numkeys);
+}
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  BTreeNodeView b;
+  BTreePath path;
+  ERROR_T rc;
+
+  if (!LengthFits(key.length,superblock.info.keysize,superblock.info.format) ||
+      !LengthFits(value.length,superblock.info.valuesize,superblock.info.format)) { 
+    return ERROR_SIZE;
+  }
+  if (Buffering()) { 
+    // The key is only read for the result
+    VALUE_T v;
+    rc = Lookup(key,v);
+    if (rc!=ERROR_NONEXISTENT) { 
+      return rc ? rc : ERROR_CONFLICT;
+    }
+    return PutMessage(key,BTreeMessage(value));
+  }
+
+  rc = FindInsertLeaf(key,b,path);
+  if (rc==ERROR_NONEXISTENT) { 
+    // Special case where rootnode is empty
+    VALUE_T list;
+    return InsertFirst(key,IsUnique() ? value : MakePosting(value,superblock.info.format,list));
+  }
+  if (rc) { return rc; }
+  return LeafNodeInsert(path,b,key,value);
+}
+
+
+ERROR_T BTreeIndex::Upsert(const KEY_T &key, const VALUE_T &value)
+{
+  BTreeNodeView b;
+  BTreePath path;
+  VALUE_T list;
+  ERROR_T rc;
+  SIZE_T offset;
+  bool found;
+
+  if (!LengthFits(key.length,superblock.info.keysize,superblock.info.format) ||
+      !LengthFits(value.length,superblock.info.valuesize,superblock.info.format)) { 
+    return ERROR_SIZE;
+  }
+  if (Buffering()) { 
+    // Whatever is there, the message replaces it
+    return PutMessage(key,BTreeMessage(value));
+  }
+
+  rc = FindInsertLeaf(key,b,path);
+  if (rc==ERROR_NONEXISTENT) { 
+    return InsertFirst(key,IsUnique() ? value : MakePosting(value,superblock.info.format,list));
+  }
+  if (rc) { return rc; }
+
+  offset=SearchNode(b,key,found);
+  if (!found) { 
+    return LeafInsertAt(path,b,offset,key,IsUnique() ? value : MakePosting(value,superblock.info.format,list));
+  }
+
+  // As in Update
+  rc = SetLeafValue(b,offset,value);
+  if (rc) { return rc; }
+  if (b.IsFull()) { 
+    b.Unpin();
+    return Split(path);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FindInsertLeaf(const KEY_T &key, BTreeNodeView &leaf, BTreePath &path)
+{
+  ERROR_T rc;
+
+  // Keys arriving in order mostly go to the leaf the last one did,
+  // which needs no descent to find
+  if (lastleaf && (lastlo.length==0 || CompareKeys(key,lastlo)>=0) &&
+      (lasthi.length==0 || CompareKeys(key,lasthi)<0)) { 
+    path=lastpath;
+    return leaf.Pin(buffercache,lastleaf);
+  }
+
+  ForgetLastLeaf();
+  lastlo.Resize(0);
+  lasthi.Resize(0);
+  rc = FindLeaf(key,leaf,path,&lasthi,&lastlo);
+  if (rc) { return rc; }
+
+  // A split forgets this again
+  lastleaf=path.node[path.depth-1];
+  lastpath=path;
+  return ERROR_NOERROR;
+}
+
+// Orders a batch by key, and equal keys by where they are in the batch
+struct BatchOrder {
+  const vector<KeyValuePair> &pairs;
+
+  BatchOrder(const vector<KeyValuePair> &pairs) : pairs(pairs) {}
+
+  bool operator()(const SIZE_T a, const SIZE_T b) const {
+    int cmp=CompareKeys(pairs[a].key,pairs[b].key);
+    return cmp<0 || (cmp==0 && a<b);
+  }
+};
+
+
+ERROR_T BTreeIndex::InsertBatch(const vector<KeyValuePair> &pairs)
+{
+  vector<SIZE_T> order;
+  BTreeNodeView b;
+  bool conflict=false;
+  ERROR_T rc;
+
+  for (SIZE_T i=0;i<pairs.size();i++) { 
+    if (!LengthFits(pairs[i].key.length,superblock.info.keysize,superblock.info.format) ||
+	!LengthFits(pairs[i].value.length,superblock.info.valuesize,superblock.info.format)) { 
+      return ERROR_SIZE;
+    }
+    order.push_back(i);
+  }
+  sort(order.begin(),order.end(),BatchOrder(pairs));
+
+  // The batch goes straight to the leaves, which must be up to date
+  rc = FlushMessages();
+  if (rc) { return rc; }
+
+  if (!IsUnique()) { 
+    // Values join posting lists one at a time
+    for (SIZE_T j=0;j<order.size();j++) { 
+      rc = Insert(pairs[order[j]].key,pairs[order[j]].value);
+      if (rc) { return rc; }
+    }
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T i=0;
+  while (i<order.size()) { 
+    const KeyValuePair &p=pairs[order[i]];
+    BTreePath path;
+    KEY_T hi;
+
+    // Walk down to the leaf for the next key, narrowing hi to the
+    // separator right of each child taken
+    rc = FindLeaf(p.key,b,path,&hi);
+    if (rc==ERROR_NONEXISTENT) { 
+      // The first key builds the first two leaves
+      rc = InsertFirst(p.key,p.value);
+      if (rc) { return rc; }
+      i++;
+      continue;
+    }
+    if (rc) { return rc; }
+
+    // A separator is above some key, so is never empty; hi is only
+    // empty if the leaf is the last one
+    SIZE_T numkeys=b.info->numkeys;
+    SIZE_T from=i;
+    rc = LeafMergeBatch(b,pairs,order,i,hi.length>0 ? &hi : 0,i,conflict);
+    if (rc) { return rc; }
+    // Skipped keys are in the leaf already, so can go in the filters too
+    for (SIZE_T k=from;k<i;k++) { 
+      FilterInsert(b.GetBlockNum(),pairs[order[k]].key);
+    }
+    rc = AdjustCounts(path,b.info->numkeys-numkeys);
+    if (rc) { return rc; }
+
+    if (b.IsFull()) { 
+      // If the batch ran on past the leaf's old last key, its last key
+      // is the one to split after
+      SIZE_T n=b.info->numkeys;
+      if (i>0 && b.CompareKey(n-1,pairs[order[i-1]].key)==0) { 
+	path.slot[path.depth-1]=n-1;
+      }
+      // Whatever didn't fit goes in after the split
+      b.Unpin();
+      rc = Split(path);
+      if (rc) { return rc; }
+    }
+  }
+
+  return conflict ? ERROR_CONFLICT : ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::LeafMergeBatch(BTreeNodeView &b, const vector<KeyValuePair> &pairs,
+				   const vector<SIZE_T> &order, const SIZE_T first,
+				   const KEY_T *hi, SIZE_T &next, bool &conflict)
+{
+  ERROR_T rc=ERROR_NOERROR;
+  SIZE_T offset;
+  SIZE_T k;
+  bool found;
+
+  // Build the merged leaf in a copy that keeps b's leaf chain link
+  // and prefix but none of its slots
+  NodeMetadata info=*b.info;
+  SIZE_T databytes=info.GetNumDataBytes();
+  char *data=new char [databytes];
+  memcpy(data,b.data,databytes);
+  info.numkeys=0;
+  info.heapbytes=0;
+  BTreeNodeView m(&info,data);
+
+  SIZE_T from=0;                      // b's slots before this are in m
+  SIZE_T oldbytes=b.GetUsedBytes();   // and these are the bytes of the rest
+
+  for (k=first;k<order.size();k++) { 
+    const KeyValuePair &p=pairs[order[k]];
+
+    if (hi && CompareKeys(p.key,*hi)>=0) { 
+      // This one and the rest belong to later leaves
+      break;
+    }
+    if (k>0 && CompareKeys(p.key,pairs[order[k-1]].key)==0) { 
+      conflict=true;
+      continue;
+    }
+
+    offset=SearchNode(b,p.key,found);
+    for (SIZE_T s=from;s<offset;s++) { 
+      oldbytes-=b.GetSlotBytes(s);
+    }
+    rc = m.AppendSlots(b,from,offset-from);
+    if (rc) { break; }
+    from=offset;
+    if (found) { 
+      conflict=true;
+      continue;
+    }
+
+    // Leave room for the rest of b's slots
+    SIZE_T bytes=m.GetSlotSize()+(m.IsSlotted() ? p.key.length-info.prefixlen+p.value.length : 0);
+    if (m.GetFreeBytes()<bytes+oldbytes) { 
+      break;
+    }
+    rc = PutLeafSlot(m,info.numkeys,p.key,p.value);
+    if (rc) { break; }
+  }
+  next=k;
+
+  if (!rc) { 
+    rc = m.AppendSlots(b,from,b.info->numkeys-from);
+  }
+  if (!rc) { 
+    *b.info=info;
+    memcpy(b.data,data,databytes);
+    b.MarkDirty();
+  }
+  delete [] data;
+
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  if (!LengthFits(key.length,superblock.info.keysize,superblock.info.format) ||
+      !LengthFits(value.length,superblock.info.valuesize,superblock.info.format)) { 
+    return ERROR_SIZE;
+  }
+  if (Buffering()) { 
+    VALUE_T v;
+    ERROR_T rc = Lookup(key,v);
+    if (rc) { return rc; }
+    return PutMessage(key,BTreeMessage(value));
+  }
+  // An update only reads the value, so no copy is needed
+  return LookupOrUpdateInternal(BTREE_OP_UPDATE, key, const_cast<VALUE_T &>(value));
+}
+
+
+  
+ERROR_T BTreeIndex::Delete(const KEY_T &key)
+{
+  BTreeNodeView b;
+  BTreePath path;
+  SIZE_T offset;
+  bool found;
+  ERROR_T rc;
+
+  if (!LengthFits(key.length,superblock.info.keysize,superblock.info.format)) { 
+    return ERROR_SIZE;
+  }
+  if (Buffering()) { 
+    VALUE_T v;
+    rc = Lookup(key,v);
+    if (rc) { return rc; }
+    return PutMessage(key,BTreeMessage());
+  }
+
+  // Walk down to the leaf, remembering the way for Rebalance
+  rc = FindLeaf(key,b,path);
+  if (rc) { return rc; }
+
+  offset=SearchNode(b,key,found);
+  if (!found) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (!IsUnique()) { 
+    // All of the key's values go, posting blocks and all
+    VALUE_T list;
+    rc = b.GetVal(offset,list);
+    if (rc) { return rc; }
+    rc = FreePostings(list);
+    if (rc) { return rc; }
+  }
+  rc = b.RemoveSlot(offset);
+  if (rc) { return rc; }
+  b.Unpin();
+
+  rc = AdjustCounts(path,-1);
+  if (rc) { return rc; }
+  return Rebalance(path);
+}
+
+
+ERROR_T BTreeIndex::Delete(const KEY_T &key, const VALUE_T &value)
+{
+  BTreeNodeView b;
+  BTreePath path;
+  VALUE_T v;
+  SIZE_T offset;
+  bool found;
+  ERROR_T rc;
+
+  if (!LengthFits(key.length,superblock.info.keysize,superblock.info.format) ||
+      !LengthFits(value.length,superblock.info.valuesize,superblock.info.format)) { 
+    return ERROR_SIZE;
+  }
+  if (Buffering()) { 
+    rc = Lookup(key,v);
+    if (rc) { return rc; }
+    if (CompareKeys(v,value)) { 
+      return ERROR_NONEXISTENT;
+    }
+    return PutMessage(key,BTreeMessage());
+  }
+
+  rc = FindLeaf(key,b,path);
+  if (rc) { return rc; }
+
+  offset=SearchNode(b,key,found);
+  if (!found) { 
+    return ERROR_NONEXISTENT;
+  }
+  SIZE_T numkeys=b.info->numkeys;
+  if (IsUnique()) { 
+    rc = b.GetVal(offset,v);
+    if (rc) { return rc; }
+    if (CompareKeys(v,value)) { 
+      return ERROR_NONEXISTENT;
+    }
+    rc = b.RemoveSlot(offset);
+  } else {
+    rc = RemovePosting(b,offset,value);
+  }
+  if (rc) { return rc; }
+  rc = AdjustCounts(path,b.info->numkeys-numkeys);
+  if (rc) { return rc; }
+  b.Unpin();
+
+  // The leaf is smaller whether or not the key went
+  return Rebalance(path);
+}
+
+
+ERROR_T BTreeIndex::LookupAll(const KEY_T &key, BTreePostingCursor &cursor)
+{
+  BTreeNodeView b;
+  BTreePath path;
+  VALUE_T list;
+  SIZE_T offset;
+  bool found;
+  bool maybe;
+  ERROR_T rc;
+
+  cursor.Close();
+
+  if (!LengthFits(key.length,superblock.info.keysize,superblock.info.format)) { 
+    return ERROR_SIZE;
+  }
+  rc = FlushMessages();
+  if (rc) { return rc; }
+
+  rc = IndexMayContain(key,maybe);
+  if (rc) { return rc; }
+  if (!maybe) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  rc = FindLeaf(key,b,path);
+  if (rc) { return rc; }
+
+  rc = LeafMayContain(b,key,maybe);
+  if (rc) { return rc; }
+  if (!maybe) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  offset=SearchNode(b,key,found);
+  if (!found) { 
+    return ERROR_NONEXISTENT;
+  }
+  rc = b.GetVal(offset,list);
+  if (rc) { return rc; }
+  // The cursor has its own copy of an inline list, and pins posting
+  // blocks itself
+  return cursor.Open(buffercache,*b.info,list);
+}
+
+
+
+//
+// Order statistics
+//
+
+ERROR_T BTreeIndex::AdjustCounts(const BTreePath &path, const int delta)
+{
+  BTreeNodeView b;
+  SIZE_T count;
+  ERROR_T rc;
+
+  if (!(superblock.info.format & BTREE_FORMAT_COUNTED) || delta==0) { 
+    return ERROR_NOERROR;
+  }
+  // Every level above the leaf
+  for (SIZE_T d=0;d+1<path.depth;d++) { 
+    rc = b.Pin(buffercache,path.node[d]);
+    if (rc) { return rc; }
+    rc = b.GetCount(path.slot[d],count);
+    if (rc) { return rc; }
+    rc = b.SetCount(path.slot[d],count+delta);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::RecountSlots(BTreeNodeView &parent, const SIZE_T from, const SIZE_T to)
+{
+  BTreeNodeView child;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  if (!(superblock.info.format & BTREE_FORMAT_COUNTED)) { 
+    return ERROR_NOERROR;
+  }
+  for (SIZE_T i=from;i<=to && i<=parent.info->numkeys;i++) { 
+    rc = parent.GetPtr(i,ptr);
+    if (rc) { return rc; }
+    rc = child.Pin(buffercache,ptr);
+    if (rc) { return rc; }
+    rc = parent.SetCount(i,child.GetSubtreeCount());
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::RankInternal(const KEY_T &key, SIZE_T &rank)
+{
+  BTreeNodeView b;
+  SIZE_T node=superblock.info.rootnode;
+  SIZE_T offset;
+  SIZE_T count;
+  bool found;
+  ERROR_T rc;
+
+  rank=0;
+  for (SIZE_T depth=0;depth<BTREE_MAX_DEPTH;depth++) { 
+    rc = b.Pin(buffercache,node);
+    if (rc) { return rc; }
+    if (b.info->nodetype==BTREE_LEAF_NODE) { 
+      rank+=SearchNode(b,key,found);
+      return ERROR_NOERROR;
+    }
+    if (b.info->numkeys==0) { 
+      // Empty tree
+      return ERROR_NOERROR;
+    }
+    // Everything under the pointers left of the one taken is below key
+    offset=SearchNode(b,key,found,node)+found;
+    for (SIZE_T i=0;i<offset;i++) { 
+      rc = b.GetCount(i,count);
+      if (rc) { return rc; }
+      rank+=count;
+    }
+    rc = b.GetPtr(offset,node);
+    if (rc) { return rc; }
+  }
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::Rank(const KEY_T &key, SIZE_T &rank)
+{
+  rank=0;
+  if (!(superblock.info.format & BTREE_FORMAT_COUNTED)) { 
+    return ERROR_BADCONFIG;
+  }
+  // The counts are of the keys in the leaves
+  ERROR_T rc = FlushMessages();
+  if (rc) { return rc; }
+  if (key.length==0) { 
+    return ERROR_NOERROR;
+  }
+  if (!LengthFits(key.length,superblock.info.keysize,superblock.info.format)) { 
+    return ERROR_SIZE;
+  }
+  return RankInternal(key,rank);
+}
+
+
+ERROR_T BTreeIndex::Select(const SIZE_T k, KEY_T &key, VALUE_T &value)
+{
+  BTreeNodeView b;
+  SIZE_T node=superblock.info.rootnode;
+  SIZE_T left=k;
+  SIZE_T count;
+  SIZE_T i;
+  ERROR_T rc;
+
+  if (!(superblock.info.format & BTREE_FORMAT_COUNTED)) { 
+    return ERROR_BADCONFIG;
+  }
+  rc = FlushMessages();
+  if (rc) { return rc; }
+
+  for (SIZE_T depth=0;depth<BTREE_MAX_DEPTH;depth++) { 
+    rc = b.Pin(buffercache,node);
+    if (rc) { return rc; }
+    if (b.info->nodetype==BTREE_LEAF_NODE) { 
+      if (left>=b.info->numkeys) { 
+	return ERROR_INSANE;
+      }
+      rc = b.GetKey(left,key);
+      if (rc) { return rc; }
+      return GetLeafValue(b,left,value);
+    }
+    // Skip whole subtrees until the one holding rank left
+    for (i=0;i<=b.info->numkeys && b.info->numkeys>0;i++) { 
+      rc = b.GetCount(i,count);
+      if (rc) { return rc; }
+      if (left<count) { 
+	break;
+      }
+      left-=count;
+    }
+    if (b.info->numkeys==0 || i>b.info->numkeys) { 
+      return ERROR_NONEXISTENT;
+    }
+    rc = b.GetPtr(i,node);
+    if (rc) { return rc; }
+  }
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::CountRange(const KEY_T &lo, const KEY_T &hi, SIZE_T &count)
+{
+  BTreeNodeView root;
+  SIZE_T below;
+  SIZE_T upto;
+  ERROR_T rc;
+
+  count=0;
+  if (!(superblock.info.format & BTREE_FORMAT_COUNTED)) { 
+    return ERROR_BADCONFIG;
+  }
+  if ((lo.length>0 && !LengthFits(lo.length,superblock.info.keysize,superblock.info.format)) ||
+      (hi.length>0 && !LengthFits(hi.length,superblock.info.keysize,superblock.info.format))) { 
+    return ERROR_SIZE;
+  }
+
+  rc = Rank(lo,below);
+  if (rc) { return rc; }
+  if (hi.length>0) { 
+    rc = RankInternal(hi,upto);
+    if (rc) { return rc; }
+  } else {
+    // Up to the last key, which the root counts
+    rc = root.Pin(buffercache,superblock.info.rootnode);
+    if (rc) { return rc; }
+    upto=root.GetSubtreeCount();
+  }
+  count = upto>below ? upto-below : 0;
+  return ERROR_NOERROR;
+}
+
+
+
+//
+// Bloom filters
+//
+
+BTreeBloomFilter::BTreeBloomFilter() : numbits(0), numhashes(0), capacity(0), count(0)
+{}
+
+
+BTreeBloomFilter::BTreeBloomFilter(const SIZE_T cap, const SIZE_T bitsperkey) : 
+  capacity(cap), count(0)
+{
+  // About ln 2 probes per bit per key is best, and more than a dozen
+  // don't pay
+  numbits=capacity*bitsperkey;
+  if (numbits<64) { 
+    numbits=64;
+  }
+  numhashes=(bitsperkey*69+50)/100;
+  numhashes=numhashes<1 ? 1 : numhashes>12 ? 12 : numhashes;
+  bits.assign((numbits+31)/32,0);
+}
+
+
+// 64 bit FNV-1a of the key, split into the two hashes that the probes
+// are made from
+static void HashKey(const KEY_T &key, unsigned int &h1, unsigned int &h2)
+{
+  unsigned long long h=14695981039346656037ULL;
+
+  for (SIZE_T i=0;i<key.length;i++) { 
+    h^=(unsigned char)key.data[i];
+    h*=1099511628211ULL;
+  }
+  h1=(unsigned int)h;
+  h2=(unsigned int)(h>>32) | 1;
+}
+
+
+void BTreeBloomFilter::Add(const KEY_T &key)
+{
+  unsigned int h1, h2;
+
+  if (numbits==0) { 
+    return;
+  }
+  HashKey(key,h1,h2);
+  for (SIZE_T i=0;i<numhashes;i++) { 
+    SIZE_T bit=(h1+i*h2)%numbits;
+    bits[bit/32]|=1u<<(bit%32);
+  }
+  count++;
+}
+
+
+bool BTreeBloomFilter::MayContain(const KEY_T &key) const
+{
+  unsigned int h1, h2;
+
+  if (numbits==0) { 
+    return true;
+  }
+  HashKey(key,h1,h2);
+  for (SIZE_T i=0;i<numhashes;i++) { 
+    SIZE_T bit=(h1+i*h2)%numbits;
+    if (!(bits[bit/32] & (1u<<(bit%32)))) { 
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void BTreeIndex::SetBloomFilters(const SIZE_T bitsperkey)
+{
+  ForgetFilters();
+  bloombits=bitsperkey;
+}
+
+
+void BTreeIndex::ForgetFilters()
+{
+  indexfilter=BTreeBloomFilter();
+  indexfiltered=false;
+  leaffilters.clear();
+}
+
+
+ERROR_T BTreeIndex::IndexMayContain(const KEY_T &key, bool &maybe)
+{
+  ERROR_T rc;
+
+  maybe=true;
+  if (!bloombits) { 
+    return ERROR_NOERROR;
+  }
+  if (!indexfiltered) { 
+    rc = FilterIndex();
+    if (rc) { return rc; }
+  }
+  maybe=indexfilter.MayContain(key);
+  if (!maybe) { 
+    filteredlookups++;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::LeafMayContain(const BTreeNodeView &b, const KEY_T &key, bool &maybe)
+{
+  map<SIZE_T, BTreeBloomFilter>::const_iterator f;
+  ERROR_T rc;
+
+  maybe=true;
+  if (!bloombits) { 
+    return ERROR_NOERROR;
+  }
+  f=leaffilters.find(b.GetBlockNum());
+  if (f==leaffilters.end()) { 
+    // The leaf has just been read, so its filter costs no more reads
+    rc = FilterLeaf(b);
+    if (rc) { return rc; }
+    f=leaffilters.find(b.GetBlockNum());
+  }
+  maybe=(*f).second.MayContain(key);
+  if (!maybe) { 
+    filteredlookups++;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FilterIndex()
+{
+  BTreeNodeView leaf;
+  BTreePath path;
+  vector<KEY_T> keys;
+  KEY_T key;
+  SIZE_T next;
+  ERROR_T rc;
+
+  // Walk the leaf chain from the first leaf, filtering each leaf on
+  // the way since it is being read anyway
+  rc = FindLeaf(KEY_T(),leaf,path);
+  if (rc && rc!=ERROR_NONEXISTENT) { return rc; }
+  while (leaf.IsPinned()) { 
+    for (SIZE_T i=0;i<leaf.info->numkeys;i++) { 
+      rc = leaf.GetKey(i,key);
+      if (rc) { return rc; }
+      keys.push_back(key);
+    }
+    if (!leaffilters.count(leaf.GetBlockNum())) { 
+      rc = FilterLeaf(leaf);
+      if (rc) { return rc; }
+    }
+    rc = leaf.GetPtr(0,next);
+    if (rc) { return rc; }
+    if (next==0) { 
+      break;
+    }
+    rc = leaf.Pin(buffercache,next);
+    if (rc) { return rc; }
+  }
+
+  // Room for the index to double before it is read again
+  indexfilter=BTreeBloomFilter(2*keys.size()>1024 ? 2*keys.size() : 1024,bloombits);
+  for (SIZE_T i=0;i<keys.size();i++) { 
+    indexfilter.Add(keys[i]);
+  }
+  indexfiltered=true;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FilterLeaf(const BTreeNodeView &b)
+{
+  KEY_T key;
+  ERROR_T rc;
+
+  if (!bloombits) { 
+    return ERROR_NOERROR;
+  }
+  // Room for the leaf to double.  One that outgrows it is dropped,
+  // and built again when the leaf is next read.
+  BTreeBloomFilter &f=leaffilters[b.GetBlockNum()];
+  f=BTreeBloomFilter(2*b.info->numkeys>16 ? 2*b.info->numkeys : 16,bloombits);
+  for (SIZE_T i=0;i<b.info->numkeys;i++) { 
+    rc = b.GetKey(i,key);
+    if (rc) { 
+      leaffilters.erase(b.GetBlockNum());
+      return rc;
+    }
+    f.Add(key);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::RefilterLeaf(const BTreeNodeView &b)
+{
+  if (!leaffilters.count(b.GetBlockNum())) { 
+    return ERROR_NOERROR;
+  }
+  return FilterLeaf(b);
+}
+
+
+void BTreeIndex::FilterInsert(const SIZE_T node, const KEY_T &key)
+{
+  map<SIZE_T, BTreeBloomFilter>::iterator f;
+
+  if (!bloombits) { 
+    return;
+  }
+  if (indexfiltered) { 
+    indexfilter.Add(key);
+    if (indexfilter.IsFull()) { 
+      // Built again, bigger, by the next lookup
+      indexfilter=BTreeBloomFilter();
+      indexfiltered=false;
+    }
+  }
+  f=leaffilters.find(node);
+  if (f!=leaffilters.end()) { 
+    (*f).second.Add(key);
+    if ((*f).second.IsFull()) { 
+      leaffilters.erase(f);
+    }
+  }
+}
+
+
+
+//
+// Learned models
+//
+
+BTreeNodeModel::BTreeNodeModel() : first(0), last(0), slope(0), intercept(0), error(0),
+				   numkeys(0), stale(false)
+{}
+
+
+// Nodes with fewer keys than this are searched whole
+static const SIZE_T MODEL_MIN_KEYS=16;
+
+
+ERROR_T BTreeNodeModel::Train(const BTreeNodeView &b)
+{
+  vector<KEY_T> keys;
+  ERROR_T rc;
+
+  // Until there is a line that fits, the window is the whole node
+  numkeys=b.info->numkeys;
+  stale=false;
+  slope=0;
+  intercept=0;
+  error=numkeys;
+  lead.Resize(0);
+  first=last=0;
+
+  if (numkeys<MODEL_MIN_KEYS) { 
+    return ERROR_NOERROR;
+  }
+  keys.resize(numkeys);
+  for (SIZE_T i=0;i<numkeys;i++) { 
+    rc = b.GetKey(i,keys[i]);
+    if (rc) { return rc; }
+  }
+
+  // Whatever the first and last keys share begins every key between,
+  // and the bytes after it place a key along the line
+  const KEY_T &lo=keys[0];
+  const KEY_T &hi=keys[numkeys-1];
+  SIZE_T leadlen=0;
+  while (leadlen<lo.length && leadlen<hi.length && lo.data[leadlen]==hi.data[leadlen]) { 
+    leadlen++;
+  }
+  unsigned long long x0=KeyBits((const char *)lo.data,lo.length,leadlen);
+  unsigned long long x1=KeyBits((const char *)hi.data,hi.length,leadlen);
+  if (x1<=x0) { 
+    return ERROR_NOERROR;
+  }
+
+  // Least squares fit of slot against position between the ends
+  vector<double> u(numkeys);
+  double su=0, ss=0, suu=0, sus=0;
+  for (SIZE_T i=0;i<numkeys;i++) { 
+    unsigned long long x=KeyBits((const char *)keys[i].data,keys[i].length,leadlen);
+    u[i]=(double)(x-x0)/(double)(x1-x0);
+    su+=u[i];
+    ss+=i;
+    suu+=u[i]*u[i];
+    sus+=u[i]*i;
+  }
+  double n=numkeys;
+  double d=n*suu-su*su;
+  if (d<=0) { 
+    return ERROR_NOERROR;
+  }
+  double a=(n*sus-su*ss)/d;
+  double c=(ss-a*su)/n;
+
+  // The error bound is the furthest any key is from its prediction
+  double worst=0;
+  for (SIZE_T i=0;i<numkeys;i++) { 
+    double miss=a*u[i]+c-i;
+    worst=max(worst,miss<0 ? -miss : miss);
+  }
+  if (worst+2>=n) { 
+    return ERROR_NOERROR;
+  }
+  rc = lead.Resize(leadlen,false);
+  if (rc) { return rc; }
+  memcpy(lead.data,lo.data,leadlen);
+  first=x0;
+  last=x1;
+  slope=a;
+  intercept=c;
+  error=(SIZE_T)worst+1;
+  return ERROR_NOERROR;
+}
+
+
+void BTreeNodeModel::Predict(const KEY_T &key, SIZE_T &from, SIZE_T &to) const
+{
+  double u;
+
+  from=0;
+  to=numkeys;
+  if (error>=numkeys) { 
+    return;
+  }
+
+  // A key without the lead is below or above the whole node, as is
+  // one past the first or last key
+  int cmp=memcmp(key.data,lead.data,min(key.length,lead.length));
+  if (cmp<0 || (cmp==0 && key.length<lead.length)) { 
+    u=0;
+  } else if (cmp>0) { 
+    u=1;
+  } else {
+    unsigned long long x=KeyBits((const char *)key.data,key.length,lead.length);
+    u = x<=first ? 0 : x>=last ? 1 : (double)(x-first)/(double)(last-first);
+  }
+
+  // The window is error either side of the prediction, rounded out
+  double p=slope*u+intercept;
+  double lo=floor(p)-error;
+  double hi=ceil(p)+error+1;
+  if (lo>0) { 
+    from = lo<numkeys ? (SIZE_T)lo : numkeys;
+  }
+  if (hi<numkeys) { 
+    to = hi>from ? (SIZE_T)hi : from;
+  }
+}
+
+
+void BTreeIndex::SetLearnedModels(const bool on)
+{
+  models.clear();
+  learned=on;
+}
+
+
+void BTreeIndex::ForgetModel(const SIZE_T node)
+{
+  map<SIZE_T, BTreeNodeModel>::iterator m=models.find(node);
+
+  if (m!=models.end()) { 
+    (*m).second.stale=true;
+  }
+}
+
+
+ERROR_T BTreeIndex::TrainModels()
+{
+  vector<SIZE_T> todo;
+  BTreeNodeView b;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  if (!learned) { 
+    return ERROR_NOERROR;
+  }
+
+  // Every interior node with a missing or stale model, from the root
+  // down
+  todo.push_back(superblock.info.rootnode);
+  while (!todo.empty()) { 
+    SIZE_T node=todo.back();
+    todo.pop_back();
+
+    rc = b.Pin(buffercache,node);
+    if (rc) { return rc; }
+    if (b.info->nodetype==BTREE_LEAF_NODE || b.info->numkeys==0) { 
+      continue;
+    }
+    map<SIZE_T, BTreeNodeModel>::iterator m=models.find(node);
+    if (m==models.end() || (*m).second.stale || (*m).second.numkeys!=b.info->numkeys) { 
+      rc = models[node].Train(b);
+      if (rc) { 
+        models.erase(node);
+        return rc;
+      }
+    }
+    for (SIZE_T i=0;i<=b.info->numkeys;i++) { 
+      rc = b.GetPtr(i,ptr);
+      if (rc) { return rc; }
+      todo.push_back(ptr);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+
+//
+// Message buffers
+//
+
+bool BTreeKeyLess::operator()(const KEY_T &a, const KEY_T &b) const
+{
+  return CompareKeys(a,b)<0;
+}
+
+
+// What a message takes up in a buffer: its key and value, and the
+// length of the value
+static SIZE_T MessageBytes(const KEY_T &key, const BTreeMessage &message)
+{
+  return key.length+message.value.length+sizeof(SIZE_T);
+}
+
+
+ERROR_T BTreeIndex::SetMessageBuffers(const SIZE_T bytes)
+{
+  ERROR_T rc;
+
+  if (bytes>0 && !IsUnique()) { 
+    return ERROR_BADCONFIG;
+  }
+  rc = FlushMessages();
+  if (rc) { return rc; }
+  bufferbytes=bytes;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FindMessage(const KEY_T &key, BTreeMessage &message, bool &found)
+{
+  BTreeNodeView b;
+  SIZE_T node=superblock.info.rootnode;
+  SIZE_T offset;
+  ERROR_T rc;
+
+  // Messages higher up are newer, so the first one on the way down is
+  // the one that counts
+  found=false;
+  for (SIZE_T depth=0;depth<BTREE_MAX_DEPTH;depth++) { 
+    map<SIZE_T, BTreeMessageBuffer>::const_iterator buf=buffers.find(node);
+    if (buf!=buffers.end()) { 
+      BTreeMessages::const_iterator m=(*buf).second.messages.find(key);
+      if (m!=(*buf).second.messages.end()) { 
+	message=(*m).second;
+	found=true;
+	return ERROR_NOERROR;
+      }
+    }
+    rc = b.Pin(buffercache,node);
+    if (rc) { return rc; }
+    if (b.info->nodetype==BTREE_LEAF_NODE || b.info->numkeys==0) { 
+      return ERROR_NOERROR;
+    }
+    offset=SearchNode(b,key,found,node)+found;
+    found=false;
+    rc = b.GetPtr(offset,node);
+    if (rc) { return rc; }
+  }
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::PutMessage(const KEY_T &key, const BTreeMessage &message)
+{
+  AddMessage(superblock.info.rootnode,key,message);
+  return FlushBuffer(superblock.info.rootnode);
+}
+
+
+void BTreeIndex::AddMessage(const SIZE_T node, const KEY_T &key, const BTreeMessage &message)
+{
+  BTreeMessageBuffer &buffer=buffers[node];
+  BTreeMessages::iterator m=buffer.messages.find(key);
+
+  if (m!=buffer.messages.end()) { 
+    buffer.bytes-=MessageBytes((*m).first,(*m).second);
+    buffer.messages.erase(m);
+    bufferedmessages--;
+  }
+  buffer.messages.insert(make_pair(key,message));
+  buffer.bytes+=MessageBytes(key,message);
+  bufferedmessages++;
+}
+
+
+void BTreeIndex::DropBuffer(const SIZE_T node)
+{
+  map<SIZE_T, BTreeMessageBuffer>::iterator buf=buffers.find(node);
+
+  if (buf!=buffers.end()) { 
+    bufferedmessages-=(*buf).second.messages.size();
+    buffers.erase(buf);
+  }
+}
+
+
+ERROR_T BTreeIndex::FlushBuffer(const SIZE_T node)
+{
+  map<SIZE_T, BTreeMessageBuffer>::iterator buf;
+  ERROR_T rc;
+
+  // Applying or passing on a batch can split or merge node, which
+  // moves its messages, so the buffer is found afresh each time round
+  while ((buf=buffers.find(node))!=buffers.end()) { 
+    BTreeMessages &messages=(*buf).second.messages;
+    BTreeMessages::iterator first=messages.begin();
+    BTreeMessages::iterator last=messages.end();
+    BTreeNodeView b;
+    BTreeNodeView c;
+    SIZE_T ptr=0;
+    bool leaf=true;
+
+    rc = b.Pin(buffercache,node);
+    if (rc) { return rc; }
+    if (b.info->numkeys>0) { 
+      if ((*buf).second.bytes<=bufferbytes) { 
+	return ERROR_NOERROR;
+      }
+
+      // The child with the most bytes of messages for it takes them
+      vector<SIZE_T> bytes(b.info->numkeys+1,0);
+      SIZE_T child=0;
+      for (BTreeMessages::iterator m=messages.begin();m!=messages.end();++m) { 
+	while (child<b.info->numkeys && b.CompareKey(child,(*m).first)<=0) { 
+	  child++;
+	}
+	bytes[child]+=MessageBytes((*m).first,(*m).second);
+      }
+      child=max_element(bytes.begin(),bytes.end())-bytes.begin();
+
+      // Its messages are those from the separator left of it up to
+      // the one right of it, as in FindLeaf
+      KEY_T separator;
+      if (child>0) { 
+	rc = b.GetKey(child-1,separator);
+	if (rc) { return rc; }
+	first=messages.lower_bound(separator);
+      }
+      if (child<b.info->numkeys) { 
+	rc = b.GetKey(child,separator);
+	if (rc) { return rc; }
+	last=messages.lower_bound(separator);
+      }
+      rc = b.GetPtr(child,ptr);
+      if (rc) { return rc; }
+      rc = c.Pin(buffercache,ptr);
+      if (rc) { return rc; }
+      leaf=c.info->nodetype==BTREE_LEAF_NODE;
+      c.Unpin();
+    }
+    // else an empty tree has nowhere to send them, so they are all
+    // applied
+    b.Unpin();
+
+    BTreeMessages batch(first,last);
+    for (BTreeMessages::iterator m=first;m!=last;++m) { 
+      (*buf).second.bytes-=MessageBytes((*m).first,(*m).second);
+    }
+    bufferedmessages-=batch.size();
+    messages.erase(first,last);
+    if (messages.empty()) { 
+      buffers.erase(buf);
+    }
+
+    // A batch for a leaf goes into it while it is in the cache, and
+    // one for an interior node waits in its buffer in turn
+    for (BTreeMessages::iterator m=batch.begin();m!=batch.end();++m) { 
+      if (leaf) { 
+	rc = ApplyMessage((*m).first,(*m).second);
+	if (rc) { return rc; }
+      } else {
+	AddMessage(ptr,(*m).first,(*m).second);
+      }
+    }
+    if (!leaf) { 
+      rc = FlushBuffer(ptr);
+      if (rc) { return rc; }
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::ApplyMessage(const KEY_T &key, const BTreeMessage &message)
+{
+  bool wasflushing=flushing;
+  ERROR_T rc;
+
+  flushing=true;
+  rc = message.remove ? Delete(key) : Upsert(key,message.value);
+  flushing=wasflushing;
+  if (message.remove && rc==ERROR_NONEXISTENT) { 
+    // The key was inserted and deleted again before either reached
+    // the leaf
+    return ERROR_NOERROR;
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::FlushMessages()
+{
+  BTreeMessages pending;
+  vector<SIZE_T> level;
+  vector<SIZE_T> next;
+  BTreeNodeView b;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  if (bufferedmessages==0) { 
+    return ERROR_NOERROR;
+  }
+
+  // Gather the messages a level at a time from the root down, keeping
+  // the first, and so newest, for each key
+  level.push_back(superblock.info.rootnode);
+  while (bufferedmessages>0 && !level.empty()) { 
+    next.clear();
+    for (SIZE_T i=0;i<level.size();i++) { 
+      map<SIZE_T, BTreeMessageBuffer>::iterator buf=buffers.find(level[i]);
+      if (buf!=buffers.end()) { 
+	pending.insert((*buf).second.messages.begin(),(*buf).second.messages.end());
+	DropBuffer(level[i]);
+      }
+      rc = b.Pin(buffercache,level[i]);
+      if (rc) { return rc; }
+      for (SIZE_T j=0;b.info->nodetype!=BTREE_LEAF_NODE && b.info->numkeys>0 && j<=b.info->numkeys;j++) { 
+	rc = b.GetPtr(j,ptr);
+	if (rc) { return rc; }
+	next.push_back(ptr);
+      }
+    }
+    level.swap(next);
+  }
+  if (bufferedmessages>0) { 
+    // Some were in nodes that aren't in the tree
+    return ERROR_INSANE;
+  }
+
+  // In key order, which takes the leaves in order too
+  for (BTreeMessages::iterator m=pending.begin();m!=pending.end();++m) { 
+    rc = ApplyMessage((*m).first,(*m).second);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::RerouteMessages(const BTreeNodeView &parent, const SIZE_T from,
+				    const SIZE_T to)
+{
+  BTreeMessages pool;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  if (bufferedmessages==0) { 
+    return ERROR_NOERROR;
+  }
+
+  // The children cover separate keys, so no key has two messages
+  for (SIZE_T i=from;i<=to;i++) { 
+    rc = parent.GetPtr(i,ptr);
+    if (rc) { return rc; }
+    map<SIZE_T, BTreeMessageBuffer>::iterator buf=buffers.find(ptr);
+    if (buf!=buffers.end()) { 
+      pool.insert((*buf).second.messages.begin(),(*buf).second.messages.end());
+      DropBuffer(ptr);
+    }
+  }
+
+  SIZE_T child=from;
+  for (BTreeMessages::iterator m=pool.begin();m!=pool.end();++m) { 
+    while (child<to && parent.CompareKey(child,(*m).first)<=0) { 
+      child++;
+    }
+    rc = parent.GetPtr(child,ptr);
+    if (rc) { return rc; }
+    AddMessage(ptr,(*m).first,(*m).second);
+  }
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::MoveMessages(const SIZE_T from, const SIZE_T to)
+{
+  map<SIZE_T, BTreeMessageBuffer>::iterator buf=buffers.find(from);
+
+  if (buf==buffers.end()) { 
+    return;
+  }
+  for (BTreeMessages::iterator m=(*buf).second.messages.begin();m!=(*buf).second.messages.end();++m) { 
+    AddMessage(to,(*m).first,(*m).second);
+  }
+  DropBuffer(from);
+}
+
+
+
+//
+// Posting lists
+//
+
+ERROR_T BTreeIndex::GetLeafValue(const BTreeNodeView &b, const SIZE_T offset, VALUE_T &value)
+{
+  BTreePostingCursor postings;
+  VALUE_T list;
+  ERROR_T rc;
+
+  if (IsUnique()) { 
+    return b.GetVal(offset,value);
+  }
+  rc = b.GetVal(offset,list);
+  if (rc) { return rc; }
+  rc = postings.Open(buffercache,*b.info,list);
+  if (rc) { return rc; }
+  rc = postings.Next(value);
+  // A list is never empty
+  return rc==ERROR_NONEXISTENT ? ERROR_INSANE : rc;
+}
+
+
+ERROR_T BTreeIndex::SetLeafValue(BTreeNodeView &b, const SIZE_T offset, const VALUE_T &value)
+{
+  VALUE_T list;
+  ERROR_T rc;
+
+  if (IsUnique()) { 
+    return b.SetVal(offset,value);
+  }
+  rc = b.GetVal(offset,list);
+  if (rc) { return rc; }
+  rc = FreePostings(list);
+  if (rc) { return rc; }
+  return b.SetVal(offset,MakePosting(value,superblock.info.format,list));
+}
+
+
+ERROR_T BTreeIndex::MakePostings(const vector<VALUE_T> &values, VALUE_T &list)
+{
+  SIZE_T format=superblock.info.format;
+  SIZE_T bytes=1;
+  SIZE_T first;
+  SIZE_T loc;
+  SIZE_T next;
+  ERROR_T rc;
+
+  for (SIZE_T i=0;i<values.size();i++) { 
+    bytes+=PostingBytes(format,values[i].length);
+  }
+  if (bytes<=superblock.info.GetMaxValueLength()) { 
+    list.Resize(bytes,false);
+    list.data[0]=POSTING_INLINE;
+    bytes=1;
+    for (SIZE_T i=0;i<values.size();i++) { 
+      bytes+=PutPosting((char *)list.data+bytes,format,values[i]);
+    }
+    return ERROR_NOERROR;
+  }
+
+  // Fill posting blocks in order, each linked to the next as it is
+  // allocated, so a long list is written once and read in order
+  BTreeNode node(BTREE_POSTING_NODE,superblock.info.keysize,superblock.info.valuesize,
+		 superblock.info.blocksize);
+  node.info.format=format;
+  node.info.rootnode=superblock.info.rootnode;
+  BTreeNodeView block=node.View();
+
+  rc = AllocateNode(first,false);
+  if (rc) { return rc; }
+  loc=first;
+
+  for (SIZE_T i=0;i<values.size();i++) { 
+    if (AppendPosting(block,values[i])) { 
+      continue;
+    }
+    rc = AllocateNode(next,false);
+    if (rc) { return rc; }
+    SetNextPostings(block,next);
+    rc = node.Serialize(buffercache,loc);
+    if (rc) { return rc; }
+    node.info.numkeys=0;
+    node.info.heapbytes=0;
+    memset(node.data,0,node.info.GetNumDataBytes());
+    loc=next;
+    if (!AppendPosting(block,values[i])) { 
+      return ERROR_SIZE;
+    }
+  }
+  SetNextPostings(block,0);
+  rc = node.Serialize(buffercache,loc);
+  if (rc) { return rc; }
+  // The free list changed
+  rc = superblock.Serialize(buffercache,superblock_index);
+  if (rc) { return rc; }
+
+  SetChain(list,values.size(),first,loc);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::AddPosting(BTreeNodeView &b, const SIZE_T offset, const VALUE_T &value)
+{
+  SIZE_T format=superblock.info.format;
+  VALUE_T list;
+  SIZE_T count;
+  SIZE_T first;
+  SIZE_T last;
+  ERROR_T rc;
+
+  rc = b.GetVal(offset,list);
+  if (rc) { return rc; }
+
+  if (!IsOverflow(list)) { 
+    SIZE_T n=list.length;
+    SIZE_T room=b.GetFreeBytes()+n;
+    if (n+PostingBytes(format,value.length)<=min(room,b.info->GetMaxValueLength())) { 
+      rc = list.Resize(n+PostingBytes(format,value.length));
+      if (rc) { return rc; }
+      PutPosting((char *)list.data+n,format,value);
+      return b.SetVal(offset,list);
+    }
+    // Too long for the leaf now, so out to posting blocks
+    if (room<1+3*sizeof(SIZE_T)) { 
+      return ERROR_NOSPACE;
+    }
+    vector<VALUE_T> values;
+    rc = ReadPostings(list,values);
+    if (rc) { return rc; }
+    values.push_back(value);
+    rc = MakePostings(values,list);
+    if (rc) { return rc; }
+    return b.SetVal(offset,list);
+  }
+
+  // Only the last block of the chain is touched
+  GetChain(list,count,first,last);
+
+  BTreeNodeView block;
+  rc = block.Pin(buffercache,last);
+  if (rc) { return rc; }
+  if (!AppendPosting(block,value)) { 
+    BTreeNodeView fresh;
+    SIZE_T loc;
+    rc = AllocateNode(loc,fresh,BTREE_POSTING_NODE);
+    if (rc) { return rc; }
+    SetNextPostings(block,loc);
+    if (!AppendPosting(fresh,value)) { 
+      return ERROR_SIZE;
+    }
+    last=loc;
+  }
+  SetChain(list,count+1,first,last);
+  return b.SetVal(offset,list);
+}
+
+
+ERROR_T BTreeIndex::RemovePosting(BTreeNodeView &b, const SIZE_T offset, const VALUE_T &value)
+{
+  SIZE_T format=superblock.info.format;
+  SIZE_T valuesize=superblock.info.valuesize;
+  VALUE_T list;
+  VALUE_T v;
+  SIZE_T count;
+  SIZE_T first;
+  SIZE_T last;
+  SIZE_T n;
+  ERROR_T rc;
+
+  rc = b.GetVal(offset,list);
+  if (rc) { return rc; }
+
+  if (!IsOverflow(list)) { 
+    for (SIZE_T p=1;p<list.length;p+=n) { 
+      n=GetPosting((const char *)list.data+p,format,valuesize,v);
+      if (CompareKeys(v,value)==0) { 
+	if (list.length==1+n) { 
+	  // It was the key's last value
+	  return b.RemoveSlot(offset);
+	}
+	memmove(list.data+p,list.data+p+n,list.length-p-n);
+	rc = list.Resize(list.length-n);
+	if (rc) { return rc; }
+	return b.SetVal(offset,list);
+      }
+    }
+    return ERROR_NONEXISTENT;
+  }
+
+  GetChain(list,count,first,last);
+
+  // Find the block holding it, and the one before that
+  BTreeNodeView block;
+  SIZE_T prev=0;
+  SIZE_T loc=first;
+  SIZE_T p=0;
+  bool found=false;
+
+  while (loc && !found) { 
+    rc = block.Pin(buffercache,loc);
+    if (rc) { return rc; }
+    if (block.info->nodetype!=BTREE_POSTING_NODE) { 
+      return ERROR_INSANE;
+    }
+    for (p=sizeof(SIZE_T);p<sizeof(SIZE_T)+block.info->heapbytes;p+=n) { 
+      n=GetPosting(block.data+p,format,valuesize,v);
+      if (CompareKeys(v,value)==0) { 
+	found=true;
+	break;
+      }
+    }
+    if (!found) { 
+      prev=loc;
+      loc=GetNextPostings(block);
+    }
+  }
+  if (!found) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  char *end=block.data+sizeof(SIZE_T)+block.info->heapbytes;
+  memmove(block.data+p,block.data+p+n,end-(block.data+p+n));
+  memset(end-n,0,n);
+  block.info->heapbytes-=n;
+  block.info->numkeys--;
+  block.MarkDirty();
+  count--;
+
+  if (block.info->numkeys==0) { 
+    // Unlink the emptied block
+    SIZE_T next=GetNextPostings(block);
+    block.Unpin();
+    if (prev) { 
+      rc = block.Pin(buffercache,prev);
+      if (rc) { return rc; }
+      SetNextPostings(block,next);
+      block.Unpin();
+    } else {
+      first=next;
+    }
+    if (loc==last) { 
+      last=prev;
+    }
+    rc = DeallocateNode(loc);
+    if (rc) { return rc; }
+  }
+  block.Unpin();
+  SetChain(list,count,first,last);
+
+  // Back into the leaf once it takes no more than half the room it may
+  // (and the leaf has that room)
+  SIZE_T inline_bytes=1+count*(b.info->GetStoredValueSize()-1);
+  if (inline_bytes <= min(b.info->GetMaxValueLength()/2,b.GetFreeBytes()+list.length)) { 
+    vector<VALUE_T> values;
+    rc = ReadPostings(list,values);
+    if (rc) { return rc; }
+    rc = FreePostings(list);
+    if (rc) { return rc; }
+    if (values.empty()) { 
+      return b.RemoveSlot(offset);
+    }
+    rc = MakePostings(values,list);
+    if (rc) { return rc; }
+  }
+  return b.SetVal(offset,list);
+}
+
+
+ERROR_T BTreeIndex::FreePostings(const VALUE_T &list)
+{
+  BTreeNodeView block;
+  SIZE_T count;
+  SIZE_T first;
+  SIZE_T last;
+  SIZE_T next;
+  ERROR_T rc;
+
+  if (!IsOverflow(list)) { 
+    return ERROR_NOERROR;
+  }
+  GetChain(list,count,first,last);
+  for (SIZE_T loc=first;loc;loc=next) { 
+    rc = block.Pin(buffercache,loc);
+    if (rc) { return rc; }
+    if (block.info->nodetype!=BTREE_POSTING_NODE) { 
+      return ERROR_INSANE;
+    }
+    next=GetNextPostings(block);
+    block.Unpin();
+    rc = DeallocateNode(loc);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::ReadPostings(const VALUE_T &list, vector<VALUE_T> &values) const
+{
+  BTreePostingCursor postings;
+  VALUE_T v;
+  ERROR_T rc;
+
+  rc = postings.Open(buffercache,superblock.info,list);
+  if (rc) { return rc; }
+  while ((rc=postings.Next(v))==ERROR_NOERROR) { 
+    values.push_back(v);
+  }
+  return rc==ERROR_NONEXISTENT ? ERROR_NOERROR : rc;
+}
+
+
+ERROR_T BTreeIndex::CheckPostings(const VALUE_T &list) const
+{
+  SIZE_T format=superblock.info.format;
+  VALUE_T v;
+  SIZE_T count;
+  SIZE_T first;
+  SIZE_T last;
+  SIZE_T next;
+  ERROR_T rc;
+
+  if (!IsOverflow(list)) { 
+    // The values must fill the list exactly, and there must be some
+    SIZE_T p=1;
+    while (p<list.length) { 
+      if (format & BTREE_FORMAT_VARLEN && p+sizeof(unsigned short)>list.length) { 
+	return ERROR_INSANE;
+      }
+      p+=GetPosting((const char *)list.data+p,format,superblock.info.valuesize,v);
+    }
+    return list.length>1 && p==list.length && list.data[0]==POSTING_INLINE ? ERROR_NOERROR : ERROR_INSANE;
+  }
+
+  // Every block of the chain is a posting block with values in it, and
+  // they add up to the count
+  GetChain(list,count,first,last);
+  SIZE_T seen=0;
+  SIZE_T loc=first;
+  SIZE_T prev=0;
+  BTreeNode block;
+
+  for (;loc;loc=next) { 
+    rc = block.Unserialize(buffercache,loc);
+    if (rc) { return rc; }
+    if (block.info.nodetype!=BTREE_POSTING_NODE || block.info.numkeys==0) { 
+      return ERROR_INSANE;
+    }
+    seen+=block.info.numkeys;
+    if (seen>count) { 
+      return ERROR_INSANE;
+    }
+    next=GetNextPostings(block.View());
+    prev=loc;
+  }
+  return seen==count && prev==last ? ERROR_NOERROR : ERROR_INSANE;
+}
+
+
+BTreePostingCursor::BTreePostingCursor() : 
+  cache(0), format(0), valuesize(0), overflow(false), offset(0), count(0), left(0)
+{}
+
+
+ERROR_T BTreePostingCursor::Open(BufferCache *c, const NodeMetadata &info, const VALUE_T &l)
+{
+  ERROR_T rc;
+
+  Close();
+  cache=c;
+  format=info.format;
+  valuesize=info.valuesize;
+  list=l;
+  overflow=false;
+
+  if (!(format & BTREE_FORMAT_POSTINGS)) { 
+    // A unique index's one value
+    count=left=1;
+    return ERROR_NOERROR;
+  }
+  if (!IsOverflow(list)) { 
+    // Count the values as they are given
+    VALUE_T v;
+    count=0;
+    for (offset=1;offset<list.length;count++) { 
+      offset+=GetPosting((const char *)list.data+offset,format,valuesize,v);
+    }
+    left=count;
+    offset=1;
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T first;
+  SIZE_T last;
+  GetChain(list,count,first,last);
+  overflow=true;
+  left=0;
+  if (count==0) { 
+    return ERROR_NOERROR;
+  }
+  rc = block.Pin(cache,first);
+  if (rc) { return rc; }
+  offset=sizeof(SIZE_T);
+  left=count;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreePostingCursor::Next(VALUE_T &value)
+{
+  ERROR_T rc;
+
+  if (left==0) { 
+    Close();
+    return ERROR_NONEXISTENT;
+  }
+
+  if (!(format & BTREE_FORMAT_POSTINGS)) { 
+    value=list;
+  } else if (!overflow) { 
+    offset+=GetPosting((const char *)list.data+offset,format,valuesize,value);
+  } else {
+    // Off the end of this block, so on to the next one
+    while (offset>=sizeof(SIZE_T)+block.info->heapbytes) { 
+      SIZE_T next=GetNextPostings(block);
+      if (next==0) { 
+	Close();
+	return ERROR_INSANE;
+      }
+      rc = block.Pin(cache,next);
+      if (rc) { return rc; }
+      offset=sizeof(SIZE_T);
+    }
+    offset+=GetPosting(block.data+offset,format,valuesize,value);
+  }
+
+  if (--left==0) { 
+    Close();
+  }
+  return ERROR_NOERROR;
+}
+
+
+void BTreePostingCursor::Close()
+{
+  block.Unpin();
+  left=0;
+}
+
+
+// Cuts b's prefix back to what it has in common with other's.  Every
+// key routed to either node begins with that, so b can then take keys
+// from anywhere in the two nodes' ranges.
+static ERROR_T SharePrefix(BTreeNodeView &b, const BTreeNodeView &other)
+{
+  SIZE_T n=0;
+  const char *p=b.ResolvePrefix();
+  const char *q=other.ResolvePrefix();
+
+  while (n<b.info->prefixlen && n<other.info->prefixlen && p[n]==q[n]) { 
+    n++;
+  }
+  if (n==b.info->prefixlen) { 
+    return ERROR_NOERROR;
+  }
+  return b.SetPrefix(p,n);
+}
+
+
+ERROR_T BTreeIndex::MergeSiblings(BTreeNodeView &left, BTreeNodeView &right,
+				  const KEY_T &separator, const bool toroot, bool &merged)
+{
+  ERROR_T rc;
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T count;
+
+  // Build the merged node in a copy of left, so that one that turns
+  // out not to fit can just be thrown away
+  NodeMetadata info=*left.info;
+  SIZE_T databytes=info.GetNumDataBytes();
+  char *data=new char [databytes];
+  memcpy(data,left.data,databytes);
+  BTreeNodeView m(&info,data);
+
+  merged=false;
+
+  if (toroot) { 
+    // The root is unbounded, so it has no prefix
+    rc = m.SetPrefix(m.ResolvePrefix(),0);
+  } else {
+    rc = SharePrefix(m,right);
+  }
+
+  if (info.nodetype==BTREE_LEAF_NODE) { 
+    // left takes right's place in the leaf chain
+    if (!rc) { rc = right.GetPtr(0,ptr); }
+    if (!rc) { rc = m.SetPtr(0,ptr); }
+    for (SIZE_T i=0;i<right.info->numkeys && !rc;i++) { 
+      rc = right.GetKey(i,key);
+      if (!rc) { rc = right.GetVal(i,value); }
+      if (!rc) { rc = PutLeafSlot(m,info.numkeys,key,value); }
+    }
+  } else if (!rc) {
+    // The separator comes down between left's pointers and right's
+    rc = right.GetPtr(0,ptr);
+    if (!rc) { rc = right.GetCount(0,count); }
+    if (!rc) { rc = PutInteriorSlot(m,info.numkeys,separator,ptr,count); }
+    for (SIZE_T i=0;i<right.info->numkeys && !rc;i++) { 
+      rc = right.GetKey(i,key);
+      if (!rc) { rc = right.GetPtr(i+1,ptr); }
+      if (!rc) { rc = right.GetCount(i+1,count); }
+      if (!rc) { rc = PutInteriorSlot(m,info.numkeys,key,ptr,count); }
+    }
+  }
+
+  if (!rc && !m.IsFull()) { 
+    *left.info=info;
+    memcpy(left.data,data,databytes);
+    left.MarkDirty();
+    merged=true;
+    if (info.nodetype==BTREE_LEAF_NODE) { 
+      rc = RefilterLeaf(left);
+    }
+  }
+  delete [] data;
+
+  return rc==ERROR_NOSPACE ? ERROR_NOERROR : rc;
+}
+
+
+ERROR_T BTreeIndex::Redistribute(BTreeNodeView &left, BTreeNodeView &right,
+				 KEY_T &separator, SIZE_T &moved)
+{
+  ERROR_T rc;
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T count;
+  bool leaf=left.info->nodetype==BTREE_LEAF_NODE;
+
+  // Slots move from the fuller node to the emptier one, whose range
+  // grows into the other's
+  bool toleft=right.GetUsedBytes()>left.GetUsedBytes();
+  BTreeNodeView &to = toleft ? left : right;
+  BTreeNodeView &from = toleft ? right : left;
+
+  moved=0;
+
+  rc = SharePrefix(to,from);
+  if (rc==ERROR_NOSPACE) { 
+    // Leave them as they are
+    return ERROR_NOERROR;
+  }
+  if (rc) { return rc; }
+
+  // Stop before the giver gets emptier than the taker, and always
+  // leave it a key
+  while (from.info->numkeys>1) { 
+    SIZE_T n=from.info->numkeys;
+    SIZE_T i = toleft ? 0 : n-1;
+    SIZE_T bytes=from.GetSlotBytes(i);
+
+    if (to.info->numkeys>0 && to.GetUsedBytes()+bytes > from.GetUsedBytes()-bytes) { 
+      break;
+    }
+
+    if (leaf) { 
+      rc = from.GetKey(i,key);
+      if (rc) { return rc; }
+      rc = from.GetVal(i,value);
+      if (rc) { return rc; }
+      if (!to.HasRoomFor(key.length,value.length)) { 
+	break;
+      }
+      rc = PutLeafSlot(to,toleft ? to.info->numkeys : 0,key,value);
+      if (rc) { return rc; }
+      rc = from.RemoveSlot(i);
+      if (rc) { return rc; }
+    } else if (toleft) { 
+      // separator and right's first pointer go to the end of left,
+      // and right's first key becomes the separator
+      if (!to.HasRoomFor(separator.length,0)) { 
+	break;
+      }
+      rc = from.GetPtr(0,ptr);
+      if (rc) { return rc; }
+      rc = from.GetCount(0,count);
+      if (rc) { return rc; }
+      rc = PutInteriorSlot(to,to.info->numkeys,separator,ptr,count);
+      if (rc) { return rc; }
+      rc = from.GetKey(0,separator);
+      if (rc) { return rc; }
+      rc = from.GetPtr(1,ptr);
+      if (rc) { return rc; }
+      rc = from.SetPtr(0,ptr);
+      if (rc) { return rc; }
+      rc = from.GetCount(1,count);
+      if (rc) { return rc; }
+      rc = from.SetCount(0,count);
+      if (rc) { return rc; }
+      rc = from.RemoveSlot(0);
+      if (rc) { return rc; }
+    } else {
+      // separator and left's last pointer go to the front of right,
+      // and left's last key becomes the separator
+      if (!to.HasRoomFor(separator.length,0)) { 
+	break;
+      }
+      rc = to.GetPtr(0,ptr);
+      if (rc) { return rc; }
+      rc = to.GetCount(0,count);
+      if (rc) { return rc; }
+      rc = PutInteriorSlot(to,0,separator,ptr,count);
+      if (rc) { return rc; }
+      rc = from.GetPtr(n,ptr);
+      if (rc) { return rc; }
+      rc = to.SetPtr(0,ptr);
+      if (rc) { return rc; }
+      rc = from.GetCount(n,count);
+      if (rc) { return rc; }
+      rc = to.SetCount(0,count);
+      if (rc) { return rc; }
+      rc = from.GetKey(n-1,separator);
+      if (rc) { return rc; }
+      rc = from.RemoveSlot(n-1);
+      if (rc) { return rc; }
+    }
+    moved++;
+  }
+
+  if (leaf && moved>0) { 
+    rc = RefilterLeaf(to);
+    if (rc) { return rc; }
+    return LeafSeparator(left,right,separator);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Rebalance(BTreePath &path)
+{
+  SIZE_T node;
+  SIZE_T parentloc;
+  SIZE_T leftloc;
+  SIZE_T rightloc;
+  SIZE_T slot;
+  KEY_T separator;
+  ERROR_T rc;
+
+  // Each pass fixes the last node on the path, and goes on up while a
+  // merge leaves the parent underfull.  The root may be as empty as
+  // it likes.
+  for (;path.depth>=2;path.depth--) { 
+    BTreeNodeView b;
+    BTreeNodeView parent;
+    BTreeNodeView left;
+    BTreeNodeView right;
+
+    node=path.node[path.depth-1];
+    parentloc=path.node[path.depth-2];
+
+    rc = b.Pin(buffercache,node);
+    if (rc) { return rc; }
+    if (!b.IsUnderfull()) { 
+      return ERROR_NOERROR;
+    }
+    b.Unpin();
+    ForgetLastLeaf();
+
+    // Pair the node with its left sibling, or its right one if it is
+    // the first child
+    rc = parent.Pin(buffercache,parentloc);
+    if (rc) { return rc; }
+    slot=path.slot[path.depth-2];
+    if (slot>parent.info->numkeys || parent.info->numkeys==0) { 
+      return ERROR_INSANE;
+    }
+    if (slot>0) { 
+      slot--;
+    }
+
+    rc = parent.GetPtr(slot,leftloc);
+    if (rc) { return rc; }
+    rc = parent.GetPtr(slot+1,rightloc);
+    if (rc) { return rc; }
+    if (leftloc!=node && rightloc!=node) { 
+      return ERROR_INSANE;
+    }
+    ForgetModel(parentloc);
+    ForgetModel(leftloc);
+    ForgetModel(rightloc);
+    rc = parent.GetKey(slot,separator);
+    if (rc) { return rc; }
+    rc = left.Pin(buffercache,leftloc);
+    if (rc) { return rc; }
+    rc = right.Pin(buffercache,rightloc);
+    if (rc) { return rc; }
 
-      if (orig_node.info.numkeys < orig_node.info.GetNumSlotsAsInterior()) { return ERROR_INSANE; }
-      
-      // Numbers of keys for blocks that result from split
-      k1 = orig_node.info.numkeys/2;
-      k2 = orig_node.info.numkeys-k1-1;
+    bool leaf=left.info->nodetype==BTREE_LEAF_NODE;
+    // Merging these two would leave the root without keys
+    bool lastkey=parent.info->nodetype==BTREE_ROOT_NODE && parent.info->numkeys==1;
+    bool merged=false;
 
-      // Get block from AllocateNode and unserialize into new_node
-      rc = AllocateNode(new_block_ref);
-      if (rc) { cout<<rc<<endl; return rc; }
-      rc = new_node.Unserialize(buffercache, new_block_ref);
+    // The root needs keys to reach a leaf, so two leaves under a root
+    // with one key only merge once both are empty
+    if (!leaf || !lastkey || left.info->numkeys+right.info->numkeys==0) { 
+      rc = MergeSiblings(left,right,separator,lastkey,merged);
       if (rc) { return rc; }
+    }
 
-      // Set new_node type and numkeys
-      new_node.info.nodetype=BTREE_INTERIOR_NODE;
-      new_node.info.numkeys=k2;
-      // Initialize new_node's data to all 0's
-      new_node.data = new char [new_node.info.GetNumDataBytes()];
-      memset(new_node.data,0,new_node.info.GetNumDataBytes());
+    if (merged) { 
+      right.Unpin();
+      rc = parent.RemoveSlot(slot);
+      if (rc) { return rc; }
+      rc = parent.SetCount(slot,left.GetSubtreeCount());
+      if (rc) { return rc; }
+      MoveMessages(rightloc,leftloc);
+      rc = DeallocateNode(rightloc);
+      if (rc) { return rc; }
 
-      // Loop through orig_node, copying into new_node
-      for (iter=k1+1; iter<orig_node.info.numkeys; iter++) {
-        
-        // Copy key
-        rc = orig_node.GetKey(iter,temp_key_ref);
-        if (rc) { return rc; }
-        rc = new_node.SetKey(iter-(k1+1),temp_key_ref);
-        if (rc) { return rc; }
-        // Set copied key to 0
-        rc = orig_node.SetKey(iter,KEY_T(null_key_str.c_str()));
-        if (rc) { return rc; }
+      if (!lastkey) { 
+        // On to the parent
+        continue;
+      }
 
-        // Copy pointer
-        rc = orig_node.GetPtr(iter,temp_ptr_ref);
-        if (rc) { return rc; }
-        rc = new_node.SetPtr(iter-(k1+1),temp_ptr_ref);
-        if (rc) { return rc; }
-        // Set copied pointer to 0
-        rc = orig_node.SetPtr(iter,SIZE_T(null_ptr_ref));
+      if (leaf) { 
+        // The tree is empty again
+        left.Unpin();
+        rc = parent.SetPtr(0,0);
         if (rc) { return rc; }
+        return DeallocateNode(leftloc);
       }
 
-      // Set key at index k1 of orig_node to null. It is unneeded after the split.
-      rc = orig_node.SetKey(k1,KEY_T(null_key_str.c_str()));
-      if (rc) { return rc; }
-
-      // Copy last pointer in orig_node to new_node
-      rc = orig_node.GetPtr(orig_node.info.numkeys,temp_ptr_ref);
-      if (rc) { return rc; }
-      rc = new_node.SetPtr(k1,temp_ptr_ref);
-      // Set pointer to 0
-      rc = orig_node.SetPtr(orig_node.info.numkeys,null_ptr_ref);
+      // The root's only child replaces it
+      left.info->nodetype=BTREE_ROOT_NODE;
+      left.MarkDirty();
+      left.Unpin();
+      parent.Unpin();
+      superblock.info.rootnode=leftloc;
+      rc = superblock.Serialize(buffercache,superblock_index);
       if (rc) { return rc; }
+      // Every pinned node is a level further up now
+      UnpinUpperNodes();
+      // The old root's messages are newer than the new one's
+      MoveMessages(parentloc,leftloc);
+      return DeallocateNode(parentloc);
+    }
 
-      // Set numkeys of orig_node to k1
-      orig_node.info.numkeys=k1;
+    SIZE_T moved;
 
-      //
-      // Different ending depending on ROOT_NODE vs INTERIOR NODE
-      if (orig_node.info.nodetype == BTREE_INTERIOR_NODE) {
-        // Serialize orig_node and new_node
-        rc = orig_node.Serialize(buffercache, orig_block_ref);
-        if (rc) { return rc; }
-        rc = new_node.Serialize(buffercache, new_block_ref);
-        if (rc) { return rc; }
+    rc = Redistribute(left,right,separator,moved);
+    if (rc) { return rc; }
+    rc = parent.SetCount(slot,left.GetSubtreeCount());
+    if (rc) { return rc; }
+    rc = parent.SetCount(slot+1,right.GetSubtreeCount());
+    if (rc) { return rc; }
+    left.Unpin();
+    right.Unpin();
 
-        // Get the first key in the new_node. This is the key we'll insert into the parent.
-        rc = new_node.GetKey(0,temp_key_ref);
-        if (rc) { return rc; }
+    if (moved>0) { 
+      rc = parent.SetKey(slot,separator);
+      if (rc) { return rc; }
+      rc = RerouteMessages(parent,slot,slot+1);
+      if (rc) { return rc; }
+      if (parent.IsFull()) { 
+        // A longer separator can fill a slotted parent
+        parent.Unpin();
+        path.depth--;
+        return Split(path);
+      }
+    }
+    return ERROR_NOERROR;
+  }
+  return ERROR_NOERROR;
+}
 
-        // Insert a pointer to it into the parent node of orig_node, using InternalPointerInsert
-        rc = InteriorPointerInsert(crumbs, temp_key, new_block_ref);
-        if (rc) { return rc; }
 
-        return ERROR_NOERROR;
-      } else {
-        // orig_node is now an interior node, so set it as such
-        orig_node.info.nodetype=BTREE_INTERIOR_NODE;
-
-        //
-        // We need to create a new root node, set the superblock to point at it, and insert both
-        // orig_node and new_node into it.
-        SIZE_T new_root_loc;
-        SIZE_T& new_root_ref = new_root_loc;
-        BTreeNode new_root;
-
-        // Allocate new root node
-        rc = AllocateNode(new_root_ref);
-        if (rc) { cout<<rc<<endl; return rc; }
-        rc = new_root.Unserialize(buffercache, new_root_ref);
-        if (rc) { return rc; }
 
-        // Set new_root type, numkeys, and data
-        new_root.info.nodetype=BTREE_ROOT_NODE;
-        new_root.info.numkeys=1;
-        new_root.data = new char [new_root.info.GetNumDataBytes()];
-        memset(new_root.data,0,new_root.info.GetNumDataBytes());
+//
+// Bulk loading
+//
+// The tree is built a level at a time from the bottom, but all levels
+// grow together: each node written out passes its lower separator and
+// its block number up to the level above.  Each level keeps its last
+// two nodes in memory until the input ends, so that the last one can
+// still borrow from or merge into the one before it.
+//
+struct BulkLoadLevel {
+  BTreeNode prev;
+  BTreeNode cur;      // being filled
+  SIZE_T    prevloc;  // 0 until a block is allocated for it
+  SIZE_T    curloc;
+  KEY_T     prevlo;   // separator below prev (empty for a level's first node)
+  KEY_T     curlo;    // separator between prev and cur
+  bool      hasprev;
+  bool      hascur;
+  SIZE_T    written;  // nodes of this level already written
+  double    fill;
+
+  BulkLoadLevel(const int nodetype, const NodeMetadata &super, const double fill) :
+    prev(nodetype,super.keysize,super.valuesize,super.blocksize),
+    cur(nodetype,super.keysize,super.valuesize,super.blocksize),
+    prevloc(0), curloc(0), hasprev(false), hascur(false), written(0), fill(fill)
+  {
+    prev.info.format=cur.info.format=super.format;
+    prev.info.rootnode=cur.info.rootnode=super.rootnode;
+  }
+};
 
-        // Set superblock to point to new_root
-        superblock.info.rootnode = new_root_loc;
 
-        // Serialize orig_node, and new_node
-        rc = orig_node.Serialize(buffercache,orig_block_ref);
-        if (rc) { return rc; }
-        rc = new_node.Serialize(buffercache,new_block_ref);
-        if (rc) { return rc; }
+// Empties a node for reuse
+static void ClearLoadNode(BTreeNode &node)
+{
+  node.info.numkeys=0;
+  node.info.prefixlen=0;
+  node.info.heapbytes=0;
+  memset(node.data,0,node.info.GetNumDataBytes());
+}
 
-        // Must insert manually into new_root
-        //
-        // Use first key in new_node as the first key in new_root
-        rc = new_node.GetKey(0,temp_key_ref);
-        if (rc) { return rc; }
-        // Set it in new_root
-        rc = new_root.SetKey(0,temp_key_ref);
-        if (rc) { return rc; }
-        // Insert pointers to orig_node and new_node
-        rc = new_root.SetPtr(0,orig_block_ref);
-        if (rc) { return rc; }
-        rc = new_root.SetPtr(1,new_block_ref);
-        if (rc) { return rc; }
-        // Serialize new_root
-        rc = new_root.Serialize(buffercache,new_root_ref);
-        if (rc) { return rc; }
 
-        return ERROR_NOERROR;
-      }
+// true if a slot of these lengths can go on the end of b without
+// taking it past fill of its capacity or leaving it full
+static bool LoadFits(const BTreeNodeView &b, const SIZE_T keylen, const SIZE_T vallen,
+		     const double fill)
+{
+  bool leaf=b.info->nodetype==BTREE_LEAF_NODE;
+  SIZE_T capacity;
+  SIZE_T bytes=b.GetSlotSize();
 
-      // Control shouldn't reach here
-      return ERROR_INSANE;
-      break;
+  if (b.IsSlotted()) { 
+    capacity=b.info->GetNumDataBytes()-b.GetHeadSize()-b.info->prefixlen;
+    bytes+=keylen-b.info->prefixlen+vallen;
+  } else {
+    capacity=(leaf ? b.info->GetNumSlotsAsLeaf() : b.info->GetNumSlotsAsInterior())*b.GetSlotSize();
+  }
+  return b.HasRoomFor(keylen,vallen) && b.GetUsedBytes()+bytes <= fill*capacity;
+}
 
-    case BTREE_LEAF_NODE:
-      
-      // Build up null_val_str of 0's.
-      for (i = 0; i < superblock.info.valuesize; i++) {
-        null_val_str = "0" + null_val_str;
-      }
 
+// Gives b the longest prefix that its fences lo and hi allow (see
+// BTreeIndex::SplitPrefixes), short of one that leaves it underfull
+static ERROR_T LoadPrefix(BTreeNodeView &b, const KEY_T &lo, const KEY_T &hi)
+{
+  ERROR_T rc;
 
-      if (orig_node.info.numkeys < orig_node.info.GetNumSlotsAsLeaf()) { return ERROR_INSANE; }
-      
-      // Numbers of keys for blocks that result from split
-      k2 = orig_node.info.numkeys/2;
-      k1 = orig_node.info.numkeys-k2;
-        
-      // Get block from AllocateNode and unserialize into new_node
-      rc = AllocateNode(new_block_ref);
-      if (rc) { cout<<rc<<endl; return rc; }
-      rc = new_node.Unserialize(buffercache, new_block_ref);
-      if (rc) { return rc; }
-      
-      // Set new_node type and numkeys
-      new_node.info.nodetype=BTREE_LEAF_NODE;
-      new_node.info.numkeys=k2;
-      // Initialize new_node's data to all 0's
-      new_node.data = new char [new_node.info.GetNumDataBytes()];
-      memset(new_node.data,0,new_node.info.GetNumDataBytes());
-
-      // Loop through orig_node, copying into new_node
-      for(iter=k1;iter<orig_node.info.numkeys;iter++) {
-        
-        // Copy key
-        rc = orig_node.GetKey(iter,temp_key_ref);
-        if (rc) { return rc; }
-        rc = new_node.SetKey(iter-k1,temp_key_ref);
-        if (rc) { return rc; }
-        // Set copied key to 0
-        rc = orig_node.SetKey(iter,KEY_T(null_key_str.c_str()));
-        if (rc) { return rc; }
+  if (!(b.info->format & BTREE_FORMAT_PREFIX)) { 
+    return ERROR_NOERROR;
+  }
+  for (SIZE_T len=min(CommonPrefixLength(lo,hi),b.info->keysize-1);len>0;len--) { 
+    rc = b.SetPrefix((const char *)lo.data,len);
+    if (rc) { return rc; }
+    if (!b.IsUnderfull()) { 
+      return ERROR_NOERROR;
+    }
+  }
+  return b.SetPrefix(b.ResolvePrefix(),0);
+}
 
-        // Copy value
-        rc = orig_node.GetVal(iter,temp_val_ref);
-        if (rc) { return rc; }
-        rc = new_node.SetVal(iter-k1,temp_val_ref);
-        if (rc) { return rc; }
-        // Set copied value to 0
-        rc = orig_node.SetVal(iter,VALUE_T(null_val_str.c_str()));
-        if (rc) { return rc; }
-      }
 
-      //Set the original node's number of keys to k1
-      orig_node.info.numkeys=k1;
+ERROR_T BTreeIndex::BulkLoad(BTreeLoadSource &source, const double fill)
+{
+  deque<BulkLoadLevel> levels;
+  BTreeNodeView root;
+  KEY_T key;
+  VALUE_T value;
+  KEY_T runkey;
+  vector<VALUE_T> run;
+  VALUE_T list;
+  ERROR_T rc;
+  ERROR_T stop;
 
-      // Serialize orig_node and new_node
-      rc = orig_node.Serialize(buffercache,orig_block_ref);
-      if (rc) { return rc; }
-      rc = new_node.Serialize(buffercache,new_block_ref);
-      if (rc) { return rc; }
+  if (fill<0.5 || fill>1) { 
+    return ERROR_BADCONFIG;
+  }
+  rc = FlushMessages();
+  if (rc) { return rc; }
+  ForgetLastLeaf();
+  ForgetFilters();
+  models.clear();
 
-      // Get the first key in the new_node. This is the key we'll insert into the parent.
-      rc = new_node.GetKey(0,temp_key_ref);
-      if (rc) { return rc; }
+  rc = root.Pin(buffercache,superblock.info.rootnode);
+  if (rc) { return rc; }
+  if (root.info->numkeys>0) { 
+    return ERROR_CONFLICT;
+  }
+  root.Unpin();
 
-      // Insert a pointer to it into the parent node of orig_node, using InternalPointerInsert
-      rc = InteriorPointerInsert(crumbs, temp_key, new_block_ref);
-      if (rc) { return rc; }
+  levels.push_back(BulkLoadLevel(BTREE_LEAF_NODE,superblock.info,fill));
+  BTreeNode &leaf=levels[0].cur;
 
-      return ERROR_NOERROR;
+  while ((stop=source.Next(key,value))==ERROR_NOERROR) { 
+    if (!LengthFits(key.length,superblock.info.keysize,superblock.info.format) ||
+	!LengthFits(value.length,superblock.info.valuesize,superblock.info.format)) { 
+      stop=ERROR_SIZE;
       break;
-
- 
-    default:
-      return ERROR_INSANE;
+    }
+    if (!IsUnique()) { 
+      // A run of equal keys becomes one posting list, added to the
+      // leaf once the run ends
+      int cmp = run.empty() ? 1 : CompareKeys(key,runkey);
+      if (cmp<0) { 
+	stop=ERROR_CONFLICT;
+	break;
+      }
+      if (cmp>0 && !run.empty()) { 
+	rc = MakePostings(run,list);
+	if (rc) { return rc; }
+	rc = BulkLoadAdd(levels,0,runkey,list,0,0);
+	if (rc) { return rc; }
+	run.clear();
+      }
+      runkey=key;
+      run.push_back(value);
+      continue;
+    }
+    // The last key loaded is the last one in the leaf being filled
+    if (leaf.info.numkeys>0 && leaf.View().CompareKey(leaf.info.numkeys-1,key)>=0) { 
+      stop=ERROR_CONFLICT;
       break;
+    }
+    rc = BulkLoadAdd(levels,0,key,value,0,0);
+    if (rc) { return rc; }
+  }
+  if (stop==ERROR_NONEXISTENT) { 
+    stop=ERROR_NOERROR;
+  }
+  if (!run.empty()) { 
+    rc = MakePostings(run,list);
+    if (rc) { return rc; }
+    rc = BulkLoadAdd(levels,0,runkey,list,0,0);
+    if (rc) { return rc; }
   }
 
-  // We shouldn't reach here
-  return ERROR_INSANE;
+  if (levels[0].hascur) { 
+    rc = BulkLoadFinish(levels);
+    if (rc) { return rc; }
+    // The free list is all that changed
+    rc = superblock.Serialize(buffercache,superblock_index);
+    if (rc) { return rc; }
+    // A loaded index is read mostly, so model it now
+    rc = TrainModels();
+    if (rc) { return rc; }
+  }
+  return stop;
 }
 
-ERROR_T BTreeIndex::InteriorPointerInsert(list<SIZE_T> crumbs, const KEY_T &key, const SIZE_T &ptr)
+
+ERROR_T BTreeIndex::BulkLoadAdd(deque<BulkLoadLevel> &levels, const SIZE_T l,
+				const KEY_T &key, const VALUE_T &value, const SIZE_T ptr,
+				const SIZE_T count)
 {
-  BTreeNode b;
+  BulkLoadLevel &level=levels[l];
+  bool leaf = l==0;
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-
-  // Iterator and temporary keys and pointers, used to copy data
-  SIZE_T iter;
-  KEY_T temp_key;
-  KEY_T& temp_key_ref = temp_key;
-  SIZE_T temp_ptr;
-  SIZE_T& temp_ptr_ref = temp_ptr;
 
-  //---------------//
-
-  // Crumbs should never be empty
-  if (crumbs.empty()) { return ERROR_INSANE; }
-
-  // node is first node in crumbs list. Don't pop so that Split will look at this node.
-  const SIZE_T& node = crumbs.front();
+  if (level.hascur) { 
+    BTreeNodeView cur=level.cur.View();
+    if (LoadFits(cur,key.length,leaf ? value.length : 0,level.fill)) { 
+      return leaf ? PutLeafSlot(cur,cur.info->numkeys,key,value) :
+	PutInteriorSlot(cur,cur.info->numkeys,key,ptr,count);
+    }
 
-  rc = b.Unserialize(buffercache,node);
-  if (rc) { return rc; }
+    // cur is as full as it is going to get, so prev is done with
+    if (level.hasprev) { 
+      if (!level.curloc) { 
+	rc = AllocateNode(level.curloc,false);
+	if (rc) { return rc; }
+      }
+      rc = BulkLoadWrite(levels,l,level.prev,level.prevloc,level.prevlo,level.curlo,level.curloc);
+      if (rc) { return rc; }
+    }
 
-  // Check nodetype. If it isn't an interior node or the root node, error.
-  if (b.info.nodetype != BTREE_INTERIOR_NODE && b.info.nodetype != BTREE_ROOT_NODE)
-  {
-    return ERROR_BADNODETYPE;
+    // and cur takes its place
+    swap(level.prev.info,level.cur.info);
+    swap(level.prev.data,level.cur.data);
+    ClearLoadNode(level.cur);
+    level.prevloc=level.curloc;
+    level.curloc=0;
+    level.prevlo=level.curlo;
+    level.hasprev=true;
   }
 
-  //
-  // Node shouldn't be empty.
-  if (b.info.numkeys == 0) {
-    return ERROR_INSANE;
-  }
+  BTreeNodeView cur=level.cur.View();
+  level.hascur=true;
 
-  for (offset=0; offset<b.info.numkeys; offset++) {
-    // Move through keys until we find one larger than input key
-    rc = b.GetKey(offset,testkey);
+  if (leaf) { 
+    rc = PutLeafSlot(cur,0,key,value);
     if (rc) { return rc; }
-    // If key exists, conflict error.
-    if (key == testkey) { return ERROR_CONFLICT; }
-    // Otherwise, break loop
-    if (key<testkey) { break; }
+    return level.hasprev ? LeafSeparator(level.prev.View(),cur,level.curlo) : ERROR_NOERROR;
   }
+  // key is the separator below ptr
+  level.curlo=key;
+  rc = cur.SetPtr(0,ptr);
+  if (rc) { return rc; }
+  return cur.SetCount(0,count);
+}
 
-  // Increment numkeys
-  b.info.numkeys++;
-
-  // Move back from largest key to offset key, shifting keys and pointers
-  // one slot to the right
-  for (iter=b.info.numkeys-2; iter>=offset; iter--) {
 
-    // Shift key
-    rc = b.GetKey(iter,temp_key_ref);
-    if (rc) { return rc; }
-    rc = b.SetKey(iter+1,temp_key_ref);
-    if (rc) { return rc; }
+ERROR_T BTreeIndex::BulkLoadWrite(deque<BulkLoadLevel> &levels, const SIZE_T l,
+				  BTreeNode &node, SIZE_T &loc, const KEY_T &lo,
+				  const KEY_T &hi, const SIZE_T next)
+{
+  BTreeNodeView b=node.View();
+  ERROR_T rc;
 
-    //Shift pointer
-    rc = b.GetPtr(iter+1,temp_ptr_ref);
+  if (!loc) { 
+    rc = AllocateNode(loc,false);
     if (rc) { return rc; }
-    rc = b.SetPtr(iter+2,temp_ptr_ref);
+  }
+  if (l==0) { 
+    rc = b.SetPtr(0,next);
     if (rc) { return rc; }
-
-    // Test if pointers are equal, since >= doesn't work with pointers. Break loop if they are.
-    if (iter == offset) { break; }
   }
-
-  // Set input key
-  rc = b.SetKey(offset,key);
-  if (rc) { return rc; }
-
-  // Set input ptr
-  rc = b.SetPtr(offset+1,ptr);
+  rc = LoadPrefix(b,lo,hi);
   if (rc) { return rc; }
-
-  // Serialize block
-  rc = b.Serialize(buffercache,node);
+  rc = node.Serialize(buffercache,loc);
   if (rc) { return rc; }
+  levels[l].written++;
 
-  if (b.info.numkeys >= b.info.GetNumSlotsAsInterior()) {
-    // Check if we're at or over the slot upper bound, split if we are.
-    rc = Split(crumbs);
-    if (rc) { return rc; }
+  if (l+1==levels.size()) { 
+    levels.push_back(BulkLoadLevel(BTREE_INTERIOR_NODE,superblock.info,levels[l].fill));
   }
-
-  return ERROR_NOERROR;  
-  
-}
-  
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
-{
-  list<SIZE_T> crumbs;
-  return Inserter(crumbs, superblock.info.rootnode, key, value);
+  return BulkLoadAdd(levels,l+1,lo,VALUE_T(),loc,b.GetSubtreeCount());
 }
 
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
-{
-  VALUE_T val = value;
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, val);
-}
 
-  
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
+ERROR_T BTreeIndex::BulkLoadFinish(deque<BulkLoadLevel> &levels)
 {
-  // This is optional extra credit for F12
-  //
-  // 
-  return ERROR_UNIMPL;
-}
+  ERROR_T rc;
+
+  // The level above each one only exists once it has been written to,
+  // so levels grows as this goes
+  for (SIZE_T l=0;l<levels.size();l++) { 
+    BulkLoadLevel &level=levels[l];
+    BTreeNodeView prev=level.prev.View();
+    BTreeNodeView cur=level.cur.View();
+    bool merged=false;
+    SIZE_T moved;
+
+    if (!level.hasprev) { 
+      if (l>0) { 
+	// A level of one node is the top one.  The node goes in the
+	// root's block, which has been empty all along.
+	level.cur.info.nodetype=BTREE_ROOT_NODE;
+	return level.cur.Serialize(buffercache,superblock.info.rootnode);
+      }
+      // The root needs two leaves below it, so put an empty one first
+      // and even them out
+      level.hasprev=true;
+      rc = LeafSeparator(prev,cur,level.curlo);
+      if (rc) { return rc; }
+      rc = Redistribute(prev,cur,level.curlo,moved);
+      if (rc) { return rc; }
+    } else if (cur.IsUnderfull()) { 
+      // The last node ran out of input; but the only two leaves must
+      // stay two
+      if (l>0 || level.written>0) { 
+	rc = MergeSiblings(prev,cur,level.curlo,false,merged);
+	if (rc) { return rc; }
+      }
+      if (!merged) { 
+	rc = Redistribute(prev,cur,level.curlo,moved);
+	if (rc) { return rc; }
+      }
+    }
+
+    if (merged && level.written==0) { 
+      // prev is all that is left of the top level
+      level.prev.info.nodetype=BTREE_ROOT_NODE;
+      return level.prev.Serialize(buffercache,superblock.info.rootnode);
+    }
+    if (merged) { 
+      rc = BulkLoadWrite(levels,l,level.prev,level.prevloc,level.prevlo,KEY_T(),0);
+      if (rc) { return rc; }
+      continue;
+    }
+
+    if (!level.curloc) { 
+      rc = AllocateNode(level.curloc,false);
+      if (rc) { return rc; }
+    }
+    rc = BulkLoadWrite(levels,l,level.prev,level.prevloc,level.prevlo,level.curlo,level.curloc);
+    if (rc) { return rc; }
+    rc = BulkLoadWrite(levels,l,level.cur,level.curloc,level.curlo,KEY_T(),0);
+    if (rc) { return rc; }
+  }
 
+  // The loop ends at the top level
+  return ERROR_INSANE;
+}
   
 //
 //
@@ -994,7 +4174,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
     return rc;
   }
 
-  rc = PrintNode(o,node,b,display_type);
+  rc = PrintNode(o,node,b,display_type,buffercache);
   
   if (rc) { return rc; }
 
@@ -1080,22 +4260,80 @@ ERROR_T BTreeIndex::ISA_Tree(set<SIZE_T> visited, const SIZE_T &node) const
   case BTREE_ROOT_NODE:
   case BTREE_INTERIOR_NODE:
 
-    if (b.info.numkeys >= b.info.GetNumSlotsAsInterior()) {
+    if (b.View().IsFull()) {
       return ERROR_INSANE;
     }
 
+    if (b.info.numkeys==0) {
+      // Only an empty tree's root has no keys
+      return b.info.nodetype==BTREE_ROOT_NODE ? ERROR_NOERROR : ERROR_INSANE;
+    }
+
+    if (learned) { 
+      // A model in use must put every key of the node in its window
+      map<SIZE_T, BTreeNodeModel>::const_iterator m=models.find(node);
+      if (m!=models.end() && !(*m).second.stale && (*m).second.numkeys==b.info.numkeys) { 
+        for (offset=0; offset<b.info.numkeys; offset++) { 
+          KEY_T key;
+          SIZE_T from, to;
+          rc = b.GetKey(offset,key);
+          if (rc) { return rc; }
+          (*m).second.Predict(key,from,to);
+          if (offset<from || offset>=to) { 
+            return ERROR_INSANE;
+          }
+        }
+      }
+    }
+
     for(offset=0; offset<=b.info.numkeys; offset++){
       rc = b.GetPtr(offset, ptr_ref);
       if(rc) {return rc;}
       rc = ISA_Tree(visited, ptr_ref);
       if (rc) { return rc; }
+      if (b.info.format & BTREE_FORMAT_COUNTED) { 
+        // The count must be the keys the child has below it
+        BTreeNode child;
+        SIZE_T count;
+        rc = child.Unserialize(buffercache, ptr);
+        if (rc) { return rc; }
+        rc = b.GetCount(offset, count);
+        if (rc) { return rc; }
+        if (count!=child.View().GetSubtreeCount()) { 
+          return ERROR_INSANE;
+        }
+      }
     }
     return ERROR_NOERROR;
     break;
   case BTREE_LEAF_NODE:
-    if (b.info.numkeys >= b.info.GetNumSlotsAsLeaf()) {
+    if (b.View().IsFull()) {
+      return ERROR_INSANE;
+    }
+    if (buffers.count(node)) { 
+      // Messages only wait in interior nodes
       return ERROR_INSANE;
     }
+    for (offset=0; !IsUnique() && offset<b.info.numkeys; offset++) { 
+      VALUE_T list;
+      rc = b.GetVal(offset,list);
+      if (rc) { return rc; }
+      rc = CheckPostings(list);
+      if (rc) { return rc; }
+    }
+    if (bloombits) { 
+      // Every key must get past the filters it is under
+      map<SIZE_T, BTreeBloomFilter>::const_iterator f=leaffilters.find(node);
+      for (offset=0; offset<b.info.numkeys; offset++) { 
+        KEY_T key;
+        rc = b.GetKey(offset,key);
+        if (rc) { return rc; }
+        if ((indexfiltered && !indexfilter.MayContain(key)) ||
+            (f!=leaffilters.end() && !(*f).second.MayContain(key))) { 
+          return ERROR_INSANE;
+        }
+      }
+    }
     return ERROR_NOERROR;
     break;
   default:
@@ -1105,12 +4343,91 @@ ERROR_T BTreeIndex::ISA_Tree(set<SIZE_T> visited, const SIZE_T &node) const
   return ERROR_INSANE;
 }
 
+ERROR_T BTreeIndex::GetHeight(SIZE_T &height) const
+{
+  BTreeNodeView b;
+  SIZE_T node=superblock.info.rootnode;
+  ERROR_T rc;
+
+  height=0;
+  for (;;) { 
+    rc = b.Pin(buffercache,node);
+    if (rc) { return rc; }
+    height++;
+    if (b.info->nodetype==BTREE_LEAF_NODE || b.info->numkeys==0) { 
+      return ERROR_NOERROR;
+    }
+    rc = b.GetPtr(0,node);
+    if (rc) { return rc; }
+  }
+}
+
+ERROR_T BTreeIndex::CollectLeaves(const SIZE_T &node, list<SIZE_T> &leaves) const
+{
+  BTreeNode b;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  rc = b.Unserialize(buffercache,node);
+  if (rc) { return rc; }
+
+  if (b.info.nodetype==BTREE_LEAF_NODE) { 
+    leaves.push_back(node);
+    return ERROR_NOERROR;
+  }
+  for (SIZE_T offset=0;b.info.numkeys>0 && offset<=b.info.numkeys;offset++) { 
+    rc = b.GetPtr(offset,ptr);
+    if (rc) { return rc; }
+    rc = CollectLeaves(ptr,leaves);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
 ERROR_T BTreeIndex::SanityCheck() const
 {
   set<SIZE_T> visited;
   SIZE_T root = superblock.info.rootnode;
-  return ISA_Tree(visited, root);
+  ERROR_T rc;
+
+  rc = ISA_Tree(visited, root);
+  if (rc) { return rc; }
 
+  // The buffers must hold the messages they are counted as holding
+  SIZE_T messages=0;
+  for (map<SIZE_T, BTreeMessageBuffer>::const_iterator i=buffers.begin();i!=buffers.end();++i) { 
+    SIZE_T bytes=0;
+    for (BTreeMessages::const_iterator m=(*i).second.messages.begin();m!=(*i).second.messages.end();++m) { 
+      bytes+=MessageBytes((*m).first,(*m).second);
+    }
+    if (bytes!=(*i).second.bytes) { 
+      return ERROR_INSANE;
+    }
+    messages+=(*i).second.messages.size();
+  }
+  if (messages!=bufferedmessages) { 
+    return ERROR_INSANE;
+  }
+
+  // Following the leaf chain from the first leaf must visit the
+  // leaves in the same order as the tree does
+  list<SIZE_T> leaves;
+  BTreeNode b;
+  SIZE_T next;
+
+  rc = CollectLeaves(root,leaves);
+  if (rc) { return rc; }
+  for (list<SIZE_T>::const_iterator i=leaves.begin();i!=leaves.end();) { 
+    rc = b.Unserialize(buffercache,*i);
+    if (rc) { return rc; }
+    rc = b.GetPtr(0,next);
+    if (rc) { return rc; }
+    ++i;
+    if (next != (i==leaves.end() ? 0 : *i)) { 
+      return ERROR_INSANE;
+    }
+  }
+  return ERROR_NOERROR;
 }
 
 
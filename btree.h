@@ -4,6 +4,9 @@
 #include <iostream>
 #include <string>
 #include <list>
+#include <map>
+#include <deque>
+#include <vector>
 #include <set>
 
 #include "global.h"
@@ -43,24 +46,464 @@ enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP}
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
+// What an insert does with a full node: split it in two, or first
+// even it out with a sibling that has room, and split it and a full
+// sibling three ways when neither has (B* style)
+enum BTreeOverflowPolicy {BTREE_OVERFLOW_SPLIT, BTREE_OVERFLOW_SHARE};
+
+//
+// A cursor over all the values of one key, opened by
+// BTreeIndex::LookupAll.  An inline posting list is copied into the
+// cursor; an overflow one is read a posting block at a time, keeping
+// the block it is on pinned, so a hot key's values come off a few
+// blocks in order rather than off a leaf per value.  The tree must not
+// be changed while a cursor is open on it.
+//
+class BTreePostingCursor {
+ public:
+  BTreePostingCursor();
+
+  // Starts on list, the value of a slot of a leaf whose metadata is
+  // info.  Without BTREE_FORMAT_POSTINGS list is the key's one value.
+  ERROR_T Open(BufferCache *cache, const NodeMetadata &info, const VALUE_T &list);
+
+  // Gives the key's next value, in the order they were inserted
+  // return ERROR_NONEXISTENT once they are used up
+  ERROR_T Next(VALUE_T &value);
+
+  // Releases the block early; Next then returns ERROR_NONEXISTENT
+  void Close();
+
+  bool IsOpen() const { return left>0; }
+
+  // Values the key has, given or not
+  SIZE_T GetCount() const { return count; }
+
+ private:
+  BufferCache  *cache;
+  SIZE_T        format;
+  SIZE_T        valuesize;
+  VALUE_T       list;
+  bool          overflow;
+  BTreeNodeView block;   // posting block being read (overflow)
+  SIZE_T        offset;  // next byte of list or block to read
+  SIZE_T        count;
+  SIZE_T        left;
+
+  BTreePostingCursor(const BTreePostingCursor &rhs) { throw GenericException(); }
+  BTreePostingCursor & operator=(const BTreePostingCursor &rhs) { throw GenericException(); return *this; }
+};
+
+//
+// A forward cursor over a range of keys, opened by BTreeIndex::Scan.
+// It keeps the leaf it is on pinned and moves to the next one through
+// the leaf chain, so each leaf is read once and no interior node is
+// read after the first descent.  The tree must not be changed while a
+// cursor is open on it.
+//
+class BTreeCursor {
+ public:
+  BTreeCursor();
+
+  // Gives the next key and value in key order, and each value of a
+  // key of a non-unique index in turn
+  // return ERROR_NONEXISTENT once the range is used up
+  ERROR_T Next(KEY_T &key, VALUE_T &value);
+
+  // Releases the leaf early; Next then returns ERROR_NONEXISTENT
+  void Close();
+
+  bool IsOpen() const { return leaf.IsPinned(); }
+
+ private:
+  friend class BTreeIndex;
+
+  BufferCache  *cache;
+  BTreeNodeView leaf;
+  SIZE_T        offset;  // next slot of leaf to give
+  KEY_T         hi;
+  bool          bounded;
+  BTreePostingCursor postings;  // values of key still to give
+  KEY_T         key;
+
+  BTreeCursor(const BTreeCursor &rhs) { throw GenericException(); }
+  BTreeCursor & operator=(const BTreeCursor &rhs) { throw GenericException(); return *this; }
+};
+
+//
+// The sorted input to BTreeIndex::BulkLoad
+//
+class BTreeLoadSource {
+ public:
+  virtual ~BTreeLoadSource() {}
+
+  // Gives the next key and value
+  // return ERROR_NONEXISTENT after the last one
+  virtual ERROR_T Next(KEY_T &key, VALUE_T &value)=0;
+};
+
+// The nodes of one level of a tree that BulkLoad is building
+struct BulkLoadLevel;
+
+// Every interior node has at least two children and block numbers
+// are 32 bits, so no tree is deeper than this
+#define BTREE_MAX_DEPTH 32
+
+//
+// The way from the root down to a node, as found by a descent.
+// node[0] is the root and node[depth-1] the node reached, and
+// slot[i] is the pointer of node[i] that leads to node[i+1], so a
+// split or merge finds its place in the parent without searching it.
+// slot[depth-1] is where a key was last put into the node reached, if
+// anywhere, which Split uses to spot keys being appended.
+//
+struct BTreePath {
+  SIZE_T depth;
+  SIZE_T node[BTREE_MAX_DEPTH];
+  SIZE_T slot[BTREE_MAX_DEPTH];
+
+  BTreePath() : depth(0) {}
+};
+
+//
+// A Bloom filter over keys, as BTreeIndex keeps in memory for the
+// whole index and for each leaf (see SetBloomFilters).  MayContain is
+// only false for a key that was never added.  The filter is sized for
+// capacity keys at bitsperkey bits each; once more have been added it
+// is full, and should be rebuilt bigger.
+//
+class BTreeBloomFilter {
+ public:
+  BTreeBloomFilter();
+  BTreeBloomFilter(const SIZE_T capacity, const SIZE_T bitsperkey);
+
+  void Add(const KEY_T &key);
+  bool MayContain(const KEY_T &key) const;
+
+  bool IsFull() const { return count>capacity; }
+
+ private:
+  vector<unsigned int> bits;
+  SIZE_T numbits;
+  SIZE_T numhashes;
+  SIZE_T capacity;
+  SIZE_T count;
+};
+
+//
+// A linear model of where the keys of an interior node are, as
+// BTreeIndex keeps in memory for each node (see SetLearnedModels).
+// Every key of the node begins with lead, and is read as a number from
+// the 8 bytes after it (see KeyBits).  Scaled to run from 0 at the
+// node's first key to 1 at its last, that number u puts the key within
+// error slots of slope*u+intercept.
+//
+struct BTreeNodeModel {
+  KEY_T  lead;
+  unsigned long long first, last;
+  double slope, intercept;
+  SIZE_T error;
+  SIZE_T numkeys;   // keys the node had when the model was made
+  bool   stale;     // the node has changed since
+
+  BTreeNodeModel();
+
+  // Fits the model to b's keys
+  ERROR_T Train(const BTreeNodeView &b);
+
+  // The slots from..to-1 of the node that the first key >= key is
+  // among, or is just past
+  void    Predict(const KEY_T &key, SIZE_T &from, SIZE_T &to) const;
+};
+
+//
+// Orders keys as the tree does, byte by byte with a shorter key
+// first, for keeping them in a map
+//
+struct BTreeKeyLess {
+  bool operator()(const KEY_T &a, const KEY_T &b) const;
+};
+
+//
+// A change on its way down to the leaves in a message buffer (see
+// BTreeIndex::SetMessageBuffers): the key's new value, or with
+// remove, its deletion
+//
+struct BTreeMessage {
+  bool    remove;
+  VALUE_T value;
+
+  BTreeMessage() : remove(true) {}
+  BTreeMessage(const VALUE_T &value) : remove(false), value(value) {}
+};
+
+typedef map<KEY_T, BTreeMessage, BTreeKeyLess> BTreeMessages;
+
+// The messages waiting in one interior node, the latest for each key,
+// and the bytes they take up
+struct BTreeMessageBuffer {
+  BTreeMessages messages;
+  SIZE_T        bytes;
+
+  BTreeMessageBuffer() : bytes(0) {}
+};
+
 class BTreeIndex {
  private:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
 
+  BTreeSearchType searchtype;
+  BTreeOverflowPolicy overflowpolicy;
+  bool         appendsplits;
+  SIZE_T       nodesearches, keycompares;
+
+  // The upper level nodes kept pinned in the buffer cache for the
+  // descent to read in place (see SetPinnedLevels), by block number
+  SIZE_T       pinnedlevels, pinnedbytes;
+  map<SIZE_T, Block *> pinned;
+
+  // The leaf the last Insert went to (0 if none), the way down to it,
+  // and the keys it covers, from lastlo up to but not including
+  // lasthi (empty for no bound).  Anything that moves keys between
+  // leaves or changes the interior nodes forgets it.
+  SIZE_T       lastleaf;
+  BTreePath    lastpath;
+  KEY_T        lastlo, lasthi;
+
+  // Bloom filters of bloombits bits per key (none if 0, see
+  // SetBloomFilters) of the keys in the whole index, which is good
+  // only while indexfiltered, and in each leaf, by block number.
+  SIZE_T       bloombits;
+  BTreeBloomFilter indexfilter;
+  bool         indexfiltered;
+  map<SIZE_T, BTreeBloomFilter> leaffilters;
+  SIZE_T       filteredlookups;
+
+  // Models of the interior nodes, by block number, if learned (see
+  // SetLearnedModels)
+  bool         learned;
+  map<SIZE_T, BTreeNodeModel> models;
+  SIZE_T       modelsearches;
+
+  // Buffers of messages on their way down to the leaves, of up to
+  // bufferbytes bytes each (none if 0, see SetMessageBuffers), by
+  // block number of the interior node they wait in.  flushing is set
+  // while messages are being applied to the leaves.
+  SIZE_T       bufferbytes;
+  map<SIZE_T, BTreeMessageBuffer> buffers;
+  SIZE_T       bufferedmessages;
+  bool         flushing;
+
  protected:
 
-  ERROR_T      AllocateNode(SIZE_T &node);
+  // writesuperblock=false leaves the superblock's new free list
+  // to be written by the caller
+  ERROR_T      AllocateNode(SIZE_T &node, const bool writesuperblock=true);
+
+  // Allocate a node and pin it as a fresh, empty node of the given type
+  ERROR_T      AllocateNode(SIZE_T &node, BTreeNodeView &view, const int nodetype);
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
-  ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
-				      const BTreeOp op, 
+  // The frame of node if it is a pinned upper level node, else 0
+  Block       *GetPinnedNode(const SIZE_T &node);
+  // Keeps node, which the descent reached depth levels down, pinned
+  // if it is an interior node within the levels and bytes allowed
+  ERROR_T      PinUpperNode(const SIZE_T &node, const SIZE_T depth);
+  // Releases node if it is pinned, or all the upper nodes
+  void         UnpinUpperNode(const SIZE_T &node);
+  void         UnpinUpperNodes();
+
+  // Gives the two halves of a split node the longest key prefixes
+  // their bounds allow (BTREE_FORMAT_PREFIX).  left is the original
+  // node, split_key separates the halves, and path ends at left.
+  ERROR_T      SplitPrefixes(const BTreePath &path, BTreeNodeView &left,
+			     BTreeNodeView &right, const KEY_T &split_key);
+
+  // Moves the slots of orig_node from k1 on (the ones after k1, which
+  // goes up, for an interior node) into a new node, which goes into
+  // the leaf chain after it.  split_key is set to the key to put
+  // between them in the parent.  path ends at orig_node.
+  ERROR_T      SplitNode(const BTreePath &path, BTreeNodeView &orig_node, const SIZE_T k1,
+			 SIZE_T &new_block_loc, BTreeNodeView &new_node, KEY_T &split_key);
+
+  // Sets append if the full node b at the end of path looks to be
+  // taking keys in ascending order: the key last put into it is its
+  // last, and it is the last node on its level
+  ERROR_T      IsAppend(const BTreePath &path, const BTreeNodeView &b, bool &append);
+
+  // BTREE_OVERFLOW_SHARE's alternative to splitting the full node at
+  // the end of path in two.  shared is false, and an ordinary split is
+  // wanted, if the parent is too full or the nodes too small to share.
+  // parentfull is set if sharing has filled the parent.
+  ERROR_T      ShareOverflow(BTreePath &path, bool &shared, bool &parentfull);
+
+  // The key to put between two adjacent leaves in their parent:
+  // right's first key, or with BTREE_FORMAT_TRUNCATE the shortest key
+  // above left's last one that is no more than that.
+  ERROR_T      LeafSeparator(const BTreeNodeView &left, const BTreeNodeView &right,
+			     KEY_T &separator) const;
+
+  // Moves everything in right, and the separator between them if they
+  // are interior nodes, onto the end of left.  merged is false and
+  // neither node is changed if the result would not fit.  With
+  // toroot, left is about to become the root, so it drops its prefix.
+  ERROR_T      MergeSiblings(BTreeNodeView &left, BTreeNodeView &right,
+			     const KEY_T &separator, const bool toroot, bool &merged);
+
+  // Evens out two adjacent siblings by moving slots from the fuller one
+  // to the other, through the separator between them for interior
+  // nodes.  separator is updated to the new one.  moved is set to the
+  // number of slots moved.
+  ERROR_T      Redistribute(BTreeNodeView &left, BTreeNodeView &right,
+			    KEY_T &separator, SIZE_T &moved);
+
+  // The in-node search used by every path through the tree.  node is
+  // b's block number, if b is an interior node on a descent, for its
+  // model to narrow the search (see SetLearnedModels).
+  SIZE_T       SearchNode(const BTreeNodeView &b, const KEY_T &key, bool &found,
+			  const SIZE_T node=0);
+
+  // Learned models (see SetLearnedModels).  ForgetModel leaves the
+  // model of a node that is about to change unused until the node is
+  // trained again; DropModel drops it for a block that is being
+  // allocated or freed.
+  void         ForgetModel(const SIZE_T node);
+  void         DropModel(const SIZE_T node) { models.erase(node); }
+
+  // Message buffers (see SetMessageBuffers).  Buffering is true if
+  // changes go into them rather than to the leaves.  FindMessage
+  // walks down to the leaf level for the latest message for key.
+  // PutMessage puts one into the root's buffer.  AddMessage puts one
+  // into node's, replacing any for the same key, and FlushBuffer
+  // sends the messages of a buffer over its size down a child at a
+  // time.  ApplyMessage makes the change a message stands for.
+  // RerouteMessages moves the messages of children from..to of
+  // parent to the child each now belongs under, after keys have moved
+  // between them, and MoveMessages moves all of from's into to's,
+  // where they take the place of any older ones.  DropBuffer drops
+  // node's buffer.
+  bool         Buffering() const { return bufferbytes>0 && !flushing && IsUnique(); }
+  ERROR_T      FindMessage(const KEY_T &key, BTreeMessage &message, bool &found);
+  ERROR_T      PutMessage(const KEY_T &key, const BTreeMessage &message);
+  void         AddMessage(const SIZE_T node, const KEY_T &key, const BTreeMessage &message);
+  ERROR_T      FlushBuffer(const SIZE_T node);
+  ERROR_T      ApplyMessage(const KEY_T &key, const BTreeMessage &message);
+  ERROR_T      RerouteMessages(const BTreeNodeView &parent, const SIZE_T from, const SIZE_T to);
+  void         MoveMessages(const SIZE_T from, const SIZE_T to);
+  void         DropBuffer(const SIZE_T node);
+
+  // Walks from the root down to the leaf for key, leaving it pinned
+  // in leaf and the way there in path.  If fence is given, it is set
+  // to the separator right of the last child taken that has one, and
+  // left alone if the leaf is the last one.  lo likewise gets the
+  // separator left of the last child taken that has one.
+  // return ERROR_NONEXISTENT (with leaf unpinned) if the tree is empty
+  ERROR_T      FindLeaf(const KEY_T &key, BTreeNodeView &leaf, BTreePath &path,
+			KEY_T *fence=0, KEY_T *lo=0);
+
+  // As FindLeaf, but first tries the leaf the last insert went to,
+  // and remembers the one it finds for the next
+  ERROR_T      FindInsertLeaf(const KEY_T &key, BTreeNodeView &leaf, BTreePath &path);
+
+  void         ForgetLastLeaf() { lastleaf=0; }
+
+  // Bloom filters (see SetBloomFilters).  IndexMayContain and
+  // LeafMayContain clear maybe if key is surely not in the index, or
+  // in leaf b, first building the filter they need if it is missing.
+  // FilterIndex builds the whole index one, and FilterLeaf b's.
+  // RefilterLeaf rebuilds b's filter, if it has one, after keys have
+  // moved into it.  FilterInsert adds a key just put into leaf node.
+  // All do nothing (and leave maybe set) without filters.
+  ERROR_T      IndexMayContain(const KEY_T &key, bool &maybe);
+  ERROR_T      LeafMayContain(const BTreeNodeView &b, const KEY_T &key, bool &maybe);
+  ERROR_T      FilterIndex();
+  ERROR_T      FilterLeaf(const BTreeNodeView &b);
+  ERROR_T      RefilterLeaf(const BTreeNodeView &b);
+  void         FilterInsert(const SIZE_T node, const KEY_T &key);
+  void         ForgetLeafFilter(const SIZE_T node) { leaffilters.erase(node); }
+  void         ForgetFilters();
+
+  // The value at offset of leaf b, or with BTREE_FORMAT_POSTINGS the
+  // first value of its posting list
+  ERROR_T      GetLeafValue(const BTreeNodeView &b, const SIZE_T offset, VALUE_T &value);
+
+  // Sets the value at offset of leaf b, or with BTREE_FORMAT_POSTINGS
+  // replaces its posting list with one holding just value
+  ERROR_T      SetLeafValue(BTreeNodeView &b, const SIZE_T offset, const VALUE_T &value);
+
+  // Posting lists (BTREE_FORMAT_POSTINGS).
+  //
+  // MakePostings builds the list of values, in the leaf if it fits in
+  // GetMaxValueLength() bytes and otherwise in a new chain of posting
+  // blocks.  AddPosting puts value on the end of the list at offset of
+  // leaf b, moving it out to posting blocks once it is too long.
+  // RemovePosting takes the first value equal to value off it, moving
+  // it back into the leaf once it is short enough, and drops the slot
+  // once it is empty (ERROR_NONEXISTENT if value isn't there).
+  // FreePostings gives a list's posting blocks back to the free list.
+  ERROR_T      MakePostings(const vector<VALUE_T> &values, VALUE_T &list);
+  ERROR_T      AddPosting(BTreeNodeView &b, const SIZE_T offset, const VALUE_T &value);
+  ERROR_T      RemovePosting(BTreeNodeView &b, const SIZE_T offset, const VALUE_T &value);
+  ERROR_T      FreePostings(const VALUE_T &list);
+  ERROR_T      ReadPostings(const VALUE_T &list, vector<VALUE_T> &values) const;
+  ERROR_T      CheckPostings(const VALUE_T &list) const;
+
+  // Subtree counts (BTREE_FORMAT_COUNTED).  AdjustCounts adds delta
+  // to the count of each pointer taken on path, for a leaf at its end
+  // that has gained or lost keys.  RecountSlots sets the counts of
+  // pointers from..to of parent from the children, after keys have
+  // moved between them.  Both do nothing without counts.
+  ERROR_T      AdjustCounts(const BTreePath &path, const int delta);
+  ERROR_T      RecountSlots(BTreeNodeView &parent, const SIZE_T from, const SIZE_T to);
+
+  // The number of keys below key, from one descent
+  ERROR_T      RankInternal(const KEY_T &key, SIZE_T &rank);
+
+  // An update that grows a varlen value may split the leaf
+  ERROR_T      LookupOrUpdateInternal(const BTreeOp op, 
 				      const KEY_T &key,
 				      VALUE_T &val);
   
 
+  // BulkLoad's steps: put a key and value (leaf) or a separator and
+  // the child to its right, with its count (interior), on the end of a level, and write
+  // a finished node and pass it up to the level above.  lo and hi are
+  // the separators either side of the node.
+  ERROR_T      BulkLoadAdd(deque<BulkLoadLevel> &levels, const SIZE_T level,
+			   const KEY_T &key, const VALUE_T &value, const SIZE_T ptr,
+			   const SIZE_T count);
+  ERROR_T      BulkLoadWrite(deque<BulkLoadLevel> &levels, const SIZE_T level,
+			     BTreeNode &node, SIZE_T &loc, const KEY_T &lo,
+			     const KEY_T &hi, const SIZE_T next);
+  ERROR_T      BulkLoadFinish(deque<BulkLoadLevel> &levels);
+
+  // Looks up keys[order[first]] ... keys[order[last-1]], which are in
+  // key order, in the subtree under node (depth levels below the
+  // root), splitting them among its children so that each node is
+  // read once
+  ERROR_T      MultiLookupNode(const SIZE_T node, const SIZE_T depth,
+			       const vector<KEY_T> &keys, const vector<SIZE_T> &order,
+			       const SIZE_T first, const SIZE_T last,
+			       vector<VALUE_T> &values, vector<ERROR_T> &results);
+
+  // Merges the batch pairs[order[first]], pairs[order[first+1]], ...
+  // that are below hi (all of them if hi is 0) into leaf b in one
+  // pass, stopping before one that would overfill it.  next is set to
+  // the first one not taken.  conflict is set if any were skipped.
+  ERROR_T      LeafMergeBatch(BTreeNodeView &b, const vector<KeyValuePair> &pairs,
+			      const vector<SIZE_T> &order, const SIZE_T first,
+			      const KEY_T *hi, SIZE_T &next, bool &conflict);
+
+  // Builds the first two leaves under an empty root, with key in
+  // the right one
+  ERROR_T      InsertFirst(const KEY_T &key, const VALUE_T &value);
+
+  // Appends the leaves under node to leaves, left to right
+  ERROR_T      CollectLeaves(const SIZE_T &node, list<SIZE_T> &leaves) const;
+
   ERROR_T      DisplayInternal(const SIZE_T &node,
 			       ostream &o, 
 			       const BTreeDisplayType display_type=BTREE_DEPTH) const;
@@ -74,11 +517,19 @@ public:
   // and actually write the data in the superblock.
   // otherwise, the expectation is that keysize and valuesize
   // will be zero and will be read when Attach(initialblock,false) is 
-  // invoked
+  // invoked.  format (BTREE_FORMAT_*) is likewise only used on creation.
   BTreeIndex(SIZE_T keysize, 
 	     SIZE_T valuesize,
 	     BufferCache *cache,
-	     bool unique=true);   // true if a  key maps to a single value
+	     bool unique=true,   // true if a  key maps to a single value
+	     SIZE_T format=BTREE_FORMAT_PLAIN);
+  // unique=false adds BTREE_FORMAT_POSTINGS to format, which makes a
+  // non-unique index: Insert adds a value to a key that is there
+  // rather than failing, and the key is stored once with a posting
+  // list of its values.  Lookup gives a key's first value, LookupAll
+  // all of them, and Scan each in turn.  Update and Upsert replace a
+  // key's values with the one given; Delete(key) drops them all and
+  // Delete(key,value) just the one.
 
 
   BTreeIndex();
@@ -95,6 +546,7 @@ public:
   // you need to find the elements of the tree.
   // return zero on success or ERROR_NOTANINDEX if we are
   // giving you an incorrect block to start with
+  // return ERROR_BADCONFIG if asked to create an unknown format
   ERROR_T Attach(const SIZE_T initblock, const bool create=false );
   
   // This is called after all inserts, updates, or deletes are done.
@@ -104,17 +556,29 @@ public:
  
   // Our functions
   //
-  // Inserter, called by Insert
-  ERROR_T Inserter(list<SIZE_T> crumbs, const SIZE_T &node, const KEY_T &key, const VALUE_T &value);
+  // LeafNodeInsert, called by Insert with the leaf at the end of
+  // path pinned in b
+  ERROR_T LeafNodeInsert(BTreePath &path, BTreeNodeView &b, const KEY_T&, const VALUE_T&); 
 
-  // LeafNodeInsert, called by Inserter
-  ERROR_T LeafNodeInsert(list<SIZE_T> crumbs, const SIZE_T &node, BTreeNode &b, const KEY_T&, const VALUE_T&); 
+  // The rest of LeafNodeInsert once the key's place in the leaf is
+  // known
+  ERROR_T LeafInsertAt(BTreePath &path, BTreeNodeView &b, const SIZE_T offset,
+		       const KEY_T&, const VALUE_T&);
 
-  // Splitter function
-  ERROR_T Split(list<SIZE_T> crumbs);
+  // Splits the full node at the end of path and puts the new
+  // separator into its parent, working up the path while that fills
+  // the parent too.  A split root gets a new root above it.  path is
+  // used up.  A node is split in the middle, unless the key last put
+  // into it is its last and it is the last node on its level, when
+  // keys are likely being appended and it keeps all but a slot or so.
+  ERROR_T Split(BTreePath &path);
 
-  // Insert a pointer into an Internal node and call split if necessary
-  ERROR_T InteriorPointerInsert(list<SIZE_T>, const KEY_T &key, const SIZE_T &ptr);
+  // Rebalance, called by Delete.  If the node at the end of path has
+  // fallen below its fill bound, it borrows from or merges with a
+  // sibling, working up the path while merges leave parents
+  // underfull.  A root left with one child is replaced by it.  path
+  // is used up.
+  ERROR_T Rebalance(BTreePath &path);
   
   //
   //
@@ -124,24 +588,104 @@ public:
   // return ERROR_SIZE if the key or value are the wrong size for this index
   // return ERROR_CONFLICT if the key already exists and it's a unique index
   ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+
+  // A leaf with BTREE_FORMAT_POSTINGS adds the value to a key that is
+  // already there
+  bool IsUnique() const { return !(superblock.info.format & BTREE_FORMAT_POSTINGS); }
   
+  // Inserts a batch of pairs in any order.  The batch is sorted, and
+  // the pairs bound for the same leaf go into it together, with one
+  // descent and at most one split.  Pairs whose keys are already in
+  // the index, or earlier in the batch, are skipped.  A non-unique
+  // index takes the pairs one Insert at a time.
+  // return zero on success
+  // return ERROR_CONFLICT if any pairs were skipped (the rest are inserted)
+  // return ERROR_SIZE if any key or value is the wrong size (none are inserted)
+  // return ERROR_NOSPACE if you run out of disk space
+  ERROR_T InsertBatch(const vector<KeyValuePair> &pairs);
+
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
   ERROR_T Update(const KEY_T &key, const VALUE_T &value);
+
+  // Sets the key's value, inserting the key if it isn't there, with
+  // one descent rather than Insert's and then Update's
+  // return zero on success
+  // return ERROR_SIZE if the key or value are the wrong size for this index
+  // return ERROR_NOSPACE if you run out of disk space
+  ERROR_T Upsert(const KEY_T &key, const VALUE_T &value);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
+  // Nodes emptied by the delete go back on the free list.
   ERROR_T Delete(const KEY_T &key);
+
+  // Deletes one value of the key, and the key with its last value
+  // return zero on success
+  // return ERROR_NONEXISTENT  if the key doesn't have the value
+  // return ERROR_SIZE if the key or value are the wrong size for this index
+  ERROR_T Delete(const KEY_T &key, const VALUE_T &value);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
+  // Opens cursor on all of the key's values (just the one for a
+  // unique index)
+  // return zero on success
+  // return ERROR_NONEXISTENT  if the key doesn't exist
+  // return ERROR_SIZE if the key is the wrong size for this index
+  ERROR_T LookupAll(const KEY_T &key, BTreePostingCursor &cursor);
+
+  // Looks up a batch of keys with one descent for the lot: the keys
+  // are sorted, and each node on the way to any of them is read once.
+  // values[i] and results[i] are keys[i]'s value and Lookup's result
+  // for it (zero, ERROR_NONEXISTENT, or ERROR_SIZE).
+  // return zero unless the tree can't be read
+  ERROR_T MultiLookup(const vector<KEY_T> &keys, vector<VALUE_T> &values,
+		      vector<ERROR_T> &results);
+
+  // Builds the tree bottom up from keys that arrive in increasing
+  // order, packing each node to fill (0.5 to 1) of its capacity and
+  // writing each block once.  The index must be empty.  A non-unique
+  // index takes runs of equal keys, each as one posting list.  If a key is
+  // out of order or the wrong size, or the source fails, the keys
+  // before it are loaded and the error is returned.
+  // return zero on success
+  // return ERROR_CONFLICT if the index is not empty or a key is not
+  //   above the one before it
+  // return ERROR_SIZE if a key or value is the wrong size for this index
+  // return ERROR_BADCONFIG if fill is out of range
+  // return ERROR_NOSPACE if you run out of disk space
+  ERROR_T BulkLoad(BTreeLoadSource &source, const double fill=1.0);
+
+  // Opens cursor on the keys k with lo <= k < hi.  An empty lo starts
+  // at the first key and an empty hi runs to the last one.
+  // return zero on success, even if no keys are in the range
+  // return ERROR_SIZE if lo or hi are the wrong size for this index
+  ERROR_T Scan(const KEY_T &lo, const KEY_T &hi, BTreeCursor &cursor);
+
+  // Order statistics, for an index created with BTREE_FORMAT_COUNTED.
+  // Each follows one path from the root per key, using the counts of
+  // keys kept with every interior pointer.
+  //
+  // Rank gives the number of keys below key (an empty key has rank 0)
+  // Select gives the key of rank k, the (k+1)th smallest, and its value
+  // CountRange gives the number of keys k with lo <= k < hi, with empty
+  // lo and hi as for Scan
+  // return zero on success
+  // return ERROR_NONEXISTENT if there are no more than k keys (Select)
+  // return ERROR_SIZE if a key is the wrong size for this index
+  // return ERROR_BADCONFIG if the index has no counts
+  ERROR_T Rank(const KEY_T &key, SIZE_T &rank);
+  ERROR_T Select(const SIZE_T k, KEY_T &key, VALUE_T &value);
+  ERROR_T CountRange(const KEY_T &lo, const KEY_T &hi, SIZE_T &count);
+
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
-  // a valid use ratio?
+  // a valid use ratio?  Does the leaf chain link the leaves in order?
   ERROR_T SanityCheck() const;
   ERROR_T ISA_Tree(set<SIZE_T> visited, const SIZE_T &node) const;
   // Display tree
@@ -158,6 +702,92 @@ public:
   
 
   ostream & Print(ostream &os) const;
+
+  // How nodes are searched (SIMD by default)
+  void SetSearchType(const BTreeSearchType type) { searchtype=type; }
+  BTreeSearchType GetSearchType() const { return searchtype; }
+
+  // What to do with a full node (splitting by default).  Sharing
+  // leaves nodes fuller, at the cost of reading a sibling.
+  void SetOverflowPolicy(const BTreeOverflowPolicy policy) { overflowpolicy=policy; }
+  BTreeOverflowPolicy GetOverflowPolicy() const { return overflowpolicy; }
+
+  // Whether a node that keys are being appended to is split near its
+  // end rather than in the middle (on by default), so ascending
+  // inserts leave full nodes behind them
+  void SetAppendSplits(const bool on) { appendsplits=on; }
+  bool GetAppendSplits() const { return appendsplits; }
+
+  // Keeps Bloom filters of bitsperkey bits per key in memory, one of
+  // all the keys in the index and one per leaf, so that Lookup,
+  // LookupAll, MultiLookup and Update of a key that isn't there can
+  // mostly stop before the descent, or at the leaf without searching
+  // it.  A filter is built when a lookup first needs it: the whole
+  // index one by reading every leaf, and a leaf's when it is read.
+  // Inserts add to the filters and deletes leave them be, so a
+  // deleted key may still get past them.  0, the default, keeps none.
+  void   SetBloomFilters(const SIZE_T bitsperkey);
+  SIZE_T GetBloomFilters() const { return bloombits; }
+  // Lookups that a filter stopped
+  SIZE_T GetNumFilteredLookups() const { return filteredlookups; }
+
+  // Keeps a linear model of each interior node in memory, which
+  // predicts where a key is in the node, so that a descent only
+  // searches the few slots either side of the prediction that the
+  // model's error allows.  It suits read-mostly indexes: a model is
+  // made when a descent first reads the node, or by TrainModels, and
+  // BulkLoad makes them all.  A node that changes is searched as usual
+  // until TrainModels makes it a new one.  Off by default.
+  void    SetLearnedModels(const bool on);
+  bool    GetLearnedModels() const { return learned; }
+  // Makes models of every interior node without a good one
+  ERROR_T TrainModels();
+  // Node searches that a model narrowed
+  SIZE_T  GetNumModelSearches() const { return modelsearches; }
+
+  // Gives each interior node a buffer, of up to bytes bytes, for the
+  // changes made by Insert, Update, Upsert and Delete (B-epsilon tree
+  // style).  A change goes into the root's buffer as a message, and a
+  // buffer that fills sends the messages for whichever child has the
+  // most down to it in one batch, so a leaf is written once for many
+  // changes rather than once for each.  Lookup and MultiLookup see
+  // buffered messages on the way down; anything else that reads the
+  // tree flushes them all first, as does Detach.  Upsert reads
+  // nothing, but the others still look the key up for their result.
+  // The buffers are kept in memory, like the cache's dirty blocks, so
+  // they can be bigger than a block; the bigger they are, the more
+  // changes go into a leaf each time it is written.  0, the default,
+  // keeps none, and changing the size flushes every message.
+  // return ERROR_BADCONFIG for a non-unique index
+  ERROR_T SetMessageBuffers(const SIZE_T bytes);
+  SIZE_T  GetMessageBuffers() const { return bufferbytes; }
+  // Applies every buffered message to the leaves
+  ERROR_T FlushMessages();
+  // Messages waiting in the buffers
+  SIZE_T  GetNumBufferedMessages() const { return bufferedmessages; }
+
+  SIZE_T GetNumNodeSearches() const { return nodesearches; }
+  SIZE_T GetNumKeyCompares() const { return keycompares; }
+
+  // Keeps the nodes of the top levels levels of the tree (the root's
+  // is the first) pinned in the buffer cache, so the leaves don't
+  // push them out and the descent reads them in place without asking
+  // the cache.
+  // If bytes is not zero, no more than that many bytes of blocks are
+  // kept, nearest the root first; pass BTREE_MAX_DEPTH levels to
+  // limit by bytes alone.  Leaves are never kept.  0 levels, the
+  // default, keeps none.  Nodes are pinned as descents first reach
+  // them, and dropped when the root changes or they are freed.  Call
+  // Detach (or SetPinnedLevels(0)) before detaching the cache.
+  void   SetPinnedLevels(const SIZE_T levels, const SIZE_T bytes=0);
+  SIZE_T GetNumPinnedNodes() const { return pinned.size(); }
+
+  // Levels of nodes from the root down to the leaves (just 1, the
+  // root, for an empty tree)
+  ERROR_T GetHeight(SIZE_T &height) const;
+
+  // The superblock as of the last change (root node, sizes, format)
+  const NodeMetadata &GetSuperblockInfo() const { return superblock.info; }
   
 };
 
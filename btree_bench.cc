@@ -0,0 +1,1337 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <set>
+#include "btree.h"
+#include "btree_simd.h"
+#include "btree_typed.h"
+
+void usage()
+{
+  cerr << "usage: btree_bench filestem cachesize keysize valuesize numkeys workload [format]\n";
+  cerr << "  Creates a new index on the disk, in the given node format (see sim),\n";
+  cerr << "  and runs workload against it.\n";
+  cerr << "  workload is one of\n";
+  cerr << "    search  - insert numkeys random keys, then look each of them up\n";
+  cerr << "              using each in-node search in turn (linear, binary,\n";
+  cerr << "              SIMD with each kernel, interpolation)\n";
+  cerr << "    ids     - insert numkeys random 64 bit keys, then look each of them\n";
+  cerr << "              up using binary and then interpolation in-node search\n";
+  cerr << "              (keysize 8)\n";
+  cerr << "    typed   - insert numkeys random 64 bit keys, then look each of them\n";
+  cerr << "              up through BTreeIndex and then TypedBTreeIndex\n";
+  cerr << "              (keysize 8, valuesize 8 or 32, plain format)\n";
+  cerr << "    scan    - insert numkeys random keys, then read them back in\n";
+  cerr << "              ranges of 100 by Lookup of each key and then by Scan\n";
+  cerr << "    load    - insert numkeys random keys in key order, delete them,\n";
+  cerr << "              and then load them again with BulkLoad\n";
+  cerr << "    batch   - insert numkeys random keys one at a time, delete them,\n";
+  cerr << "              and then insert them again with InsertBatch, 10000\n";
+  cerr << "              at a time\n";
+  cerr << "    share   - insert numkeys random keys one at a time, delete them,\n";
+  cerr << "              and then insert them again with the B* style\n";
+  cerr << "              BTREE_OVERFLOW_SHARE policy\n";
+  cerr << "    append  - insert numkeys random keys in key order, splitting full\n";
+  cerr << "              nodes in the middle, delete them, and then insert them\n";
+  cerr << "              again with append splits\n";
+  cerr << "    pinned  - insert numkeys random keys, then look up numkeys random\n";
+  cerr << "              ones with the top 0, 1, 2, and 3 levels pinned\n";
+  cerr << "    upsert  - insert numkeys random keys, then write numkeys keys, half\n";
+  cerr << "              of them new, by Insert and then Update if the key is\n";
+  cerr << "              there, and numkeys more by Upsert\n";
+  cerr << "    multi   - insert numkeys random keys, then look up numkeys random\n";
+  cerr << "              ones one at a time and then with MultiLookup, 50\n";
+  cerr << "              and then 500 at a time\n";
+  cerr << "    churn   - insert numkeys random keys, then in each of 10 rounds\n";
+  cerr << "              delete numkeys of them and insert as many new ones,\n";
+  cerr << "              and finally delete them all, reporting blocks in use\n";
+  cerr << "              and tree height as it goes\n";
+  cerr << "    postings - insert numkeys values under numkeys/50 random keys, a\n";
+  cerr << "              tenth of them under one hot key, then read back every\n";
+  cerr << "              key's values.  A unique index (run without the\n";
+  cerr << "              postings format) makes each pair a key of its own by\n";
+  cerr << "              ending the key with a count and reads them with Scan;\n";
+  cerr << "              a postings index reads them with LookupAll\n";
+  cerr << "    rank    - insert numkeys random keys, then count the keys in\n";
+  cerr << "              1000 random ranges by Scan and then by CountRange,\n";
+  cerr << "              and find the median key by Select (counted format)\n";
+  cerr << "    bloom   - insert numkeys random keys, then look up numkeys keys,\n";
+  cerr << "              half of them missing, without and with Bloom filters\n";
+  cerr << "    learned - load numkeys random keys with BulkLoad, then look each of\n";
+  cerr << "              them up without and then with learned models of the\n";
+  cerr << "              interior nodes\n";
+  cerr << "    buffered - insert numkeys random keys, then delete them, without\n";
+  cerr << "              and then with message buffers of half a block, 4\n";
+  cerr << "              blocks and 16 blocks, by Insert and by Upsert,\n";
+  cerr << "              reporting disk traffic\n";
+}
+
+
+static const char *keybytes="abcdefghijklmnopqrstuvwxyz0123456789";
+
+static string MakeRandom(const SIZE_T len)
+{
+  string s(len,' ');
+  for (SIZE_T i=0;i<len;i++) {
+    s[i]=keybytes[rand()%36];
+  }
+  return s;
+}
+
+
+static ERROR_T InsertRandom(BTreeIndex &btree, const SIZE_T keysize, const SIZE_T valuesize,
+			    const SIZE_T numkeys, vector<string> &keys)
+{
+  ERROR_T rc;
+
+  while (keys.size()<numkeys) {
+    string key=MakeRandom(keysize);
+    rc=btree.Insert(KEY_T(key.c_str()),VALUE_T(MakeRandom(valuesize).c_str()));
+    if (rc==ERROR_CONFLICT) {
+      continue;
+    }
+    if (rc) {
+      cerr << "Can't insert due to error "<<rc<<endl;
+      return rc;
+    }
+    keys.push_back(key);
+  }
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T SearchWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			      const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  vector<string> keys;
+  ERROR_T rc;
+  const int numtypes=6;
+  const BTreeSearchType types[numtypes] = {BTREE_SEARCH_LINEAR, BTREE_SEARCH_BINARY,
+					   BTREE_SEARCH_SIMD, BTREE_SEARCH_SIMD, BTREE_SEARCH_SIMD,
+					   BTREE_SEARCH_INTERPOLATION};
+  const KeySearchKernel kernels[numtypes] = {KEY_KERNEL_SCALAR, KEY_KERNEL_SCALAR,
+					     KEY_KERNEL_SCALAR, KEY_KERNEL_SSE2, KEY_KERNEL_AVX2,
+					     KEY_KERNEL_SCALAR};
+  const char *names[numtypes] = {"linear", "binary", "scalar", "sse2", "avx2", "interp"};
+  KeySearchKernel best=GetKeySearchKernel();
+
+  if ((rc=InsertRandom(btree,keysize,valuesize,numkeys,keys))) {
+    return rc;
+  }
+
+  cout << "search      lookups  nodes/lookup  compares/node  cpu seconds\n";
+
+  for (int t=0;t<numtypes;t++) {
+    btree.SetSearchType(types[t]);
+    if (SetKeySearchKernel(kernels[t])) {
+      // This CPU can't run it
+      continue;
+    }
+
+    SIZE_T nodes=btree.GetNumNodeSearches();
+    SIZE_T compares=btree.GetNumKeyCompares();
+    KEY_T key(keys[0].c_str());
+    VALUE_T value;
+    clock_t start=clock();
+
+    for (SIZE_T i=0;i<keys.size();i++) {
+      memcpy(key.data,keys[i].data(),keysize);
+      if ((rc=btree.Lookup(key,value))) {
+	cerr << "Can't lookup due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+
+    double cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+    nodes=btree.GetNumNodeSearches()-nodes;
+    compares=btree.GetNumKeyCompares()-compares;
+
+    cout << names[t] << "\t" << keys.size()
+	 << "\t" << (double)nodes/keys.size()
+	 << "\t" << (double)compares/nodes
+	 << "\t" << cpu << endl;
+  }
+
+  btree.SetSearchType(BTREE_SEARCH_SIMD);
+  SetKeySearchKernel(best);
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T IdsWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			   const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  vector<string> keys;
+  KEY_T key(keysize);
+  ERROR_T rc;
+  const int numtypes=2;
+  const BTreeSearchType types[numtypes] = {BTREE_SEARCH_BINARY, BTREE_SEARCH_INTERPOLATION};
+  const char *names[numtypes] = {"binary", "interp"};
+
+  if (keysize!=8) {
+    cerr << "ids needs keysize 8\n";
+    return ERROR_SIZE;
+  }
+
+  // Evenly spread over all 64 bit numbers, big endian so that their
+  // byte order is their numeric order
+  while (keys.size()<numkeys) {
+    string k(keysize,' ');
+    for (SIZE_T i=0;i<keysize;i++) {
+      k[i]=(char)(rand()>>4);
+    }
+    memcpy(key.data,k.data(),keysize);
+    rc=btree.Insert(key,VALUE_T(MakeRandom(valuesize).c_str()));
+    if (rc==ERROR_CONFLICT) {
+      continue;
+    }
+    if (rc) {
+      cerr << "Can't insert due to error "<<rc<<endl;
+      return rc;
+    }
+    keys.push_back(k);
+  }
+
+  cout << "search      lookups  nodes/lookup  compares/node  cpu seconds\n";
+
+  for (int t=0;t<numtypes;t++) {
+    btree.SetSearchType(types[t]);
+
+    SIZE_T nodes=btree.GetNumNodeSearches();
+    SIZE_T compares=btree.GetNumKeyCompares();
+    VALUE_T value;
+    clock_t start=clock();
+
+    for (SIZE_T i=0;i<keys.size();i++) {
+      memcpy(key.data,keys[i].data(),keysize);
+      if ((rc=btree.Lookup(key,value))) {
+	cerr << "Can't lookup due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+
+    double cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+    nodes=btree.GetNumNodeSearches()-nodes;
+    compares=btree.GetNumKeyCompares()-compares;
+
+    cout << names[t] << "\t" << keys.size()
+	 << "\t" << (double)nodes/keys.size()
+	 << "\t" << (double)compares/nodes
+	 << "\t" << cpu << endl;
+  }
+
+  btree.SetSearchType(BTREE_SEARCH_SIMD);
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T ScanWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			    const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const SIZE_T rangelen=100;
+  vector<string> keys;
+  ERROR_T rc;
+
+  if ((rc=InsertRandom(btree,keysize,valuesize,numkeys,keys))) {
+    return rc;
+  }
+  sort(keys.begin(),keys.end());
+
+  SIZE_T numranges=(keys.size()+rangelen-1)/rangelen;
+  KEY_T key(keys[0].c_str());
+  VALUE_T value;
+
+  cout << "range       ranges  blocks read/range  cpu seconds\n";
+
+  SIZE_T reads=cache.GetNumReads();
+  clock_t start=clock();
+  for (SIZE_T i=0;i<keys.size();i++) {
+    memcpy(key.data,keys[i].data(),keysize);
+    if ((rc=btree.Lookup(key,value))) {
+      cerr << "Can't lookup due to error "<<rc<<endl;
+      return rc;
+    }
+  }
+  cout << "lookup\t" << numranges
+       << "\t" << (double)(cache.GetNumReads()-reads)/numranges
+       << "\t" << (double)(clock()-start)/CLOCKS_PER_SEC << endl;
+
+  reads=cache.GetNumReads();
+  start=clock();
+  for (SIZE_T i=0;i<keys.size();i+=rangelen) {
+    BTreeCursor cursor;
+    KEY_T lo(keys[i].c_str());
+    KEY_T hi;
+    SIZE_T n=0;
+    if (i+rangelen<keys.size()) {
+      hi=KEY_T(keys[i+rangelen].c_str());
+    }
+    if ((rc=btree.Scan(lo,hi,cursor))) {
+      cerr << "Can't scan due to error "<<rc<<endl;
+      return rc;
+    }
+    while ((rc=cursor.Next(key,value))==ERROR_NOERROR) {
+      n++;
+    }
+    if (rc!=ERROR_NONEXISTENT || n!=min(rangelen,(SIZE_T)keys.size()-i)) {
+      cerr << "Scan returned the wrong keys"<<endl;
+      return ERROR_INSANE;
+    }
+  }
+  cout << "scan\t" << numranges
+       << "\t" << (double)(cache.GetNumReads()-reads)/numranges
+       << "\t" << (double)(clock()-start)/CLOCKS_PER_SEC << endl;
+
+  return ERROR_NOERROR;
+}
+
+
+// Gives BulkLoad the pairs in a pair of vectors
+class VectorLoadSource : public BTreeLoadSource {
+ public:
+  VectorLoadSource(const vector<string> &keys, const vector<string> &values) :
+    keys(keys), values(values), next(0) {}
+
+  ERROR_T Next(KEY_T &key, VALUE_T &value) {
+    if (next==keys.size()) {
+      return ERROR_NONEXISTENT;
+    }
+    key=KEY_T(keys[next].c_str());
+    value=VALUE_T(values[next].c_str());
+    next++;
+    return ERROR_NOERROR;
+  }
+
+ private:
+  const vector<string> &keys;
+  const vector<string> &values;
+  SIZE_T next;
+};
+
+
+static ERROR_T LoadReport(BTreeIndex &btree, BufferCache &cache, const char *phase,
+			  const SIZE_T numkeys, const SIZE_T blocks, const SIZE_T writes,
+			  const double cpu)
+{
+  SIZE_T height;
+  ERROR_T rc;
+
+  if ((rc=btree.GetHeight(height)) || (rc=btree.SanityCheck())) {
+    cerr << "Tree is broken after "<<phase<<", error "<<rc<<endl;
+    return rc;
+  }
+  cout << phase << "\t" << numkeys
+       << "\t" << blocks
+       << "\t" << writes
+       << "\t" << height
+       << "\t" << cpu << endl;
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T LoadWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			    const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  set<string> unique;
+  vector<string> keys, values;
+  ERROR_T rc;
+
+  while (unique.size()<numkeys) {
+    unique.insert(MakeRandom(keysize));
+  }
+  keys.assign(unique.begin(),unique.end());
+  for (SIZE_T i=0;i<keys.size();i++) {
+    values.push_back(MakeRandom(valuesize));
+  }
+
+  cout << "phase    keys  blocks  writes  height  cpu seconds\n";
+
+  SIZE_T blocks=cache.GetNumAllocs()-cache.GetNumDeallocs();
+  SIZE_T writes=cache.GetNumWrites();
+  clock_t start=clock();
+  for (SIZE_T i=0;i<keys.size();i++) {
+    if ((rc=btree.Insert(KEY_T(keys[i].c_str()),VALUE_T(values[i].c_str())))) {
+      cerr << "Can't insert due to error "<<rc<<endl;
+      return rc;
+    }
+  }
+  double cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+  if ((rc=LoadReport(btree,cache,"insert",keys.size(),
+		     cache.GetNumAllocs()-cache.GetNumDeallocs()-blocks,
+		     cache.GetNumWrites()-writes,cpu))) {
+    return rc;
+  }
+
+  for (SIZE_T i=0;i<keys.size();i++) {
+    if ((rc=btree.Delete(KEY_T(keys[i].c_str())))) {
+      cerr << "Can't delete due to error "<<rc<<endl;
+      return rc;
+    }
+  }
+
+  VectorLoadSource source(keys,values);
+  blocks=cache.GetNumAllocs()-cache.GetNumDeallocs();
+  writes=cache.GetNumWrites();
+  start=clock();
+  if ((rc=btree.BulkLoad(source))) {
+    cerr << "Can't bulk load due to error "<<rc<<endl;
+    return rc;
+  }
+  cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+  return LoadReport(btree,cache,"bulkload",keys.size(),
+		    cache.GetNumAllocs()-cache.GetNumDeallocs()-blocks,
+		    cache.GetNumWrites()-writes,cpu);
+}
+
+
+static ERROR_T BatchWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			     const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const SIZE_T batchsize=10000;
+  set<string> unique;
+  vector<KeyValuePair> pairs;
+  ERROR_T rc;
+
+  while (pairs.size()<numkeys) {
+    string key=MakeRandom(keysize);
+    if (unique.insert(key).second) {
+      pairs.push_back(KeyValuePair(KEY_T(key.c_str()),VALUE_T(MakeRandom(valuesize).c_str())));
+    }
+  }
+
+  cout << "phase    keys  blocks  writes  height  cpu seconds\n";
+
+  SIZE_T blocks=cache.GetNumAllocs()-cache.GetNumDeallocs();
+  SIZE_T writes=cache.GetNumWrites();
+  clock_t start=clock();
+  for (SIZE_T i=0;i<pairs.size();i++) {
+    if ((rc=btree.Insert(pairs[i].key,pairs[i].value))) {
+      cerr << "Can't insert due to error "<<rc<<endl;
+      return rc;
+    }
+  }
+  double cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+  if ((rc=LoadReport(btree,cache,"insert",pairs.size(),
+		     cache.GetNumAllocs()-cache.GetNumDeallocs()-blocks,
+		     cache.GetNumWrites()-writes,cpu))) {
+    return rc;
+  }
+
+  for (SIZE_T i=0;i<pairs.size();i++) {
+    if ((rc=btree.Delete(pairs[i].key))) {
+      cerr << "Can't delete due to error "<<rc<<endl;
+      return rc;
+    }
+  }
+
+  blocks=cache.GetNumAllocs()-cache.GetNumDeallocs();
+  writes=cache.GetNumWrites();
+  start=clock();
+  for (SIZE_T i=0;i<pairs.size();i+=batchsize) {
+    vector<KeyValuePair> batch(pairs.begin()+i,pairs.begin()+min(i+batchsize,(SIZE_T)pairs.size()));
+    if ((rc=btree.InsertBatch(batch))) {
+      cerr << "Can't insert batch due to error "<<rc<<endl;
+      return rc;
+    }
+  }
+  cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+  return LoadReport(btree,cache,"batch",pairs.size(),
+		    cache.GetNumAllocs()-cache.GetNumDeallocs()-blocks,
+		    cache.GetNumWrites()-writes,cpu);
+}
+
+
+static ERROR_T ShareWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			     const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  set<string> unique;
+  vector<string> keys, values;
+  ERROR_T rc;
+
+  while (keys.size()<numkeys) {
+    string key=MakeRandom(keysize);
+    if (unique.insert(key).second) {
+      keys.push_back(key);
+      values.push_back(MakeRandom(valuesize));
+    }
+  }
+
+  cout << "phase    keys  blocks  writes  height  cpu seconds\n";
+
+  const BTreeOverflowPolicy policies[2] = {BTREE_OVERFLOW_SPLIT, BTREE_OVERFLOW_SHARE};
+  const char *names[2] = {"split", "share"};
+
+  for (int p=0;p<2;p++) {
+    btree.SetOverflowPolicy(policies[p]);
+
+    SIZE_T blocks=cache.GetNumAllocs()-cache.GetNumDeallocs();
+    SIZE_T writes=cache.GetNumWrites();
+    clock_t start=clock();
+    for (SIZE_T i=0;i<keys.size();i++) {
+      if ((rc=btree.Insert(KEY_T(keys[i].c_str()),VALUE_T(values[i].c_str())))) {
+	cerr << "Can't insert due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+    double cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+    if ((rc=LoadReport(btree,cache,names[p],keys.size(),
+		       cache.GetNumAllocs()-cache.GetNumDeallocs()-blocks,
+		       cache.GetNumWrites()-writes,cpu))) {
+      return rc;
+    }
+
+    for (SIZE_T i=0;i<keys.size();i++) {
+      if ((rc=btree.Delete(KEY_T(keys[i].c_str())))) {
+	cerr << "Can't delete due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+  }
+
+  btree.SetOverflowPolicy(BTREE_OVERFLOW_SPLIT);
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T AppendWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			      const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  set<string> unique;
+  vector<string> keys, values;
+  ERROR_T rc;
+
+  while (unique.size()<numkeys) {
+    unique.insert(MakeRandom(keysize));
+  }
+  keys.assign(unique.begin(),unique.end());
+  for (SIZE_T i=0;i<keys.size();i++) {
+    values.push_back(MakeRandom(valuesize));
+  }
+
+  cout << "phase    keys  blocks  writes  height  cpu seconds\n";
+
+  const bool appendsplits[2] = {false, true};
+  const char *names[2] = {"middle", "append"};
+
+  for (int p=0;p<2;p++) {
+    btree.SetAppendSplits(appendsplits[p]);
+
+    SIZE_T blocks=cache.GetNumAllocs()-cache.GetNumDeallocs();
+    SIZE_T writes=cache.GetNumWrites();
+    clock_t start=clock();
+    for (SIZE_T i=0;i<keys.size();i++) {
+      if ((rc=btree.Insert(KEY_T(keys[i].c_str()),VALUE_T(values[i].c_str())))) {
+	cerr << "Can't insert due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+    double cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+    if ((rc=LoadReport(btree,cache,names[p],keys.size(),
+		       cache.GetNumAllocs()-cache.GetNumDeallocs()-blocks,
+		       cache.GetNumWrites()-writes,cpu))) {
+      return rc;
+    }
+
+    for (SIZE_T i=0;i<keys.size();i++) {
+      if ((rc=btree.Delete(KEY_T(keys[i].c_str())))) {
+	cerr << "Can't delete due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+  }
+
+  btree.SetAppendSplits(true);
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T PinnedWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			      const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const SIZE_T maxlevels=3;
+  vector<string> keys;
+  ERROR_T rc;
+
+  if ((rc=InsertRandom(btree,keysize,valuesize,numkeys,keys))) {
+    return rc;
+  }
+
+  KEY_T key(keys[0].c_str());
+  VALUE_T value;
+
+  cout << "levels  lookups  pinned  reads/lookup  disk reads/lookup  cpu seconds\n";
+
+  for (SIZE_T levels=0;levels<=maxlevels;levels++) {
+    btree.SetPinnedLevels(levels);
+
+    SIZE_T reads=cache.GetNumReads();
+    SIZE_T diskreads=cache.GetNumDiskReads();
+    clock_t start=clock();
+
+    for (SIZE_T i=0;i<keys.size();i++) {
+      memcpy(key.data,keys[rand()%keys.size()].data(),keysize);
+      if ((rc=btree.Lookup(key,value))) {
+	cerr << "Can't lookup due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+
+    cout << levels << "\t" << keys.size()
+	 << "\t" << btree.GetNumPinnedNodes()
+	 << "\t" << (double)(cache.GetNumReads()-reads)/keys.size()
+	 << "\t" << (double)(cache.GetNumDiskReads()-diskreads)/keys.size()
+	 << "\t" << (double)(clock()-start)/CLOCKS_PER_SEC << endl;
+  }
+
+  btree.SetPinnedLevels(0);
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T UpsertWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			      const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  vector<string> keys;
+  set<string> unique;
+  ERROR_T rc;
+
+  if ((rc=InsertRandom(btree,keysize,valuesize,numkeys,keys))) {
+    return rc;
+  }
+  unique.insert(keys.begin(),keys.end());
+
+  // Each pass writes numkeys keys, half already in the index and half
+  // new, and the second pass's new keys are not the first's
+  vector<string> writes[2];
+  for (int p=0;p<2;p++) {
+    while (writes[p].size()<numkeys) {
+      if (writes[p].size()%2) {
+	writes[p].push_back(keys[rand()%keys.size()]);
+      } else {
+	string key=MakeRandom(keysize);
+	if (unique.insert(key).second) {
+	  writes[p].push_back(key);
+	}
+      }
+    }
+  }
+
+  cout << "method         writes  reads/write  disk reads/write  cpu seconds\n";
+
+  const char *names[2] = {"insert+update", "upsert"};
+
+  for (int p=0;p<2;p++) {
+    SIZE_T reads=cache.GetNumReads();
+    SIZE_T diskreads=cache.GetNumDiskReads();
+    clock_t start=clock();
+
+    for (SIZE_T i=0;i<writes[p].size();i++) {
+      KEY_T key(writes[p][i].c_str());
+      VALUE_T value(MakeRandom(valuesize).c_str());
+      if (p==0) {
+	rc=btree.Insert(key,value);
+	if (rc==ERROR_CONFLICT) {
+	  rc=btree.Update(key,value);
+	}
+      } else {
+	rc=btree.Upsert(key,value);
+      }
+      if (rc) {
+	cerr << "Can't write due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+
+    cout << names[p] << "\t" << writes[p].size()
+	 << "\t" << (double)(cache.GetNumReads()-reads)/writes[p].size()
+	 << "\t" << (double)(cache.GetNumDiskReads()-diskreads)/writes[p].size()
+	 << "\t" << (double)(clock()-start)/CLOCKS_PER_SEC << endl;
+
+    // Back to the starting keys for the next pass
+    for (SIZE_T i=0;i<writes[p].size();i+=2) {
+      if ((rc=btree.Delete(KEY_T(writes[p][i].c_str())))) {
+	cerr << "Can't delete due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+  }
+
+  return btree.SanityCheck();
+}
+
+
+static ERROR_T MultiWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			     const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const SIZE_T batchsizes[3] = {1, 50, 500};
+  vector<string> keys;
+  ERROR_T rc;
+
+  if ((rc=InsertRandom(btree,keysize,valuesize,numkeys,keys))) {
+    return rc;
+  }
+
+  cout << "batch  lookups  reads/lookup  disk reads/lookup  cpu seconds\n";
+
+  for (int s=0;s<3;s++) {
+    const SIZE_T batchsize=batchsizes[s];
+    SIZE_T reads=cache.GetNumReads();
+    SIZE_T diskreads=cache.GetNumDiskReads();
+    clock_t start=clock();
+
+    // Batches of 1 go through Lookup, the rest through MultiLookup
+    for (SIZE_T i=0;i<keys.size();i+=batchsize) {
+      vector<KEY_T> batch;
+      vector<VALUE_T> values;
+      vector<ERROR_T> results;
+      for (SIZE_T j=i;j<min(i+batchsize,(SIZE_T)keys.size());j++) {
+	batch.push_back(KEY_T(keys[rand()%keys.size()].c_str()));
+      }
+      if (batchsize==1) {
+	VALUE_T value;
+	rc=btree.Lookup(batch[0],value);
+      } else if (!(rc=btree.MultiLookup(batch,values,results))) {
+	for (SIZE_T j=0;j<results.size() && !rc;j++) {
+	  rc=results[j];
+	}
+      }
+      if (rc) {
+	cerr << "Can't lookup due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+
+    cout << batchsize << "\t" << keys.size()
+	 << "\t" << (double)(cache.GetNumReads()-reads)/keys.size()
+	 << "\t" << (double)(cache.GetNumDiskReads()-diskreads)/keys.size()
+	 << "\t" << (double)(clock()-start)/CLOCKS_PER_SEC << endl;
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T ChurnReport(BTreeIndex &btree, BufferCache &cache, const char *phase,
+			   const SIZE_T numkeys, const double cpu)
+{
+  SIZE_T height;
+  ERROR_T rc;
+
+  if ((rc=btree.GetHeight(height)) || (rc=btree.SanityCheck())) {
+    cerr << "Tree is broken after "<<phase<<", error "<<rc<<endl;
+    return rc;
+  }
+  cout << phase << "\t" << numkeys
+       << "\t" << cache.GetNumAllocs()-cache.GetNumDeallocs()
+       << "\t" << height
+       << "\t" << cpu << endl;
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T ChurnWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			     const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const int numrounds=10;
+  vector<string> keys;
+  ERROR_T rc;
+  clock_t start=clock();
+
+  if ((rc=InsertRandom(btree,keysize,valuesize,numkeys,keys))) {
+    return rc;
+  }
+
+  cout << "phase    keys  blocks  height  cpu seconds\n";
+
+  if ((rc=ChurnReport(btree,cache,"fill",keys.size(),(double)(clock()-start)/CLOCKS_PER_SEC))) {
+    return rc;
+  }
+
+  for (int r=1;r<=numrounds;r++) {
+    start=clock();
+    for (SIZE_T i=0;i<numkeys;i++) {
+      // Delete a random key, then insert a new one in its place
+      SIZE_T victim=rand()%keys.size();
+      if ((rc=btree.Delete(KEY_T(keys[victim].c_str())))) {
+	cerr << "Can't delete due to error "<<rc<<endl;
+	return rc;
+      }
+      keys[victim]=keys.back();
+      keys.pop_back();
+      if ((rc=InsertRandom(btree,keysize,valuesize,numkeys,keys))) {
+	return rc;
+      }
+    }
+    char phase[32];
+    sprintf(phase,"round %d",r);
+    if ((rc=ChurnReport(btree,cache,phase,keys.size(),(double)(clock()-start)/CLOCKS_PER_SEC))) {
+      return rc;
+    }
+  }
+
+  start=clock();
+  while (!keys.empty()) {
+    if ((rc=btree.Delete(KEY_T(keys.back().c_str())))) {
+      cerr << "Can't delete due to error "<<rc<<endl;
+      return rc;
+    }
+    keys.pop_back();
+  }
+  return ChurnReport(btree,cache,"empty",0,(double)(clock()-start)/CLOCKS_PER_SEC);
+}
+
+
+static ERROR_T PostingsWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+				const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const SIZE_T suffix=4;
+  set<string> unique;
+  vector<string> keys;
+  vector<SIZE_T> counts;
+  ERROR_T rc;
+
+  if (keysize<=suffix) {
+    cerr << "postings needs keys longer than "<<suffix<<" bytes\n";
+    return ERROR_SIZE;
+  }
+  while (unique.size()<max(numkeys/50,(SIZE_T)1)) {
+    unique.insert(MakeRandom(keysize-suffix));
+  }
+  keys.assign(unique.begin(),unique.end());
+  counts.assign(keys.size(),0);
+
+  cout << "phase    pairs  keys  blocks  height  reads/key  cpu seconds\n";
+
+  SIZE_T blocks=cache.GetNumAllocs()-cache.GetNumDeallocs();
+  clock_t start=clock();
+  for (SIZE_T i=0;i<numkeys;i++) {
+    SIZE_T k = rand()%10==0 ? 0 : rand()%keys.size();
+    char end[suffix+1];
+    // A unique index tells the pairs apart by a base 36 count on the
+    // end of the key; a postings index gives them all the same one
+    SIZE_T n = btree.IsUnique() ? counts[k] : 0;
+    for (SIZE_T j=0;j<suffix;j++,n/=36) {
+      end[suffix-1-j]=keybytes[n%36];
+    }
+    end[suffix]=0;
+    counts[k]++;
+    if ((rc=btree.Insert(KEY_T((keys[k]+end).c_str()),VALUE_T(MakeRandom(valuesize).c_str())))) {
+      cerr << "Can't insert due to error "<<rc<<endl;
+      return rc;
+    }
+  }
+  double cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+
+  SIZE_T height;
+  if ((rc=btree.GetHeight(height)) || (rc=btree.SanityCheck())) {
+    cerr << "Tree is broken after insert, error "<<rc<<endl;
+    return rc;
+  }
+  cout << "insert\t" << numkeys
+       << "\t" << keys.size()
+       << "\t" << cache.GetNumAllocs()-cache.GetNumDeallocs()-blocks
+       << "\t" << height
+       << "\t-"
+       << "\t" << cpu << endl;
+
+  SIZE_T reads=cache.GetNumReads();
+  SIZE_T found=0;
+  start=clock();
+  for (SIZE_T k=0;k<keys.size();k++) {
+    VALUE_T value;
+    if (btree.IsUnique()) {
+      BTreeCursor cursor;
+      KEY_T key;
+      rc=btree.Scan(KEY_T((keys[k]+string(suffix,' ')).c_str()),
+		    KEY_T((keys[k]+string(suffix,'~')).c_str()),cursor);
+      while (!rc && !(rc=cursor.Next(key,value))) {
+	found++;
+      }
+    } else {
+      BTreePostingCursor cursor;
+      rc=btree.LookupAll(KEY_T((keys[k]+string(suffix,keybytes[0])).c_str()),cursor);
+      while (!rc && !(rc=cursor.Next(value))) {
+	found++;
+      }
+    }
+    if (rc && rc!=ERROR_NONEXISTENT) {
+      cerr << "Can't read values due to error "<<rc<<endl;
+      return rc;
+    }
+  }
+  cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+  if (found!=numkeys) {
+    cerr << "Read "<<found<<" values, not "<<numkeys<<endl;
+    return ERROR_INSANE;
+  }
+  cout << "read\t" << found
+       << "\t" << keys.size()
+       << "\t-"
+       << "\t-"
+       << "\t" << (double)(cache.GetNumReads()-reads)/keys.size()
+       << "\t" << cpu << endl;
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T RankWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			    const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  const SIZE_T numranges=1000;
+  vector<string> keys;
+  vector<SIZE_T> scanned;
+  ERROR_T rc;
+
+  if (!(btree.GetSuperblockInfo().format & BTREE_FORMAT_COUNTED)) {
+    cerr << "rank needs the counted format\n";
+    return ERROR_BADCONFIG;
+  }
+  if ((rc=InsertRandom(btree,keysize,valuesize,numkeys,keys))) {
+    return rc;
+  }
+
+  // Ranges between random keys, each a random size
+  vector<pair<string,string> > ranges;
+  for (SIZE_T i=0;i<numranges;i++) {
+    string lo=keys[rand()%keys.size()];
+    string hi=keys[rand()%keys.size()];
+    ranges.push_back(lo<hi ? make_pair(lo,hi) : make_pair(hi,lo));
+  }
+
+  cout << "method      ranges  blocks read/range  cpu seconds\n";
+
+  SIZE_T reads=cache.GetNumReads();
+  clock_t start=clock();
+  for (SIZE_T i=0;i<numranges;i++) {
+    BTreeCursor cursor;
+    KEY_T key;
+    VALUE_T value;
+    SIZE_T n=0;
+    if ((rc=btree.Scan(KEY_T(ranges[i].first.c_str()),KEY_T(ranges[i].second.c_str()),cursor))) {
+      cerr << "Can't scan due to error "<<rc<<endl;
+      return rc;
+    }
+    while ((rc=cursor.Next(key,value))==ERROR_NOERROR) {
+      n++;
+    }
+    scanned.push_back(n);
+  }
+  cout << "scan\t" << numranges
+       << "\t" << (double)(cache.GetNumReads()-reads)/numranges
+       << "\t" << (double)(clock()-start)/CLOCKS_PER_SEC << endl;
+
+  reads=cache.GetNumReads();
+  start=clock();
+  for (SIZE_T i=0;i<numranges;i++) {
+    SIZE_T n;
+    if ((rc=btree.CountRange(KEY_T(ranges[i].first.c_str()),KEY_T(ranges[i].second.c_str()),n))) {
+      cerr << "Can't count due to error "<<rc<<endl;
+      return rc;
+    }
+    if (n!=scanned[i]) {
+      cerr << "CountRange gave "<<n<<" keys where Scan found "<<scanned[i]<<endl;
+      return ERROR_INSANE;
+    }
+  }
+  cout << "count\t" << numranges
+       << "\t" << (double)(cache.GetNumReads()-reads)/numranges
+       << "\t" << (double)(clock()-start)/CLOCKS_PER_SEC << endl;
+
+  KEY_T median;
+  VALUE_T value;
+  sort(keys.begin(),keys.end());
+  if ((rc=btree.Select(keys.size()/2,median,value))) {
+    cerr << "Can't select due to error "<<rc<<endl;
+    return rc;
+  }
+  if (string((const char *)median.data,median.length)!=keys[keys.size()/2]) {
+    cerr << "Select gave the wrong median"<<endl;
+    return ERROR_INSANE;
+  }
+  cout << "median\t" << keys[keys.size()/2] << endl;
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T BloomWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			     const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  vector<string> keys;
+  vector<string> lookups;
+  set<string> present;
+  ERROR_T rc;
+
+  if ((rc=InsertRandom(btree,keysize,valuesize,numkeys,keys))) {
+    return rc;
+  }
+  present.insert(keys.begin(),keys.end());
+
+  // Every other lookup misses
+  for (SIZE_T i=0;i<numkeys;i++) {
+    string key;
+    if (i%2==0) {
+      key=keys[rand()%keys.size()];
+    } else {
+      do {
+	key=MakeRandom(keysize);
+      } while (present.count(key));
+    }
+    lookups.push_back(key);
+  }
+
+  cout << "filters     lookups  blocks read/lookup  compares/lookup  filtered  cpu seconds\n";
+
+  // The first pass with filters builds them
+  const int numpasses=3;
+  const SIZE_T bits[numpasses] = {0, 10, 10};
+  const char *names[numpasses] = {"none", "cold", "warm"};
+
+  for (int p=0;p<numpasses;p++) {
+    if (p==0 || bits[p]!=bits[p-1]) {
+      btree.SetBloomFilters(bits[p]);
+    }
+
+    SIZE_T reads=cache.GetNumReads();
+    SIZE_T compares=btree.GetNumKeyCompares();
+    SIZE_T filtered=btree.GetNumFilteredLookups();
+    clock_t start=clock();
+
+    for (SIZE_T i=0;i<lookups.size();i++) {
+      VALUE_T value;
+      rc=btree.Lookup(KEY_T(lookups[i].c_str()),value);
+      if (rc!=(i%2==0 ? ERROR_NOERROR : ERROR_NONEXISTENT)) {
+	cerr << "Lookup gave the wrong answer "<<rc<<endl;
+	return rc ? rc : ERROR_INSANE;
+      }
+    }
+
+    double cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+
+    cout << names[p] << "\t" << lookups.size()
+	 << "\t" << (double)(cache.GetNumReads()-reads)/lookups.size()
+	 << "\t" << (double)(btree.GetNumKeyCompares()-compares)/lookups.size()
+	 << "\t" << btree.GetNumFilteredLookups()-filtered
+	 << "\t" << cpu << endl;
+  }
+
+  btree.SetBloomFilters(0);
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T LearnedWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+			       const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  set<string> unique;
+  vector<string> keys, values;
+  ERROR_T rc;
+
+  // Spread over every byte but 0, which would end the key early
+  while (unique.size()<numkeys) {
+    string k(keysize,' ');
+    for (SIZE_T i=0;i<keysize;i++) {
+      k[i]=(char)(1+rand()%255);
+    }
+    unique.insert(k);
+  }
+  keys.assign(unique.begin(),unique.end());
+  for (SIZE_T i=0;i<keys.size();i++) {
+    values.push_back(MakeRandom(valuesize));
+  }
+  VectorLoadSource source(keys,values);
+  if ((rc=btree.BulkLoad(source))) {
+    cerr << "Can't bulk load due to error "<<rc<<endl;
+    return rc;
+  }
+  random_shuffle(keys.begin(),keys.end());
+
+  cout << "models      lookups  compares/lookup  modelled/lookup  cpu seconds\n";
+
+  const int numpasses=2;
+  const bool learned[numpasses] = {false, true};
+  const char *names[numpasses] = {"none", "linear"};
+
+  for (int p=0;p<numpasses;p++) {
+    btree.SetLearnedModels(learned[p]);
+    if ((rc=btree.TrainModels())) {
+      cerr << "Can't train models due to error "<<rc<<endl;
+      return rc;
+    }
+
+    SIZE_T compares=btree.GetNumKeyCompares();
+    SIZE_T modelled=btree.GetNumModelSearches();
+    clock_t start=clock();
+
+    for (SIZE_T i=0;i<keys.size();i++) {
+      VALUE_T value;
+      if ((rc=btree.Lookup(KEY_T(keys[i].c_str()),value))) {
+	cerr << "Can't lookup due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+
+    double cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+
+    cout << names[p] << "\t" << keys.size()
+	 << "\t" << (double)(btree.GetNumKeyCompares()-compares)/keys.size()
+	 << "\t" << (double)(btree.GetNumModelSearches()-modelled)/keys.size()
+	 << "\t" << cpu << endl;
+  }
+
+  btree.SetLearnedModels(false);
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T BufferedWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T keysize,
+				const SIZE_T valuesize, const SIZE_T numkeys)
+{
+  set<string> unique;
+  vector<string> keys, values;
+  ERROR_T rc;
+
+  while (keys.size()<numkeys) {
+    string key=MakeRandom(keysize);
+    if (unique.insert(key).second) {
+      keys.push_back(key);
+      values.push_back(MakeRandom(valuesize));
+    }
+  }
+
+  cout << "buffers     keys  disk writes/key  disk reads/key  cpu seconds\n";
+
+  const int numpasses=7;
+  const SIZE_T block=cache.GetBlockSize();
+  const SIZE_T bytes[numpasses] = {0, block/2, block/2, 4*block, 4*block, 16*block, 16*block};
+  const bool upsert[numpasses] = {false, false, true, false, true, false, true};
+  const char *names[numpasses] = {"none", "1/2 insert", "1/2 upsert", "4 insert", "4 upsert",
+				  "16 insert", "16 upsert"};
+
+  for (int p=0;p<numpasses;p++) {
+    if ((rc=btree.SetMessageBuffers(bytes[p]))) {
+      cerr << "Can't set message buffers due to error "<<rc<<endl;
+      return rc;
+    }
+
+    SIZE_T diskwrites=cache.GetNumDiskWrites();
+    SIZE_T diskreads=cache.GetNumDiskReads();
+    clock_t start=clock();
+
+    for (SIZE_T i=0;i<keys.size();i++) {
+      KEY_T key(keys[i].c_str());
+      VALUE_T value(values[i].c_str());
+      if ((rc = upsert[p] ? btree.Upsert(key,value) : btree.Insert(key,value))) {
+	cerr << "Can't insert due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+    // Everything buffered is on its way to the leaves too
+    if ((rc=btree.FlushMessages())) {
+      cerr << "Can't flush messages due to error "<<rc<<endl;
+      return rc;
+    }
+
+    double cpu=(double)(clock()-start)/CLOCKS_PER_SEC;
+
+    cout << names[p] << "\t" << keys.size()
+	 << "\t" << (double)(cache.GetNumDiskWrites()-diskwrites)/keys.size()
+	 << "\t" << (double)(cache.GetNumDiskReads()-diskreads)/keys.size()
+	 << "\t" << cpu << endl;
+
+    if ((rc=btree.SetMessageBuffers(0))) {
+      return rc;
+    }
+    for (SIZE_T i=0;i<keys.size();i++) {
+      if ((rc=btree.Delete(KEY_T(keys[i].c_str())))) {
+	cerr << "Can't delete due to error "<<rc<<endl;
+	return rc;
+      }
+    }
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+struct Record32 {
+  char bytes[32];
+};
+
+
+template <class Value>
+static ERROR_T TypedWorkload(BTreeIndex &btree, BufferCache &cache, const SIZE_T numkeys)
+{
+  typedef TypedBTreeIndex<uint64_t,Value> Typed;
+  vector<uint64_t> keys;
+  KEY_T key(Typed::keysize);
+  VALUE_T value(Typed::valuesize);
+  ERROR_T rc;
+
+  while (keys.size()<numkeys) {
+    uint64_t k=((uint64_t)rand()<<32) ^ (uint64_t)rand();
+    Typed::KeyCodec::Encode(k,(char *)key.data);
+    memset(value.data,(int)k,value.length);
+    rc=btree.Insert(key,value);
+    if (rc==ERROR_CONFLICT) {
+      continue;
+    }
+    if (rc) {
+      cerr << "Can't insert due to error "<<rc<<endl;
+      return rc;
+    }
+    keys.push_back(k);
+  }
+
+  cout << "index       lookups  cpu seconds\n";
+
+  clock_t start=clock();
+  for (SIZE_T i=0;i<keys.size();i++) {
+    Typed::KeyCodec::Encode(keys[i],(char *)key.data);
+    if ((rc=btree.Lookup(key,value))) {
+      cerr << "Can't lookup due to error "<<rc<<endl;
+      return rc;
+    }
+  }
+  cout << "generic\t" << keys.size() << "\t" << (double)(clock()-start)/CLOCKS_PER_SEC << endl;
+
+  // A second handle on the same tree
+  Typed typed(&cache);
+  if ((rc=typed.Attach(0,false))) {
+    cerr << "Can't attach typed index due to error "<<rc<<endl;
+    return rc;
+  }
+
+  Value v;
+  start=clock();
+  for (SIZE_T i=0;i<keys.size();i++) {
+    if ((rc=typed.Lookup(keys[i],v))) {
+      cerr << "Can't lookup due to error "<<rc<<endl;
+      return rc;
+    }
+    if (*(BYTE_T *)&v!=(BYTE_T)keys[i]) {
+      cerr << "Typed lookup returned the wrong value"<<endl;
+      return ERROR_INSANE;
+    }
+  }
+  cout << "typed\t" << keys.size() << "\t" << (double)(clock()-start)/CLOCKS_PER_SEC << endl;
+
+  return ERROR_NOERROR;
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize, keysize, valuesize, numkeys;
+  SIZE_T superblocknum;
+  SIZE_T format=BTREE_FORMAT_PLAIN;
+  string workload;
+
+  if (argc!=7 && argc!=8) {
+    usage();
+    return -1;
+  }
+
+  if (argc==8 && ParseNodeFormat(argv[7],format)) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  keysize=atoi(argv[3]);
+  valuesize=atoi(argv[4]);
+  numkeys=atoi(argv[5]);
+  workload=argv[6];
+
+  srand(339);
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(keysize,valuesize,&cache,true,format);
+
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index created!"<<endl;
+    if (workload=="search") {
+      rc=SearchWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="ids") {
+      rc=IdsWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="scan") {
+      rc=ScanWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="load") {
+      rc=LoadWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="batch") {
+      rc=BatchWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="share") {
+      rc=ShareWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="append") {
+      rc=AppendWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="pinned") {
+      rc=PinnedWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="upsert") {
+      rc=UpsertWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="multi") {
+      rc=MultiWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="churn") {
+      rc=ChurnWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="bloom") {
+      rc=BloomWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="learned") {
+      rc=LearnedWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="buffered") {
+      rc=BufferedWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="rank") {
+      rc=RankWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="postings") {
+      rc=PostingsWorkload(btree,cache,keysize,valuesize,numkeys);
+    } else if (workload=="typed" && keysize==8 && valuesize==8 && format==BTREE_FORMAT_PLAIN) {
+      rc=TypedWorkload<uint64_t>(btree,cache,numkeys);
+    } else if (workload=="typed" && keysize==8 && valuesize==32 && format==BTREE_FORMAT_PLAIN) {
+      rc=TypedWorkload<Record32>(btree,cache,numkeys);
+    } else {
+      usage();
+      return -1;
+    }
+    if (rc) {
+      cerr <<"Workload failed due to error "<<rc<<endl;
+    }
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) {
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    return 0;
+  }
+}
+
+
+
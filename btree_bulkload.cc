@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string>
+#include "btree.h"
+
+void usage() 
+{
+  cerr << "usage: btree_bulkload filestem cachesize [fill]\n";
+  cerr << "  Loads \"key value\" pairs, one per line in increasing key order,\n";
+  cerr << "  from standard input into an empty btree, filling each node to\n";
+  cerr << "  fill (0.5 to 1, default 1) of its capacity.\n";
+}
+
+
+// Reads the pairs from a stream
+class StreamLoadSource : public BTreeLoadSource {
+ public:
+  StreamLoadSource(istream &in) : count(0), in(in) {}
+
+  ERROR_T Next(KEY_T &key, VALUE_T &value) {
+    string k, v;
+    if (!(in >> k >> v)) { 
+      return ERROR_NONEXISTENT;
+    }
+    key=KEY_T(k.c_str());
+    value=VALUE_T(v.c_str());
+    count++;
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T count;
+
+ private:
+  istream &in;
+};
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  double fill=1.0;
+
+  if (argc!=3 && argc!=4) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  if (argc==4) { 
+    fill=atof(argv[3]);
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+  
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) { 
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    StreamLoadSource source(cin);
+    if ((rc=btree.BulkLoad(source,fill))!=ERROR_NOERROR) { 
+      cerr <<"Bulk load failed: error "<<rc<<endl;
+      if (source.count>0) { 
+	cerr <<"The "<<source.count-1<<" pairs before line "<<source.count<<" were loaded\n";
+      }
+    } else {
+      cerr <<"Bulk load succeeded: "<<source.count<<" pairs\n";
+    }
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+    
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+    
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    return 0;
+  }
+}
+  
+
+  
@@ -7,6 +7,7 @@
 #include "buffercache.h"
 
 #include "btree.h"
+#include "btree_simd.h"
 
 using namespace std;
 
@@ -17,14 +18,53 @@ SIZE_T NodeMetadata::GetNumDataBytes() const
 }
 
 
+SIZE_T NodeMetadata::GetStoredKeySize() const
+{
+  return keysize-prefixlen;
+}
+
+
+SIZE_T NodeMetadata::GetStoredValueSize() const
+{
+  if (!(format & BTREE_FORMAT_POSTINGS)) { 
+    return valuesize;
+  }
+  // A new key's posting list: the tag and one value
+  return 1+valuesize+((format & BTREE_FORMAT_VARLEN) ? sizeof(unsigned short) : 0);
+}
+
+
+SIZE_T NodeMetadata::GetMaxValueLength() const
+{
+  if (!(format & BTREE_FORMAT_POSTINGS)) { 
+    return valuesize;
+  }
+  // An eighth of a leaf, so a split always leaves both halves room, but
+  // at least one value and the overflow form's tag, count and blocks
+  SIZE_T n=(GetNumDataBytes()-sizeof(SIZE_T))/8;
+  return max(n,max(GetStoredValueSize(),(SIZE_T)(1+3*sizeof(SIZE_T))));
+}
+
+
+SIZE_T NodeMetadata::GetPtrSize() const
+{
+  return (format & BTREE_FORMAT_COUNTED) ? 2*sizeof(SIZE_T) : sizeof(SIZE_T);
+}
+
+
+// The shared prefix takes prefixlen bytes off the end of the data area
 SIZE_T NodeMetadata::GetNumSlotsAsInterior() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
+  // A truncated separator also needs its REF, so this is how many
+  // full length ones fit
+  SIZE_T refsize = (format & (BTREE_FORMAT_TRUNCATE|BTREE_FORMAT_VARLEN)) ? sizeof(SIZE_T) : 0;
+  return (GetNumDataBytes()-GetPtrSize()-prefixlen)/(GetStoredKeySize()+GetPtrSize()+refsize);  // floor intended
 }
 
 SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize);  // floor intended
+  SIZE_T refsize = (format & (BTREE_FORMAT_VARLEN|BTREE_FORMAT_POSTINGS)) ? 2*sizeof(SIZE_T) : 0;
+  return (GetNumDataBytes()-sizeof(SIZE_T)-prefixlen)/(refsize+GetStoredKeySize()+GetStoredValueSize());  // floor intended
 }
 
 SIZE_T NodeMetadata::GetLowerBoundAsInterior() const
@@ -45,12 +85,51 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_SUPERBLOCK ? "SUPERBLOCK" :
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
-				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" :
+				   nodetype==BTREE_POSTING_NODE ? "POSTING_NODE" : "UNKNOWN_TYPE")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys;
+  if (format!=BTREE_FORMAT_PLAIN) { 
+    os << ", format="<<format<<", prefixlen="<<prefixlen<<", heapbytes="<<heapbytes;
+  }
+  os << ")";
   return os;
 }
 
+
+ERROR_T ParseNodeFormat(const char *names, SIZE_T &format)
+{
+  string s(names);
+  string::size_type start=0;
+
+  format=BTREE_FORMAT_PLAIN;
+
+  while (start<=s.size()) { 
+    string::size_type end=s.find(',',start);
+    if (end==string::npos) { 
+      end=s.size();
+    }
+    string name=s.substr(start,end-start);
+    if (name=="prefix") { 
+      format|=BTREE_FORMAT_PREFIX;
+    } else if (name=="truncate") { 
+      format|=BTREE_FORMAT_TRUNCATE;
+    } else if (name=="columnar") { 
+      format|=BTREE_FORMAT_COLUMNAR;
+    } else if (name=="varlen") { 
+      format|=BTREE_FORMAT_VARLEN;
+    } else if (name=="postings") { 
+      format|=BTREE_FORMAT_POSTINGS;
+    } else if (name=="counted") { 
+      format|=BTREE_FORMAT_COUNTED;
+    } else if (name!="plain") { 
+      return ERROR_BADCONFIG;
+    }
+    start=end+1;
+  }
+  return ERROR_NOERROR;
+}
+
 BTreeNode::BTreeNode() 
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
@@ -76,6 +155,9 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.rootnode=0;
   info.freelist=0;
   info.numkeys=0;				       
+  info.format=BTREE_FORMAT_PLAIN;
+  info.prefixlen=0;
+  info.heapbytes=0;
   data=0;
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
     data = new char [info.GetNumDataBytes()];
@@ -92,6 +174,9 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
   info.rootnode=rhs.info.rootnode;
   info.freelist=rhs.info.freelist;
   info.numkeys=rhs.info.numkeys;				       
+  info.format=rhs.info.format;
+  info.prefixlen=rhs.info.prefixlen;
+  info.heapbytes=rhs.info.heapbytes;
   data=0;
   if (rhs.data) { 
    data=new char [info.GetNumDataBytes()];
@@ -123,45 +208,450 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 
 ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 {
-  Block block;
+  Block *frame;
 
   ERROR_T rc;
 
-  rc=b->ReadBlock(blocknum,block);
+  SIZE_T oldbytes = data ? info.GetNumDataBytes() : 0;
+
+  rc=b->PinBlock(blocknum,frame);
 
   if (rc!=ERROR_NOERROR) {
     return rc;
   }
 
-  memcpy(&info,block.data,sizeof(info));
+  memcpy(&info,frame->data,sizeof(info));
   
-  if (data) { 
+  assert(b->GetBlockSize()==(unsigned)info.blocksize);
+
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
+    // Reuse our buffer if it is already the right size
+    if (data && oldbytes!=info.GetNumDataBytes()) { 
+      delete [] data;
+      data=0;
+    }
+    if (!data) { 
+      data = new char [info.GetNumDataBytes()];
+    }
+    memcpy(data,frame->data+sizeof(info),info.GetNumDataBytes());
+  } else if (data) { 
     delete [] data;
     data=0;
   }
+  
+  return b->UnpinBlock(frame);
+}
 
-  assert(b->GetBlockSize()==(unsigned)info.blocksize);
 
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
-    memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
+BTreeNodeView BTreeNode::View() const
+{
+  return BTreeNodeView(const_cast<NodeMetadata *>(&info),data);
+}
+
+
+char * BTreeNode::ResolveKey(const SIZE_T offset) const
+{
+  return View().ResolveKey(offset);
+}
+
+
+char * BTreeNode::ResolvePtr(const SIZE_T offset) const
+{
+  return View().ResolvePtr(offset);
+}
+
+
+char * BTreeNode::ResolveVal(const SIZE_T offset) const
+{
+  return View().ResolveVal(offset);
+}
+
+
+char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
+{
+  return View().ResolveKeyVal(offset);
+}
+
+ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
+{
+  return View().GetKey(offset,k);
+}
+
+ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
+{
+  return View().GetPtr(offset,ptr);
+}
+
+ERROR_T BTreeNode::GetCount(const SIZE_T offset, SIZE_T &c) const
+{
+  return View().GetCount(offset,c);
+}
+
+ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
+{
+  return View().GetVal(offset,v);
+}
+
+
+ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
+{
+  return View().GetKeyVal(offset,p);
+}
+
+
+ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
+{
+  return View().SetKey(offset,k);
+}
+
+
+ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
+{
+  return View().SetPtr(offset,ptr);
+}
+
+
+ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
+{
+  return View().SetVal(offset,v);
+}
+
+
+ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
+{
+  return View().SetKeyVal(offset,p);
+}
+
+
+BTreeNodeView::BTreeNodeView() : 
+  info(0), data(0), cache(0), frame(0), blocknum(0), dirty(false)
+{}
+
+
+BTreeNodeView::BTreeNodeView(NodeMetadata *i, char *d) : 
+  info(i), data(d), cache(0), frame(0), blocknum(0), dirty(false)
+{}
+
+
+BTreeNodeView::BTreeNodeView(const BTreeNodeView &rhs) :
+  info(rhs.info), data(rhs.data), cache(0), frame(0), blocknum(0), dirty(false)
+{
+  if (rhs.frame) { 
+    throw GenericException();
   }
-  
+}
+
+
+BTreeNodeView::~BTreeNodeView()
+{
+  Unpin();
+}
+
+
+ERROR_T BTreeNodeView::Pin(BufferCache *b, const SIZE_T block)
+{
+  ERROR_T rc;
+
+  Unpin();
+
+  rc=b->PinBlock(block,frame);
+
+  if (rc!=ERROR_NOERROR) { 
+    frame=0;
+    return rc;
+  }
+
+  cache=b;
+  blocknum=block;
+  dirty=false;
+  info=(NodeMetadata *)(frame->data);
+  data=(char *)(frame->data)+sizeof(NodeMetadata);
+
+  assert(b->GetBlockSize()==(unsigned)info->blocksize);
+
   return ERROR_NOERROR;
 }
 
 
-char * BTreeNode::ResolveKey(const SIZE_T offset) const
+ERROR_T BTreeNodeView::Unpin()
+{
+  ERROR_T rc=ERROR_NOERROR;
+
+  if (frame) { 
+    rc=cache->UnpinBlock(frame,dirty);
+    frame=0;
+    cache=0;
+    info=0;
+    data=0;
+    dirty=false;
+  }
+  return rc;
+}
+
+
+SIZE_T BTreeNodeView::GetSlotSize() const
 {
-  switch (info.nodetype) { 
+  switch (info->nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
-    break;
+    if (IsSlotted()) { 
+      return sizeof(SIZE_T)+info->GetPtrSize();
+    }
+    return info->GetStoredKeySize()+info->GetPtrSize();
   case BTREE_LEAF_NODE:
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    if (IsSlotted()) { 
+      return 2*sizeof(SIZE_T);
+    }
+    return info->GetStoredKeySize()+info->valuesize;
+  default:
+    return 0;
+  }
+}
+
+
+SIZE_T BTreeNodeView::GetHeadSize() const
+{
+  switch (info->nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    return info->GetPtrSize();
+  default:
+    return sizeof(SIZE_T);
+  }
+}
+
+
+SIZE_T BTreeNodeView::GetSubtreeCount() const
+{
+  SIZE_T total=0;
+  SIZE_T c;
+
+  if (info->nodetype==BTREE_LEAF_NODE) { 
+    return info->numkeys;
+  }
+  for (SIZE_T i=0;info->numkeys>0 && i<=info->numkeys;i++) { 
+    GetCount(i,c);
+    total+=c;
+  }
+  return total;
+}
+
+
+bool BTreeNodeView::IsSlotted() const
+{
+  switch (info->nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    return info->format & (BTREE_FORMAT_TRUNCATE|BTREE_FORMAT_VARLEN);
+  case BTREE_LEAF_NODE:
+    return info->format & (BTREE_FORMAT_VARLEN|BTREE_FORMAT_POSTINGS);
+  default:
+    return false;
+  }
+}
+
+
+bool BTreeNodeView::IsColumnar() const
+{
+  return (info->format & BTREE_FORMAT_COLUMNAR) && info->nodetype==BTREE_LEAF_NODE;
+}
+
+
+SIZE_T BTreeNodeView::GetKeyStride() const
+{
+  return IsColumnar() ? info->GetStoredKeySize() : GetSlotSize();
+}
+
+
+int BTreeNodeView::GetColumns(char *base[2], SIZE_T stride[2]) const
+{
+  base[0]=data+GetHeadSize();
+  if (IsColumnar()) { 
+    stride[0]=info->GetStoredKeySize();
+    stride[1]=info->valuesize;
+    base[1]=base[0]+info->GetNumSlotsAsLeaf()*stride[0];
+    return 2;
+  }
+  stride[0]=GetSlotSize();
+  return 1;
+}
+
+
+bool BTreeNodeView::IsFull() const
+{
+  switch (info->nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    if (IsSlotted()) { 
+      return GetFreeBytes() < GetSlotSize()+info->GetStoredKeySize();
+    }
+    return info->numkeys >= info->GetNumSlotsAsInterior();
+  case BTREE_LEAF_NODE:
+    if (IsSlotted()) { 
+      return GetFreeBytes() < GetSlotSize()+info->GetStoredKeySize()+info->GetStoredValueSize();
+    }
+    return info->numkeys >= info->GetNumSlotsAsLeaf();
+  default:
+    return false;
+  }
+}
+
+
+SIZE_T BTreeNodeView::GetFreeBytes() const
+{
+  if (IsColumnar()) { 
+    return (info->GetNumSlotsAsLeaf()-info->numkeys)*GetSlotSize();
+  }
+  return (data+info->GetNumDataBytes()-info->prefixlen-info->heapbytes) - ResolveSlot(info->numkeys);
+}
+
+
+bool BTreeNodeView::IsUnderfull() const
+{
+  switch (info->nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    if (IsSlotted()) { 
+      return GetUsedBytes() < (info->GetNumDataBytes()-GetHeadSize()-info->prefixlen)/3;
+    }
+    return info->numkeys < info->GetLowerBoundAsInterior();
+  case BTREE_LEAF_NODE:
+    if (IsSlotted()) { 
+      return GetUsedBytes() < (info->GetNumDataBytes()-sizeof(SIZE_T)-info->prefixlen)/3;
+    }
+    return info->numkeys < info->GetLowerBoundAsLeaf();
+  default:
+    return false;
+  }
+}
+
+
+SIZE_T BTreeNodeView::GetUsedBytes() const
+{
+  return info->numkeys*GetSlotSize() + (IsSlotted() ? info->heapbytes : 0);
+}
+
+
+SIZE_T BTreeNodeView::GetSlotBytes(const SIZE_T offset) const
+{
+  if (!IsSlotted()) { 
+    return GetSlotSize();
+  }
+  return GetSlotSize()+GetStoredKeyLength(offset)+
+    (info->nodetype==BTREE_LEAF_NODE ? GetValLength(offset) : 0);
+}
+
+
+bool BTreeNodeView::HasRoomFor(const SIZE_T keylen, const SIZE_T vallen) const
+{
+  bool leaf=info->nodetype==BTREE_LEAF_NODE;
+
+  if (!IsSlotted()) { 
+    return info->numkeys+1 < (leaf ? info->GetNumSlotsAsLeaf() : info->GetNumSlotsAsInterior());
+  }
+  // Room for it, and then still room for the largest slot
+  SIZE_T need=GetSlotSize()+keylen-info->prefixlen+vallen;
+  SIZE_T largest=GetSlotSize()+info->GetStoredKeySize()+(leaf ? info->GetStoredValueSize() : 0);
+  return GetFreeBytes() >= need+largest;
+}
+
+
+SIZE_T BTreeNodeView::GetMiddleSlot() const
+{
+  SIZE_T n=info->numkeys;
+  bool leaf=info->nodetype==BTREE_LEAF_NODE;
+
+  if (!IsSlotted() || n<3) { 
+    return leaf ? n-n/2 : n/2;
+  }
+
+  // Find the slot that straddles the middle byte.  A leaf splits in
+  // front of it and an interior node promotes it, so an interior node
+  // must leave at least one slot on either side.
+  SIZE_T half=(n*GetSlotSize()+info->heapbytes)/2;
+  SIZE_T bytes=0;
+  SIZE_T last = leaf ? n-1 : n-2;
+  SIZE_T i;
+
+  for (i=0;i<last;i++) { 
+    bytes+=GetSlotSize()+GetStoredKeyLength(i)+(leaf ? GetValLength(i) : 0);
+    if (bytes>=half) { 
+      break;
+    }
+  }
+  return max(i,(SIZE_T)1);
+}
+
+
+//
+// A slotted node's REF is two 16 bit halves of a SIZE_T: the offset of
+// a key or value in the data area and its length.  A length of zero
+// means it has no bytes in the heap.  Interior slots are a key REF and
+// a pointer, leaf slots a key REF and a value REF.
+//
+static inline SIZE_T GetRefOffset(const char *ref)
+{
+  unsigned short x;
+  memcpy(&x,ref,sizeof(x));
+  return x;
+}
+
+static inline SIZE_T GetRefLength(const char *ref)
+{
+  unsigned short x;
+  memcpy(&x,ref+sizeof(x),sizeof(x));
+  return x;
+}
+
+static inline void SetRef(char *ref, const SIZE_T offset, const SIZE_T length)
+{
+  unsigned short x[2] = {(unsigned short)offset, (unsigned short)length};
+  memcpy(ref,x,sizeof(x));
+}
+
+
+char * BTreeNodeView::ResolveSlot(const SIZE_T offset) const
+{
+  assert(offset<=info->numkeys);
+  return data+GetHeadSize()+offset*GetKeyStride();
+}
+
+
+char * BTreeNodeView::ResolvePrefix() const
+{
+  return data+info->GetNumDataBytes()-info->prefixlen;
+}
+
+
+SIZE_T BTreeNodeView::GetStoredKeyLength(const SIZE_T offset) const
+{
+  if (IsSlotted()) { 
+    return GetRefLength(ResolveSlot(offset));
+  }
+  return info->GetStoredKeySize();
+}
+
+
+SIZE_T BTreeNodeView::GetValLength(const SIZE_T offset) const
+{
+  if (IsSlotted()) { 
+    return GetRefLength(ResolveSlot(offset)+sizeof(SIZE_T));
+  }
+  return info->valuesize;
+}
+
+
+char * BTreeNodeView::ResolveKey(const SIZE_T offset) const
+{
+  switch (info->nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+  case BTREE_LEAF_NODE:
+    assert(offset<info->numkeys);
+    if (IsSlotted()) { 
+      return data+GetRefOffset(ResolveSlot(offset));
+    }
+    return ResolveSlot(offset);
     break;
   default:
     return 0;
@@ -169,13 +659,13 @@ char * BTreeNode::ResolveKey(const SIZE_T offset) const
 }
 
 
-char * BTreeNode::ResolvePtr(const SIZE_T offset) const
+char * BTreeNodeView::ResolvePtr(const SIZE_T offset) const
 {
-  switch (info.nodetype) { 
+  switch (info->nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
-    assert(offset<=info.numkeys);
-    return data+offset*(sizeof(SIZE_T)+info.keysize);
+    assert(offset<=info->numkeys);
+    return data+offset*GetSlotSize();
     break;
   case BTREE_LEAF_NODE:
     assert(offset==0);
@@ -188,12 +678,18 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
 
 
 
-char * BTreeNode::ResolveVal(const SIZE_T offset) const
+char * BTreeNodeView::ResolveVal(const SIZE_T offset) const
 {
-  switch (info.nodetype) { 
+  switch (info->nodetype) { 
   case BTREE_LEAF_NODE:
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
+    assert(offset<info->numkeys);
+    if (IsSlotted()) { 
+      return data+GetRefOffset(ResolveSlot(offset)+sizeof(SIZE_T));
+    }
+    if (IsColumnar()) { 
+      return data+sizeof(SIZE_T)+info->GetNumSlotsAsLeaf()*info->GetStoredKeySize()+offset*info->valuesize;
+    }
+    return data+sizeof(SIZE_T)+offset*GetSlotSize()+info->GetStoredKeySize();
     break;
   default:
     return 0;
@@ -202,12 +698,12 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
 
 
 
-char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
+char * BTreeNodeView::ResolveKeyVal(const SIZE_T offset) const
 {
   return ResolveKey(offset);
 }
 
-ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
+ERROR_T BTreeNodeView::GetKey(const SIZE_T offset, KEY_T &k) const
 {
   char *p=ResolveKey(offset);
 
@@ -215,12 +711,15 @@ ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
     return ERROR_NOMEM;
   }
   
-  k.Resize(info.keysize,false);
-  memcpy(k.data,p,info.keysize);
+  SIZE_T len=GetStoredKeyLength(offset);
+
+  k.Resize(info->prefixlen+len,false);
+  memcpy(k.data,ResolvePrefix(),info->prefixlen);
+  memcpy(k.data+info->prefixlen,p,len);
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
+ERROR_T BTreeNodeView::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
 {
   char *p=ResolvePtr(offset);
 
@@ -232,7 +731,23 @@ ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
+ERROR_T BTreeNodeView::GetCount(const SIZE_T offset, SIZE_T &c) const
+{
+  char *p=ResolvePtr(offset);
+
+  if (p==0 || info->nodetype==BTREE_LEAF_NODE) { 
+    return ERROR_NOMEM;
+  }
+  if (!(info->format & BTREE_FORMAT_COUNTED)) { 
+    c=0;
+    return ERROR_NOERROR;
+  }
+
+  memcpy(&c,p+sizeof(SIZE_T),sizeof(SIZE_T));
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeNodeView::GetVal(const SIZE_T offset, VALUE_T &v) const
 {
   char *p=ResolveVal(offset);
 
@@ -240,13 +755,15 @@ ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
     return ERROR_NOMEM;
   }
   
-  v.Resize(info.valuesize,false);
-  memcpy(v.data,p,info.valuesize);
+  SIZE_T len=GetValLength(offset);
+
+  v.Resize(len,false);
+  memcpy(v.data,p,len);
   return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
+ERROR_T BTreeNodeView::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
 {
   ERROR_T rc= GetKey(offset,p.key);
 
@@ -258,21 +775,84 @@ ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
 }
 
 
-ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
+ERROR_T BTreeNodeView::SetKey(const SIZE_T offset, const KEY_T &k)
 {
-  char *p=ResolveKey(offset);
-
-  if (p==0) { 
+  if (ResolveKey(offset)==0) { 
     return ERROR_NOMEM;
   }
 
-  memcpy(p,k.data,info.keysize);
+  if (k.length>info->keysize) { 
+    return ERROR_SIZE;
+  }
+
+  if (k.length<info->prefixlen || memcmp(k.data,ResolvePrefix(),info->prefixlen)) { 
+    // The key doesn't belong in this node
+    return ERROR_INSANE;
+  }
+
+  return SetStoredKey(offset,(const char *)k.data+info->prefixlen,k.length-info->prefixlen);
+}
+
+
+ERROR_T BTreeNodeView::SetStoredKey(const SIZE_T offset, const char *suffix, const SIZE_T len)
+{
+  if (!IsSlotted()) { 
+    if (len!=info->GetStoredKeySize()) { 
+      return ERROR_SIZE;
+    }
+    memcpy(ResolveKey(offset),suffix,len);
+    dirty=true;
+    return ERROR_NOERROR;
+  }
+
+  return SetHeapBytes(ResolveSlot(offset),suffix,len);
+}
+
+
+ERROR_T BTreeNodeView::SetHeapBytes(char *ref, const char *bytes, const SIZE_T len)
+{
+  if (GetRefLength(ref)>0) { 
+    RemoveHeapBytes(ref);
+  }
+  if (GetFreeBytes()<len) { 
+    return ERROR_NOSPACE;
+  }
+
+  // Take len bytes off the bottom of the heap
+  info->heapbytes+=len;
+  char *p=data+info->GetNumDataBytes()-info->prefixlen-info->heapbytes;
+  memcpy(p,bytes,len);
+  SetRef(ref,p-data,len);
+  dirty=true;
 
   return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
+void BTreeNodeView::RemoveHeapBytes(char *ref)
+{
+  SIZE_T offset=GetRefOffset(ref);
+  SIZE_T len=GetRefLength(ref);
+  char *heap=data+info->GetNumDataBytes()-info->prefixlen-info->heapbytes;
+  int refs = info->nodetype==BTREE_LEAF_NODE ? 2 : 1;
+
+  // Close the hole by sliding everything below it up
+  memmove(heap+len,heap,(data+offset)-heap);
+  for (SIZE_T i=0;i<info->numkeys;i++) { 
+    for (int j=0;j<refs;j++) { 
+      char *r=ResolveSlot(i)+j*sizeof(SIZE_T);
+      if (GetRefLength(r)>0 && GetRefOffset(r)<offset) { 
+	SetRef(r,GetRefOffset(r)+len,GetRefLength(r));
+      }
+    }
+  }
+  info->heapbytes-=len;
+  SetRef(ref,0,0);
+  dirty=true;
+}
+
+
+ERROR_T BTreeNodeView::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 {
   char *p=ResolvePtr(offset);
 
@@ -281,13 +861,32 @@ ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
   }
 
   memcpy(p,&ptr,sizeof(SIZE_T));
+  dirty=true;
 
   return ERROR_NOERROR;
 }
 
 
 
-ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
+ERROR_T BTreeNodeView::SetCount(const SIZE_T offset, const SIZE_T &c)
+{
+  char *p=ResolvePtr(offset);
+
+  if (p==0 || info->nodetype==BTREE_LEAF_NODE) { 
+    return ERROR_NOMEM;
+  }
+  if (!(info->format & BTREE_FORMAT_COUNTED)) { 
+    return ERROR_NOERROR;
+  }
+
+  memcpy(p+sizeof(SIZE_T),&c,sizeof(SIZE_T));
+  dirty=true;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNodeView::SetVal(const SIZE_T offset, const VALUE_T &v)
 {
   char *p=ResolveVal(offset);
   
@@ -295,13 +894,21 @@ ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
     return ERROR_NOMEM;
   }
   
-  memcpy(p,v.data,info.valuesize);
+  if (IsSlotted()) { 
+    if (v.length>info->GetMaxValueLength()) { 
+      return ERROR_SIZE;
+    }
+    return SetHeapBytes(ResolveSlot(offset)+sizeof(SIZE_T),(const char *)v.data,v.length);
+  }
+
+  memcpy(p,v.data,info->valuesize);
+  dirty=true;
   
   return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
+ERROR_T BTreeNodeView::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 {
   ERROR_T rc=SetKey(offset,p.key);
 
@@ -315,6 +922,443 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 
 
 
+// memcmp order, with a shorter key before any key it is a prefix of
+static inline int CompareBytes(const char *a, const SIZE_T alen, const char *b, const SIZE_T blen)
+{
+  int cmp=memcmp(a,b,min(alen,blen));
+
+  if (cmp) { 
+    return cmp;
+  }
+  return alen<blen ? -1 : alen>blen ? 1 : 0;
+}
+
+
+int BTreeNodeView::CompareStored(const SIZE_T offset, const char *suffix, const SIZE_T len) const
+{
+  if (IsSlotted()) { 
+    return CompareBytes(ResolveKey(offset),GetStoredKeyLength(offset),suffix,len);
+  }
+  return memcmp(ResolveKey(offset),suffix,len);
+}
+
+
+int BTreeNodeView::CompareKey(const SIZE_T offset, const KEY_T &key) const
+{
+  SIZE_T prefixlen=info->prefixlen;
+  int cmp=CompareBytes(ResolvePrefix(),prefixlen,(const char *)key.data,min((SIZE_T)key.length,prefixlen));
+
+  if (cmp) { 
+    return cmp;
+  }
+  return CompareBytes(ResolveKey(offset),GetStoredKeyLength(offset),
+		      (const char *)key.data+prefixlen,key.length-prefixlen);
+}
+
+
+// Slots left for the vector kernel at the end of a SIMD search
+static const SIZE_T SIMD_SEARCH_WINDOW=16;
+
+// Guesses an interpolation search makes before leaving the rest to
+// binary search, and the range it leaves to binary search anyway
+static const SIZE_T INTERPOLATION_GUESSES=3;
+static const SIZE_T INTERPOLATION_MIN_RANGE=4;
+
+
+unsigned long long KeyBits(const char *key, const SIZE_T len, const SIZE_T from)
+{
+  unsigned long long v=0;
+
+  for (SIZE_T i=from;i<from+8;i++) { 
+    v=(v<<8) | (i<len ? (unsigned char)key[i] : 0);
+  }
+  return v;
+}
+
+
+bool BTreeNodeView::Interpolate(const char *suffix, const SIZE_T len, SIZE_T &lo, SIZE_T &hi,
+				SIZE_T &compares) const
+{
+  SIZE_T pos;
+  SIZE_T step;
+  int cmp;
+
+  for (SIZE_T guess=0;guess<INTERPOLATION_GUESSES && hi-lo>INTERPOLATION_MIN_RANGE;guess++) { 
+    const char *first=ResolveKey(lo);
+    const char *last=ResolveKey(hi-1);
+    SIZE_T firstlen=GetStoredKeyLength(lo);
+    SIZE_T lastlen=GetStoredKeyLength(hi-1);
+
+    // The keys of the range all begin with the bytes their first and
+    // last have in common, so the numbers are read from past those
+    SIZE_T common=0;
+    while (common<firstlen && common<lastlen && first[common]==last[common]) { 
+      common++;
+    }
+    unsigned long long kl=KeyBits(first,firstlen,common);
+    unsigned long long kh=KeyBits(last,lastlen,common);
+    if (kh<=kl) { 
+      // Too alike in their first bytes to tell apart
+      break;
+    }
+
+    // A key that leaves the common bytes is off one end of the range
+    cmp=memcmp(suffix,first,min(len,common));
+    if (cmp<0 || (cmp==0 && len<common)) { 
+      pos=lo;
+    } else if (cmp>0) { 
+      pos=hi-1;
+    } else {
+      unsigned long long t=KeyBits(suffix,len,common);
+      t = t<kl ? kl : t>kh ? kh : t;
+      pos=lo+(SIZE_T)((long double)(t-kl)/(kh-kl)*(hi-1-lo));
+    }
+
+    // Evenly spread keys mostly put the key within a fraction of the
+    // square root of the range of the guess, so a guard a third of
+    // that away on the far side often closes the range in on it
+    step=1;
+    while (9*step*step<hi-lo) { 
+      step++;
+    }
+
+    compares++;
+    cmp=CompareStored(pos,suffix,len);
+    if (cmp==0) { 
+      lo=pos;
+      return true;
+    }
+    if (cmp<0) { 
+      lo=pos+1;
+      if (pos+step<hi) { 
+	compares++;
+	cmp=CompareStored(pos+step,suffix,len);
+	if (cmp==0) { 
+	  lo=pos+step;
+	  return true;
+	}
+	if (cmp>0) { 
+	  hi=pos+step;
+	} else {
+	  lo=pos+step+1;
+	}
+      }
+    } else {
+      hi=pos;
+      if (pos>=lo+step) { 
+	compares++;
+	cmp=CompareStored(pos-step,suffix,len);
+	if (cmp==0) { 
+	  lo=pos-step;
+	  return true;
+	}
+	if (cmp<0) { 
+	  lo=pos-step+1;
+	} else {
+	  hi=pos-step;
+	}
+      }
+    }
+  }
+  return false;
+}
+
+
+SIZE_T BTreeNodeView::Search(const KEY_T &key, bool &found,
+			     const BTreeSearchType type, SIZE_T &compares) const
+{
+  return SearchRange(key,0,info->numkeys,found,type,compares);
+}
+
+
+SIZE_T BTreeNodeView::SearchRange(const KEY_T &key, const SIZE_T from, const SIZE_T to,
+				  bool &found, const BTreeSearchType type, SIZE_T &compares) const
+{
+  SIZE_T lo=from;
+  SIZE_T hi=to;
+  SIZE_T mid;
+  int cmp;
+
+  found=false;
+
+  // A key outside the shared prefix is below or above every key here.
+  // Otherwise only the suffixes need comparing.
+  SIZE_T prefixlen=info->prefixlen;
+
+  if (prefixlen>0 && info->numkeys>0) { 
+    compares++;
+    cmp=CompareBytes(ResolvePrefix(),prefixlen,(const char *)key.data,min((SIZE_T)key.length,prefixlen));
+    if (cmp) { 
+      return cmp>0 ? 0 : info->numkeys;
+    }
+  }
+
+  SIZE_T suffixlen=key.length-prefixlen;
+  const char *suffix=(const char *)key.data+prefixlen;
+
+  if (type==BTREE_SEARCH_LINEAR) { 
+    for (;lo<hi;lo++) { 
+      compares++;
+      cmp=CompareStored(lo,suffix,suffixlen);
+      if (cmp>=0) { 
+	found = cmp==0;
+	return lo;
+      }
+    }
+    return EndOfRange(lo,to,suffix,suffixlen,found,compares);
+  }
+
+  if (type==BTREE_SEARCH_INTERPOLATION && Interpolate(suffix,suffixlen,lo,hi,compares)) { 
+    found=true;
+    return lo;
+  }
+
+  // Binary search over [lo,hi) for the first key >= key.
+  // Keys in a node are unique, so we can stop on an exact match.
+  // With a vector kernel we stop once the range is a few vectors wide
+  // and count the keys below key in the rest of it in one pass.
+  SIZE_T window = (type==BTREE_SEARCH_SIMD && !IsSlotted() && HasKeySearchKernel(suffixlen)) ? 
+    SIMD_SEARCH_WINDOW : 0;
+
+  while (hi-lo>window) { 
+    mid=lo+(hi-lo)/2;
+    compares++;
+    cmp=CompareStored(mid,suffix,suffixlen);
+    if (cmp<0) { 
+      lo=mid+1;
+    } else if (cmp>0) { 
+      hi=mid;
+    } else {
+      found=true;
+      return mid;
+    }
+  }
+
+  if (lo<hi) { 
+    compares+=hi-lo;
+    lo+=KeyLowerBound(suffix,ResolveKey(lo),GetKeyStride(),hi-lo,suffixlen);
+    if (lo<info->numkeys) { 
+      compares++;
+      found = CompareStored(lo,suffix,suffixlen)==0;
+    }
+    return lo;
+  }
+  return EndOfRange(lo,to,suffix,suffixlen,found,compares);
+}
+
+
+SIZE_T BTreeNodeView::EndOfRange(const SIZE_T offset, const SIZE_T to, const char *suffix,
+				 const SIZE_T len, bool &found, SIZE_T &compares) const
+{
+  // A search that ran off the end of a range short of the node's end
+  // stops at a key it hasn't compared
+  if (offset==to && offset<info->numkeys) { 
+    compares++;
+    found = CompareStored(offset,suffix,len)==0;
+  }
+  return offset;
+}
+
+
+ERROR_T BTreeNodeView::InsertSlot(const SIZE_T offset)
+{
+  SIZE_T slotsize=GetSlotSize();
+
+  if (slotsize==0 || offset>info->numkeys) { 
+    return ERROR_INSANE;
+  }
+  if (GetFreeBytes()<slotsize) { 
+    return ERROR_NOSPACE;
+  }
+
+  char *base[2];
+  SIZE_T stride[2];
+  int columns=GetColumns(base,stride);
+
+  for (int c=0;c<columns;c++) { 
+    char *p=base[c]+offset*stride[c];
+    memmove(p+stride[c],p,(info->numkeys-offset)*stride[c]);
+    memset(p,0,stride[c]);
+  }
+  info->numkeys++;
+  dirty=true;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNodeView::AppendSlots(const BTreeNodeView &src, const SIZE_T from, const SIZE_T count)
+{
+  SIZE_T slotsize=GetSlotSize();
+  SIZE_T n=info->numkeys;
+  ERROR_T rc;
+
+  if (src.info->prefixlen!=info->prefixlen || src.GetSlotSize()!=slotsize ||
+      memcmp(src.ResolvePrefix(),ResolvePrefix(),info->prefixlen)) { 
+    return ERROR_INSANE;
+  }
+  if (GetFreeBytes()<count*slotsize) { 
+    return ERROR_NOSPACE;
+  }
+
+  char *base[2], *srcbase[2];
+  SIZE_T stride[2], srcstride[2];
+  int columns=GetColumns(base,stride);
+
+  src.GetColumns(srcbase,srcstride);
+  for (int c=0;c<columns;c++) { 
+    memcpy(base[c]+n*stride[c],srcbase[c]+from*stride[c],count*stride[c]);
+  }
+  info->numkeys+=count;
+  dirty=true;
+
+  if (IsSlotted()) { 
+    // The REFs point into src's heap; copy the keys (and values) over
+    bool leaf=info->nodetype==BTREE_LEAF_NODE;
+    for (SIZE_T i=0;i<count;i++) { 
+      char *ref=ResolveSlot(n+i);
+      SetRef(ref,0,0);
+      rc=SetHeapBytes(ref,src.ResolveKey(from+i),src.GetStoredKeyLength(from+i));
+      if (rc) { return rc; }
+      if (leaf) { 
+	SetRef(ref+sizeof(SIZE_T),0,0);
+	rc=SetHeapBytes(ref+sizeof(SIZE_T),src.ResolveVal(from+i),src.GetValLength(from+i));
+	if (rc) { return rc; }
+      }
+    }
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNodeView::RemoveSlot(const SIZE_T offset)
+{
+  if (offset>=info->numkeys) { 
+    return ERROR_INSANE;
+  }
+
+  if (IsSlotted()) { 
+    int refs = info->nodetype==BTREE_LEAF_NODE ? 2 : 1;
+    for (int j=0;j<refs;j++) { 
+      RemoveHeapBytes(ResolveSlot(offset)+j*sizeof(SIZE_T));
+    }
+  }
+
+  char *base[2];
+  SIZE_T stride[2];
+  int columns=GetColumns(base,stride);
+
+  for (int c=0;c<columns;c++) { 
+    char *p=base[c]+offset*stride[c];
+    memmove(p,p+stride[c],(info->numkeys-offset-1)*stride[c]);
+    memset(base[c]+(info->numkeys-1)*stride[c],0,stride[c]);
+  }
+  info->numkeys--;
+  dirty=true;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNodeView::TruncateSlots(const SIZE_T n)
+{
+  if (n>info->numkeys) { 
+    return ERROR_INSANE;
+  }
+
+  if (IsSlotted()) { 
+    int refs = info->nodetype==BTREE_LEAF_NODE ? 2 : 1;
+    for (SIZE_T i=info->numkeys;i>n;i--) { 
+      for (int j=0;j<refs;j++) { 
+	RemoveHeapBytes(ResolveSlot(i-1)+j*sizeof(SIZE_T));
+      }
+    }
+  }
+
+  char *base[2];
+  SIZE_T stride[2];
+  int columns=GetColumns(base,stride);
+
+  for (int c=0;c<columns;c++) { 
+    memset(base[c]+n*stride[c],0,(info->numkeys-n)*stride[c]);
+  }
+  info->numkeys=n;
+  dirty=true;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNodeView::SetPrefix(const char *prefix, const SIZE_T len)
+{
+  SIZE_T n=info->numkeys;
+  SIZE_T oldlen=info->prefixlen;
+  bool interior = info->nodetype==BTREE_INTERIOR_NODE || info->nodetype==BTREE_ROOT_NODE;
+  ERROR_T rc=ERROR_NOERROR;
+
+  if (!(info->format & BTREE_FORMAT_PREFIX) || len>=info->keysize) { 
+    return len==0 && oldlen==0 ? ERROR_NOERROR : ERROR_INSANE;
+  }
+
+  if (len==oldlen && memcmp(prefix,ResolvePrefix(),len)==0) { 
+    return ERROR_NOERROR;
+  }
+
+  // Lay the node out again from a copy of the old one.  This only
+  // happens on splits, so the copy is not worth avoiding.
+  NodeMetadata oldinfo=*info;
+  SIZE_T databytes=info->GetNumDataBytes();
+  char *old=new char [databytes+info->keysize];
+  char *newprefix=old+databytes;
+  memcpy(old,data,databytes);
+  memcpy(newprefix,prefix,len);
+  BTreeNodeView was(&oldinfo,old);
+  KEY_T key;
+  VALUE_T val;
+  SIZE_T heapbytes=0;
+
+  for (SIZE_T i=0;i<n;i++) { 
+    was.GetKey(i,key);
+    if (key.length<len || memcmp(key.data,newprefix,len)) { 
+      delete [] old;
+      return ERROR_INSANE;
+    }
+    heapbytes+=key.length-len+(interior ? 0 : was.GetValLength(i));
+  }
+
+  NodeMetadata newinfo=*info;
+  newinfo.prefixlen=len;
+
+  if (IsSlotted() ? GetHeadSize()+n*GetSlotSize()+heapbytes+len > databytes :
+      n > (interior ? newinfo.GetNumSlotsAsInterior() : newinfo.GetNumSlotsAsLeaf())) { 
+    delete [] old;
+    return ERROR_NOSPACE;
+  }
+
+  info->prefixlen=len;
+  info->heapbytes=0;
+  memcpy(ResolvePrefix(),newprefix,len);
+  memset(data+GetHeadSize(),0,ResolvePrefix()-data-GetHeadSize());
+
+  for (SIZE_T i=0;i<n && !rc;i++) { 
+    was.GetKey(i,key);
+    rc=SetStoredKey(i,(const char *)key.data+len,key.length-len);
+    if (interior) { 
+      memcpy(ResolvePtr(i+1),was.ResolvePtr(i+1),info->GetPtrSize());
+    } else if (!rc) {
+      was.GetVal(i,val);
+      rc=SetVal(i,val);
+    }
+  }
+
+  delete [] old;
+  dirty=true;
+
+  return rc;
+}
+
+
 ostream & BTreeNode::Print(ostream &os) const 
 {
   os << "BTreeNode(info="<<info;
@@ -13,6 +13,18 @@ using namespace std;
 #define BTREE_ROOT_NODE 2
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
+#define BTREE_POSTING_NODE 5
+
+// Node formats, chosen when the index is created and recorded in
+// every node.  These are bit flags.
+#define BTREE_FORMAT_PLAIN  0x0
+#define BTREE_FORMAT_PREFIX   0x1   // keys share a per node prefix, slots hold suffixes
+#define BTREE_FORMAT_TRUNCATE 0x2   // separators are cut short, interior nodes are slotted
+#define BTREE_FORMAT_COLUMNAR 0x4   // leaves keep all keys before all values
+#define BTREE_FORMAT_VARLEN   0x8   // keys and values up to keysize and valuesize bytes, all nodes slotted
+#define BTREE_FORMAT_POSTINGS 0x10  // keys may repeat; a leaf keeps each key once with a list of its values
+#define BTREE_FORMAT_COUNTED  0x20  // interior pointers carry the number of keys below them
+#define BTREE_FORMAT_ALL      (BTREE_FORMAT_PREFIX|BTREE_FORMAT_TRUNCATE|BTREE_FORMAT_COLUMNAR|BTREE_FORMAT_VARLEN|BTREE_FORMAT_POSTINGS|BTREE_FORMAT_COUNTED)
 
 
 typedef Block Buffer;
@@ -23,6 +35,21 @@ typedef KeyOrValue VALUE_T;
 
 class BufferCache;
 struct KeyValuePair;
+struct BTreeNodeView;
+
+// How a node is searched for a key
+//
+// BTREE_SEARCH_SIMD narrows the range with binary search and then
+// finishes with a vector kernel (see btree_simd.h).  It is the same as
+// BTREE_SEARCH_BINARY for key sizes without a kernel.
+//
+// BTREE_SEARCH_INTERPOLATION guesses where the key is from where it
+// falls between the first and last keys of the range, read as
+// numbers, and checks the guess with a guard a step away.  It suits
+// evenly spread keys, such as random ids or hashes, and falls back
+// to binary search once a few guesses have failed to close in.
+enum BTreeSearchType {BTREE_SEARCH_BINARY, BTREE_SEARCH_LINEAR, BTREE_SEARCH_SIMD,
+		      BTREE_SEARCH_INTERPOLATION};
 
 struct NodeMetadata {
   int nodetype;
@@ -32,8 +59,15 @@ struct NodeMetadata {
   SIZE_T rootnode; //meaningful only for superblock
   SIZE_T freelist; //meaningful only for superblock or a free block
   SIZE_T numkeys;
+  SIZE_T format;    // BTREE_FORMAT_* flags
+  SIZE_T prefixlen; // bytes of key prefix stored once (BTREE_FORMAT_PREFIX)
+  SIZE_T heapbytes; // bytes used in a slotted node's key (and value) heap
 
   SIZE_T GetNumDataBytes() const;
+  SIZE_T GetStoredKeySize() const;  // key bytes kept in each slot
+  SIZE_T GetStoredValueSize() const; // value bytes a new leaf slot takes at most
+  SIZE_T GetMaxValueLength() const;  // bytes a leaf value may grow to (a posting list's limit)
+  SIZE_T GetPtrSize() const;         // bytes of an interior pointer, its count included
   SIZE_T GetNumSlotsAsInterior() const;
   SIZE_T GetNumSlotsAsLeaf() const;
   SIZE_T GetLowerBoundAsInterior() const;
@@ -46,6 +80,16 @@ struct NodeMetadata {
 
 inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return node.Print(os); }
 
+// Parses a comma separated list of format names ("plain", "prefix",
+// "truncate", "columnar", "varlen", "postings", "counted")
+// returns ERROR_BADCONFIG for an unknown name
+ERROR_T ParseNodeFormat(const char *names, SIZE_T &format);
+
+// The 8 bytes of a key from byte from on as a big endian number, with
+// missing bytes as zeroes, so that keys in memcmp order give numbers in
+// the same order
+unsigned long long KeyBits(const char *key, const SIZE_T len, const SIZE_T from);
+
 
 
 //
@@ -57,7 +101,68 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 //
 // PTR* KEY VALUE KEY VALUE KEY VALUE
 //
-// *Here this pointer is not used
+// *Here this pointer is the next leaf to the right, or 0 for the last
+// leaf, so the leaves can be walked in key order (see BTreeCursor)
+//
+// With BTREE_FORMAT_PREFIX, the node's keys all begin with the same
+// prefixlen bytes.  The prefix is stored once, in the last prefixlen
+// bytes of the data area, and each KEY above holds only the remaining
+// keysize-prefixlen bytes.  A node's prefix comes from the separators
+// that bound it in its parent (see BTreeIndex::Split), so any key that
+// is later routed to the node shares it too.
+//
+// With BTREE_FORMAT_TRUNCATE, a leaf split promotes the shortest key
+// that is above everything in the left leaf and no more than the first
+// key of the right one, so separators vary in length.  Interior nodes
+// are then slotted:
+//
+// PTR REF PTR REF PTR ... free ... HEAP [PREFIX]
+//
+// where each REF is a 16 bit offset and length of a separator (less the
+// prefix) in the heap.  The heap grows down from the end of the data
+// area and is kept free of holes.
+//
+// With BTREE_FORMAT_COLUMNAR, a leaf with room for n slots is
+//
+// PTR* KEY KEY ... KEY (n of them) VALUE VALUE ... VALUE (n of them)
+//
+// so a search only touches key bytes.
+//
+// With BTREE_FORMAT_VARLEN, keys and values may be shorter than keysize
+// and valuesize.  Interior nodes are slotted as above, and leaves too:
+//
+// PTR* KREF VREF KREF VREF ... free ... HEAP [PREFIX]
+//
+// A node counts as full when it lacks room for one more slot of the
+// largest size, and splits at the slot that halves its heap bytes
+// rather than its slot count.
+//
+// With BTREE_FORMAT_POSTINGS, a key may have any number of values.  A
+// leaf keeps each key once, and is slotted as above, with the key's
+// values in a posting list where its VALUE would be:
+//
+// 0 VALUE VALUE VALUE ...    (inline)
+// 1 COUNT FIRST LAST         (overflow)
+//
+// Inline values are valuesize bytes each, or with BTREE_FORMAT_VARLEN
+// a 16 bit length and then the bytes.  A list that would grow past
+// GetMaxValueLength() bytes moves out to a chain of posting blocks
+// holding its COUNT values, from FIRST to LAST:
+//
+// NEXT VALUE VALUE VALUE ...
+//
+// where NEXT is the next block of the chain (0 in LAST), numkeys
+// counts the block's values, and heapbytes is the bytes they take.
+// Values keep the order they were inserted in.
+//
+// With BTREE_FORMAT_COUNTED, each interior PTR above is followed by
+// the number of keys in the leaves below it (the COUNT of an order
+// statistic tree):
+//
+// PTR COUNT KEY PTR COUNT KEY PTR COUNT
+//
+// so a key's rank, or the key of a given rank, is found on one path
+// from the root.  A slot still moves as a whole, count and all.
 
 
 struct BTreeNode {
@@ -84,28 +189,169 @@ struct BTreeNode {
   ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
 
   char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
-  char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
+  char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior), or the next leaf (leaf, 0th)
   char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
   char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
 
   ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const ; // Gives the ith key  (interior or leaf)
-  ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior)
+  ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior), or the next leaf (leaf, 0th)
+  ERROR_T GetCount(const SIZE_T offset, SIZE_T &c) const ; // Gives the keys below the ith pointer (interior, counted)
   ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf)
   ERROR_T GetKeyVal(const SIZE_T offset, KeyValuePair &p) const; // Gives  the ith key value pair (leaf)
 
 
   ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf)
-  ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior)
+  ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior), or the next leaf (leaf, 0th)
   ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
   ostream &Print(ostream &rhs) const;
+
+  // A view of this node's own storage (not pinned)
+  BTreeNodeView View() const;
 };
 
 
 inline ostream & operator<<(ostream &os, const BTreeNode &node) { return node.Print(os); }
 
 
+//
+// A BTreeNodeView reads and writes a node in place.  Normally it is
+// pinned onto a block's frame in the buffer cache, in which case the
+// metadata and data point straight into the frame and nothing is
+// copied or allocated.  Any Set* call marks the view dirty; changes made
+// directly through info or data must call MarkDirty().  Unpin (or
+// the destructor) releases the frame and tells the cache whether it
+// was modified.
+//
+struct BTreeNodeView {
+  NodeMetadata *info;
+  char         *data;
+
+  BTreeNodeView();
+  BTreeNodeView(NodeMetadata *info, char *data);  // unpinned view of existing storage
+  BTreeNodeView(const BTreeNodeView &rhs);        // only unpinned views may be copied
+  ~BTreeNodeView();
+
+  ERROR_T Pin(BufferCache *b, const SIZE_T block);
+  ERROR_T Unpin();
+
+  bool   IsPinned() const { return frame!=0; }
+  SIZE_T GetBlockNum() const { return blocknum; }
+  void   MarkDirty() { dirty=true; }
+
+  SIZE_T GetSlotSize() const; // Bytes in one KEY VALUE (leaf) or KEY PTR (interior) slot
+  SIZE_T GetHeadSize() const; // Bytes before the first slot: the first PTR (and COUNT), or the next leaf
+
+  // Keys in the leaves below this node, from the counts of an interior
+  // node or the keys of a leaf
+  SIZE_T GetSubtreeCount() const;
+
+  bool   IsSlotted() const;    // Keys (and varlen values) live in a heap rather than in the slots
+  bool   IsColumnar() const;   // Keys and values are in separate arrays
+  SIZE_T GetKeyStride() const; // Bytes from one key to the next (not slotted)
+  bool   IsFull() const;       // No room for another slot; the node must be split
+  bool   IsUnderfull() const;  // Below the lower fill bound; the node must borrow or merge
+  SIZE_T GetFreeBytes() const; // Bytes between the last slot and the heap
+  SIZE_T GetUsedBytes() const; // Bytes in slots and heap
+  SIZE_T GetSlotBytes(const SIZE_T offset) const; // Bytes the ith slot takes, heap included
+
+  // true if a key and value of these lengths (the whole key, prefix
+  // included; vallen is 0 for an interior node) could be added without
+  // the node becoming full
+  bool   HasRoomFor(const SIZE_T keylen, const SIZE_T vallen) const;
+
+  // The slot that divides the node's bytes most evenly (the middle
+  // slot for fixed size slots)
+  SIZE_T GetMiddleSlot() const;
+
+  char *ResolvePrefix() const; // Gives a pointer to the shared key prefix
+  SIZE_T GetStoredKeyLength(const SIZE_T offset) const; // Bytes of the ith key kept past the prefix
+  SIZE_T GetValLength(const SIZE_T offset) const; // Bytes in the ith value (leaf)
+
+  char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
+  char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior), or the next leaf (leaf, 0th)
+  char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
+  char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf, not columnar)
+
+  // Compares the ith key against key, memcmp style
+  int CompareKey(const SIZE_T offset, const KEY_T &key) const;
+
+  // Finds the first key that is >= key and returns its offset, or
+  // numkeys if there is none.  found is set if that key equals key.
+  // compares is incremented by the number of key comparisons made.
+  // In an interior node the child to descend to is offset+found.
+  SIZE_T Search(const KEY_T &key, bool &found, 
+		const BTreeSearchType type, SIZE_T &compares) const;
+  // As Search, but only looks at keys from..to-1, as the caller knows
+  // the first key >= key to be among them or the one just after them
+  SIZE_T SearchRange(const KEY_T &key, const SIZE_T from, const SIZE_T to, bool &found,
+		     const BTreeSearchType type, SIZE_T &compares) const;
+
+  ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const ; // Gives the ith key  (interior or leaf)
+  ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior), or the next leaf (leaf, 0th)
+  ERROR_T GetCount(const SIZE_T offset, SIZE_T &c) const ; // Gives the keys below the ith pointer (interior, counted)
+  ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf)
+  ERROR_T GetKeyVal(const SIZE_T offset, KeyValuePair &p) const; // Gives  the ith key value pair (leaf)
+
+  ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf)
+  ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior), or the next leaf (leaf, 0th)
+  ERROR_T SetCount(const SIZE_T offset, const SIZE_T &c); // Writes the keys below the ith pointer (interior, counted)
+  ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
+  ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
+
+  // Opens an empty slot at offset by shifting slots offset..numkeys-1
+  // one to the right, and increments numkeys.  For an interior node
+  // the slot is the key and the pointer to its right.
+  ERROR_T InsertSlot(const SIZE_T offset);
+
+  // Copies count slots of src, starting at from, onto the end of this
+  // node, which must have the same prefix.  For an interior node the
+  // slots are keys and the pointers to their right.
+  ERROR_T AppendSlots(const BTreeNodeView &src, const SIZE_T from, const SIZE_T count);
+
+  // Drops slots n..numkeys-1
+  ERROR_T TruncateSlots(const SIZE_T n);
+
+  // Drops the slot at offset, shifting the ones after it left, and
+  // decrements numkeys.  For an interior node this is the key and the
+  // pointer to its right.
+  ERROR_T RemoveSlot(const SIZE_T offset);
+
+  // Changes the shared key prefix to the first len bytes of prefix and
+  // rewrites the slots to match.  Every key in the node must begin with
+  // the new prefix (ERROR_INSANE otherwise), and the keys must still
+  // fit in the node (ERROR_NOSPACE otherwise).
+  ERROR_T SetPrefix(const char *prefix, const SIZE_T len);
+
+ private:
+  BufferCache  *cache;
+  Block        *frame;
+  SIZE_T        blocknum;
+  bool          dirty;
+
+  // The arrays a node's slots are spread over: one for most nodes,
+  // keys and values for a columnar leaf.  Returns how many.
+  int     GetColumns(char *base[2], SIZE_T stride[2]) const;
+  char   *ResolveSlot(const SIZE_T offset) const;
+
+  int     CompareStored(const SIZE_T offset, const char *suffix, const SIZE_T len) const;
+  // BTREE_SEARCH_INTERPOLATION's part of Search, which narrows [lo,hi)
+  // and returns true, with lo the key, if it comes across key
+  bool    Interpolate(const char *suffix, const SIZE_T len, SIZE_T &lo, SIZE_T &hi,
+		      SIZE_T &compares) const;
+  // The end of a SearchRange over ..to that found no key >= key below
+  // offset
+  SIZE_T  EndOfRange(const SIZE_T offset, const SIZE_T to, const char *suffix,
+		     const SIZE_T len, bool &found, SIZE_T &compares) const;
+  ERROR_T SetStoredKey(const SIZE_T offset, const char *suffix, const SIZE_T len);
+  ERROR_T SetHeapBytes(char *ref, const char *bytes, const SIZE_T len);
+  void    RemoveHeapBytes(char *ref);
+
+  BTreeNodeView & operator=(const BTreeNodeView &rhs) { throw GenericException(); return *this; }
+};
+
+
 
 
 
@@ -4,7 +4,9 @@
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init filestem cachesize keysize valuesize [format]\n";
+  cerr << "  format is a comma separated list of node formats:\n";
+  cerr << "    plain, prefix, truncate, columnar, varlen, postings, counted\n";
 }
 
 
@@ -13,8 +15,14 @@ int main(int argc, char **argv)
   char *filestem;
   SIZE_T cachesize, keysize, valuesize;
   SIZE_T superblocknum;
+  SIZE_T format=BTREE_FORMAT_PLAIN;
 
-  if (argc!=5) { 
+  if (argc!=5 && argc!=6) { 
+    usage();
+    return -1;
+  }
+
+  if (argc==6 && ParseNodeFormat(argv[5],format)) { 
     usage();
     return -1;
   }
@@ -26,7 +34,7 @@ int main(int argc, char **argv)
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
-  BTreeIndex btree(keysize,valuesize,&cache);
+  BTreeIndex btree(keysize,valuesize,&cache,true,format);
   
   ERROR_T rc;
 
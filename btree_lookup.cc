@@ -41,7 +41,18 @@ int main(int argc, char **argv)
   } else {
     cerr << "Index attached!"<<endl;
     VALUE_T val;
-    if ((rc=btree.Lookup(KEY_T(key),val))!=ERROR_NOERROR) { 
+    BTreePostingCursor values;
+    if (!btree.IsUnique()) { 
+      // Every value of the key, one per line
+      if ((rc=btree.LookupAll(KEY_T(key),values))!=ERROR_NOERROR) { 
+	cerr <<"Lookup failed: error "<<rc<<endl;
+      } else {
+	cerr <<"Lookup succeeded ("<<values.GetCount()<<" values)\n";
+	while (values.Next(val)==ERROR_NOERROR) { 
+	  cout << val << endl;
+	}
+      }
+    } else if ((rc=btree.Lookup(KEY_T(key),val))!=ERROR_NOERROR) { 
       cerr <<"Lookup failed: error "<<rc<<endl;
     } else {
       cerr <<"Lookup succeeded\n";
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include "btree.h"
+
+void usage() 
+{
+  cerr << "usage: btree_scan filestem cachesize [lo [hi]]\n";
+  cerr << "  Prints the (key,value) pairs with lo <= key < hi in key order.\n";
+  cerr << "  Without lo or hi the scan starts at the first key or ends at the last.\n";
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  KEY_T lo, hi;
+
+  if (argc<3 || argc>5) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  if (argc>3) { 
+    lo=KEY_T(argv[3]);
+  }
+  if (argc>4) { 
+    hi=KEY_T(argv[4]);
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+  
+  ERROR_T rc;
+
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) { 
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    BTreeCursor cursor;
+    KEY_T key;
+    VALUE_T val;
+    SIZE_T count=0;
+    if ((rc=btree.Scan(lo,hi,cursor))!=ERROR_NOERROR) { 
+      cerr <<"Scan failed: error "<<rc<<endl;
+    } else {
+      while ((rc=cursor.Next(key,val))==ERROR_NOERROR) { 
+	// The same lines as btree_display sorted
+	cout << "(";
+	cout.write((const char *)key.data,key.length);
+	cout << ",";
+	cout.write((const char *)val.data,val.length);
+	cout << ")\n";
+	count++;
+      }
+      if (rc!=ERROR_NONEXISTENT) { 
+	cerr <<"Scan failed: error "<<rc<<endl;
+      } else {
+	cerr <<"Scan succeeded: "<<count<<" keys\n";
+      }
+      cursor.Close();
+    }
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+    
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+    
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    return 0;
+  }
+}
+  
+
+  
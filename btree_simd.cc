@@ -0,0 +1,244 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "btree_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BTREE_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+
+typedef SIZE_T (*KernelFn)(const char *key, const char *base, const SIZE_T stride, const SIZE_T count);
+
+
+//
+// Scalar kernels
+//
+// Loading a key big endian makes integer order the same as memcmp order.
+//
+
+static inline uint32_t LoadBE32(const char *p)
+{
+  const BYTE_T *b=(const BYTE_T *)p;
+  return ((uint32_t)b[0]<<24) | ((uint32_t)b[1]<<16) | ((uint32_t)b[2]<<8) | (uint32_t)b[3];
+}
+
+static inline uint64_t LoadBE64(const char *p)
+{
+  return ((uint64_t)LoadBE32(p)<<32) | (uint64_t)LoadBE32(p+4);
+}
+
+
+static SIZE_T LowerBoundScalar4(const char *key, const char *base, const SIZE_T stride, const SIZE_T count)
+{
+  uint32_t k=LoadBE32(key);
+  SIZE_T n=0;
+
+  for (SIZE_T i=0;i<count;i++) {
+    n+=LoadBE32(base+i*stride)<k;
+  }
+  return n;
+}
+
+static SIZE_T LowerBoundScalar8(const char *key, const char *base, const SIZE_T stride, const SIZE_T count)
+{
+  uint64_t k=LoadBE64(key);
+  SIZE_T n=0;
+
+  for (SIZE_T i=0;i<count;i++) {
+    n+=LoadBE64(base+i*stride)<k;
+  }
+  return n;
+}
+
+static SIZE_T LowerBoundScalar16(const char *key, const char *base, const SIZE_T stride, const SIZE_T count)
+{
+  uint64_t khi=LoadBE64(key);
+  uint64_t klo=LoadBE64(key+8);
+  SIZE_T n=0;
+
+  for (SIZE_T i=0;i<count;i++) {
+    uint64_t hi=LoadBE64(base+i*stride);
+    uint64_t lo=LoadBE64(base+i*stride+8);
+    n+=(hi<khi) | ((hi==khi) & (lo<klo));
+  }
+  return n;
+}
+
+
+#ifdef BTREE_SIMD_X86
+
+//
+// Vector kernels
+//
+// A key is treated as W big endian 32 bit words.  Each step loads
+// word w of several slots into one vector, flips the sign bit so the
+// signed compares order them as unsigned, and folds the result into a
+// running lexicographic less-than:
+//
+//   lt |= eq & (word < keyword);  eq &= (word == keyword)
+//
+// Slots left over at the end go through the scalar kernel.
+//
+
+template <int W>
+__attribute__((target("sse2")))
+static SIZE_T LowerBoundSSE2(const char *key, const char *base, const SIZE_T stride, const SIZE_T count)
+{
+  const __m128i sign=_mm_set1_epi32((int)0x80000000);
+  __m128i k[W];
+  SIZE_T n=0;
+  SIZE_T i;
+
+  for (int w=0;w<W;w++) {
+    k[w]=_mm_xor_si128(_mm_set1_epi32((int)LoadBE32(key+4*w)),sign);
+  }
+
+  for (i=0;i+4<=count;i+=4) {
+    const char *s=base+i*stride;
+    __m128i lt=_mm_setzero_si128();
+    __m128i eq=_mm_set1_epi32(-1);
+    for (int w=0;w<W;w++) {
+      __m128i v=_mm_set_epi32((int)LoadBE32(s+3*stride+4*w),
+			      (int)LoadBE32(s+2*stride+4*w),
+			      (int)LoadBE32(s+stride+4*w),
+			      (int)LoadBE32(s+4*w));
+      v=_mm_xor_si128(v,sign);
+      lt=_mm_or_si128(lt,_mm_and_si128(eq,_mm_cmplt_epi32(v,k[w])));
+      eq=_mm_and_si128(eq,_mm_cmpeq_epi32(v,k[w]));
+    }
+    n+=__builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(lt)));
+  }
+
+  switch (W) {
+  case 1: return n+LowerBoundScalar4(key,base+i*stride,stride,count-i);
+  case 2: return n+LowerBoundScalar8(key,base+i*stride,stride,count-i);
+  default: return n+LowerBoundScalar16(key,base+i*stride,stride,count-i);
+  }
+}
+
+
+template <int W>
+__attribute__((target("avx2")))
+static SIZE_T LowerBoundAVX2(const char *key, const char *base, const SIZE_T stride, const SIZE_T count)
+{
+  const __m256i sign=_mm256_set1_epi32((int)0x80000000);
+  // Reverses the bytes of each 32 bit word
+  const __m256i bswap=_mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+				       3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+  const __m256i index=_mm256_setr_epi32(0,(int)stride,(int)(2*stride),(int)(3*stride),
+					(int)(4*stride),(int)(5*stride),(int)(6*stride),(int)(7*stride));
+  __m256i k[W];
+  SIZE_T n=0;
+  SIZE_T i;
+
+  for (int w=0;w<W;w++) {
+    k[w]=_mm256_xor_si256(_mm256_set1_epi32((int)LoadBE32(key+4*w)),sign);
+  }
+
+  for (i=0;i+8<=count;i+=8) {
+    const char *s=base+i*stride;
+    __m256i lt=_mm256_setzero_si256();
+    __m256i eq=_mm256_set1_epi32(-1);
+    for (int w=0;w<W;w++) {
+      __m256i v=_mm256_i32gather_epi32((const int *)(s+4*w),index,1);
+      v=_mm256_xor_si256(_mm256_shuffle_epi8(v,bswap),sign);
+      lt=_mm256_or_si256(lt,_mm256_and_si256(eq,_mm256_cmpgt_epi32(k[w],v)));
+      eq=_mm256_and_si256(eq,_mm256_cmpeq_epi32(v,k[w]));
+    }
+    n+=__builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(lt)));
+  }
+
+  return n+LowerBoundSSE2<W>(key,base+i*stride,stride,count-i);
+}
+
+#endif
+
+
+// Indexed by kernel type, then by 4, 8, and 16 byte keys
+static KernelFn kernels[3][3] = {
+  {LowerBoundScalar4, LowerBoundScalar8, LowerBoundScalar16},
+#ifdef BTREE_SIMD_X86
+  {LowerBoundSSE2<1>, LowerBoundSSE2<2>, LowerBoundSSE2<4>},
+  {LowerBoundAVX2<1>, LowerBoundAVX2<2>, LowerBoundAVX2<4>},
+#else
+  {0, 0, 0},
+  {0, 0, 0},
+#endif
+};
+
+static bool kernelchosen=false;
+static KeySearchKernel kernel=KEY_KERNEL_SCALAR;
+
+
+static bool CanRun(const KeySearchKernel k)
+{
+  switch (k) {
+  case KEY_KERNEL_SCALAR:
+    return true;
+#ifdef BTREE_SIMD_X86
+  case KEY_KERNEL_SSE2:
+    return __builtin_cpu_supports("sse2");
+  case KEY_KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return false;
+  }
+}
+
+
+static int WidthIndex(const SIZE_T keysize)
+{
+  switch (keysize) {
+  case 4: return 0;
+  case 8: return 1;
+  case 16: return 2;
+  default: return -1;
+  }
+}
+
+
+bool HasKeySearchKernel(const SIZE_T keysize)
+{
+  return WidthIndex(keysize)>=0;
+}
+
+
+KeySearchKernel GetKeySearchKernel()
+{
+  if (!kernelchosen) {
+    kernel = CanRun(KEY_KERNEL_AVX2) ? KEY_KERNEL_AVX2 :
+             CanRun(KEY_KERNEL_SSE2) ? KEY_KERNEL_SSE2 : KEY_KERNEL_SCALAR;
+    kernelchosen=true;
+  }
+  return kernel;
+}
+
+
+ERROR_T SetKeySearchKernel(const KeySearchKernel k)
+{
+  if (!CanRun(k)) {
+    return ERROR_UNIMPL;
+  }
+  kernel=k;
+  kernelchosen=true;
+  return ERROR_NOERROR;
+}
+
+
+const char *KeySearchKernelName(const KeySearchKernel k)
+{
+  return k==KEY_KERNEL_AVX2 ? "avx2" : k==KEY_KERNEL_SSE2 ? "sse2" : "scalar";
+}
+
+
+SIZE_T KeyLowerBound(const char *key,
+		     const char *base,
+		     const SIZE_T stride,
+		     const SIZE_T count,
+		     const SIZE_T keysize)
+{
+  return kernels[GetKeySearchKernel()][WidthIndex(keysize)](key,base,stride,count);
+}
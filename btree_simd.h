@@ -0,0 +1,39 @@
+#ifndef _btree_simd
+#define _btree_simd
+
+#include "global.h"
+
+//
+// Vectorized key search kernels for fixed width keys
+//
+// Keys are compared as byte strings (memcmp order), which is the
+// order the btree keeps them in.  Kernels exist for 4, 8, and 16 byte
+// keys in scalar, SSE2, and AVX2 flavors.  The best one the CPU
+// supports is picked on first use.
+//
+
+enum KeySearchKernel {KEY_KERNEL_SCALAR, KEY_KERNEL_SSE2, KEY_KERNEL_AVX2};
+
+// true if there is a kernel for keys of this size
+bool HasKeySearchKernel(const SIZE_T keysize);
+
+// The kernel currently in use
+KeySearchKernel GetKeySearchKernel();
+
+// Force a particular kernel (mostly for benchmarking)
+// returns ERROR_UNIMPL if this CPU can't run it
+ERROR_T SetKeySearchKernel(const KeySearchKernel kernel);
+
+const char *KeySearchKernelName(const KeySearchKernel kernel);
+
+// Of the count keys of keysize bytes that start at base, stride bytes
+// apart, returns how many are less than key.  If the keys are sorted
+// this is the position of the first key >= key.  keysize must have a
+// kernel.
+SIZE_T KeyLowerBound(const char *key,
+		     const char *base,
+		     const SIZE_T stride,
+		     const SIZE_T count,
+		     const SIZE_T keysize);
+
+#endif
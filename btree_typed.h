@@ -0,0 +1,260 @@
+#ifndef _btree_typed
+#define _btree_typed
+
+#include <stdint.h>
+#include <string.h>
+#include <functional>
+
+#include "btree.h"
+
+//
+// A btree over fixed C++ key and value types
+//
+// TypedBTreeIndex<Key,Value,Compare> reads and writes the same
+// BTREE_FORMAT_PLAIN nodes as a BTreeIndex whose keysize and
+// valuesize are the encoded sizes of Key and Value, so either can
+// attach to a tree the other made.  Because the sizes are known at
+// compile time, slot offsets are constants and keys are compared
+// with Compare on decoded values rather than with a variable length
+// memcmp on heap buffers.
+//
+// Lookups, updates, and inserts that don't split are done here.
+// Splits, creation, display, and sanity checks are handed to the
+// BTreeIndex underneath.
+//
+
+//
+// How a type is laid out in a node
+//
+// Keys must be encoded so that memcmp order on the bytes is the same
+// as Compare order on the decoded values, as that is the order every
+// other part of the library uses.  The default copies the bytes as
+// they are, which is only right for values or byte string keys.
+// Unsigned integers are stored big endian.
+//
+template <class T>
+struct BTreeCodec {
+  static constexpr SIZE_T size=sizeof(T);
+  static inline void Encode(const T &x, char *p) { memcpy(p,&x,size); }
+  static inline T    Decode(const char *p) { T x; memcpy(&x,p,size); return x; }
+};
+
+template <class T>
+struct BTreeBigEndianCodec {
+  static constexpr SIZE_T size=sizeof(T);
+  static inline void Encode(const T &x, char *p) {
+    for (SIZE_T i=0;i<size;i++) {
+      p[i]=(char)(x>>(8*(size-1-i)));
+    }
+  }
+  static inline T Decode(const char *p) {
+    T x=0;
+    for (SIZE_T i=0;i<size;i++) {
+      x=(x<<8) | (BYTE_T)p[i];
+    }
+    return x;
+  }
+};
+
+template <> struct BTreeCodec<uint16_t> : BTreeBigEndianCodec<uint16_t> {};
+template <> struct BTreeCodec<uint32_t> : BTreeBigEndianCodec<uint32_t> {};
+template <> struct BTreeCodec<uint64_t> : BTreeBigEndianCodec<uint64_t> {};
+
+
+template <class Key, class Value, class Compare=std::less<Key> >
+class TypedBTreeIndex {
+ public:
+  typedef BTreeCodec<Key>   KeyCodec;
+  typedef BTreeCodec<Value> ValueCodec;
+
+  static constexpr SIZE_T keysize=KeyCodec::size;
+  static constexpr SIZE_T valuesize=ValueCodec::size;
+  static constexpr SIZE_T leafslotsize=keysize+valuesize;           // KEY VALUE
+  static constexpr SIZE_T interiorslotsize=keysize+sizeof(SIZE_T); // KEY PTR
+
+  // Slots in a node of a given block size, as in NodeMetadata
+  static constexpr SIZE_T GetNumSlotsAsLeaf(const SIZE_T blocksize) {
+    return (blocksize-sizeof(NodeMetadata)-sizeof(SIZE_T))/leafslotsize;
+  }
+  static constexpr SIZE_T GetNumSlotsAsInterior(const SIZE_T blocksize) {
+    return (blocksize-sizeof(NodeMetadata)-sizeof(SIZE_T))/interiorslotsize;
+  }
+
+  TypedBTreeIndex(BufferCache *cache, const Compare &compare=Compare()) :
+    cache(cache), index(keysize,valuesize,cache,true,BTREE_FORMAT_PLAIN),
+    compare(compare), leafslots(0) {}
+
+  // As BTreeIndex::Attach.  Also returns ERROR_BADCONFIG if an existing
+  // index is not plain or its sizes don't match Key and Value.
+  ERROR_T Attach(const SIZE_T initblock, const bool create=false)
+  {
+    ERROR_T rc=index.Attach(initblock,create);
+    if (rc) { return rc; }
+
+    const NodeMetadata &info=index.GetSuperblockInfo();
+    if (info.format!=BTREE_FORMAT_PLAIN || info.keysize!=keysize || info.valuesize!=valuesize) {
+      return ERROR_BADCONFIG;
+    }
+    leafslots=GetNumSlotsAsLeaf(info.blocksize);
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T Detach(SIZE_T &initblock) { return index.Detach(initblock); }
+
+  // return ERROR_CONFLICT if the key already exists
+  ERROR_T Insert(const Key &key, const Value &value)
+  {
+    BTreeNodeView b;
+    BTreePath path;
+    SIZE_T offset;
+    bool found;
+    ERROR_T rc;
+
+    rc=b.Pin(cache,index.GetSuperblockInfo().rootnode);
+    if (rc) { return rc; }
+    if (b.info->numkeys==0) {
+      // The first insert builds the first two leaves
+      b.Unpin();
+      KEY_T k(keysize);
+      VALUE_T v(valuesize);
+      KeyCodec::Encode(key,(char *)k.data);
+      ValueCodec::Encode(value,(char *)v.data);
+      return index.Insert(k,v);
+    }
+
+    rc=FindLeaf(b,key,&path,offset,found);
+    if (rc) { return rc; }
+    if (found) { return ERROR_CONFLICT; }
+
+    char *slot=b.data+sizeof(SIZE_T)+offset*leafslotsize;
+    memmove(slot+leafslotsize,slot,(b.info->numkeys-offset)*leafslotsize);
+    KeyCodec::Encode(key,slot);
+    ValueCodec::Encode(value,slot+keysize);
+    b.info->numkeys++;
+    b.MarkDirty();
+    path.slot[path.depth-1]=offset;
+
+    if (b.info->numkeys>=leafslots) {
+      b.Unpin();
+      return index.Split(path);
+    }
+    return ERROR_NOERROR;
+  }
+
+  // return ERROR_NONEXISTENT if the key doesn't exist
+  ERROR_T Update(const Key &key, const Value &value)
+  {
+    BTreeNodeView b;
+    SIZE_T offset;
+    bool found;
+    ERROR_T rc;
+
+    rc=b.Pin(cache,index.GetSuperblockInfo().rootnode);
+    if (rc) { return rc; }
+    rc=FindLeaf(b,key,0,offset,found);
+    if (rc) { return rc; }
+    if (!found) { return ERROR_NONEXISTENT; }
+
+    ValueCodec::Encode(value,b.data+sizeof(SIZE_T)+offset*leafslotsize+keysize);
+    b.MarkDirty();
+    return ERROR_NOERROR;
+  }
+
+  // return ERROR_NONEXISTENT if the key doesn't exist
+  ERROR_T Lookup(const Key &key, Value &value)
+  {
+    BTreeNodeView b;
+    SIZE_T offset;
+    bool found;
+    ERROR_T rc;
+
+    rc=b.Pin(cache,index.GetSuperblockInfo().rootnode);
+    if (rc) { return rc; }
+    rc=FindLeaf(b,key,0,offset,found);
+    if (rc) { return rc; }
+    if (!found) { return ERROR_NONEXISTENT; }
+
+    value=ValueCodec::Decode(b.data+sizeof(SIZE_T)+offset*leafslotsize+keysize);
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T SanityCheck() const { return index.SanityCheck(); }
+  ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const {
+    return index.Display(o,display_type);
+  }
+
+  // The type erased index on the same tree
+  BTreeIndex &GetIndex() { return index; }
+
+ private:
+  BufferCache *cache;
+  BTreeIndex   index;
+  Compare      compare;
+  SIZE_T       leafslots;
+
+  // Of the count keys starting at base, Stride bytes apart, the first
+  // one not less than key
+  template <SIZE_T Stride>
+  inline SIZE_T Search(const char *base, const SIZE_T count, const Key &key, bool &found) const
+  {
+    SIZE_T lo=0;
+    SIZE_T hi=count;
+
+    while (lo<hi) {
+      SIZE_T mid=lo+(hi-lo)/2;
+      Key k=KeyCodec::Decode(base+mid*Stride);
+      if (compare(k,key)) {
+        lo=mid+1;
+      } else if (compare(key,k)) {
+        hi=mid;
+      } else {
+        found=true;
+        return mid;
+      }
+    }
+    found=false;
+    return lo;
+  }
+
+  // Walks from the node pinned in b down to the leaf for key, leaving
+  // the leaf pinned in b.  If path is given, the way there is put in
+  // it, as BTreeIndex::Split wants it.
+  ERROR_T FindLeaf(BTreeNodeView &b, const Key &key, BTreePath *path,
+                   SIZE_T &offset, bool &found)
+  {
+    ERROR_T rc;
+    SIZE_T ptr;
+    SIZE_T depth=0;
+
+    while (b.info->nodetype!=BTREE_LEAF_NODE) {
+      if (b.info->nodetype!=BTREE_ROOT_NODE && b.info->nodetype!=BTREE_INTERIOR_NODE) {
+        return ERROR_INSANE;
+      }
+      if (b.info->numkeys==0) {
+        return ERROR_NONEXISTENT;
+      }
+      // An equal key belongs to the right
+      offset=Search<interiorslotsize>(b.data+sizeof(SIZE_T),b.info->numkeys,key,found);
+      memcpy(&ptr,b.data+(offset+found)*interiorslotsize,sizeof(SIZE_T));
+      if (depth+1>=BTREE_MAX_DEPTH) {
+        return ERROR_INSANE;
+      }
+      if (path) {
+        path->node[depth]=b.GetBlockNum();
+        path->slot[depth]=offset+found;
+      }
+      depth++;
+      rc=b.Pin(cache,ptr);
+      if (rc) { return rc; }
+    }
+    if (path) {
+      path->node[depth]=b.GetBlockNum();
+      path->slot[depth]=0;
+      path->depth=depth+1;
+    }
+    offset=Search<leafslotsize>(b.data+sizeof(SIZE_T),b.info->numkeys,key,found);
+    return ERROR_NOERROR;
+  }
+};
+
+#endif
@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "buffercache.h"
 
 ERROR_T BufferCache::CheckDeleteOldest()
@@ -17,6 +19,10 @@ ERROR_T BufferCache::CheckDeleteOldest()
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
+       // Pinned frames are in use and cannot go
+       if ((*i).second.pincount>0) { 
+	 continue;
+       }
        if ((*i).second.lastaccessed<oldest) { 
 	 oldestptr=i;
 	 oldest=(*i).second.lastaccessed;
@@ -175,7 +181,12 @@ ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 
   if (b!=blockmap.end()) {
     // It's in  cache, so just replace the block
-    (*b).second=inblock;
+    // Copy in place so that the frame stays put for anyone who has it pinned
+    if ((*b).second.length==inblock.length) { 
+      memcpy((*b).second.data,inblock.data,inblock.length);
+    } else {
+      (*b).second=inblock;
+    }
     (*b).second.lastaccessed=curtime;
     (*b).second.dirty=true;
     writes++;
@@ -197,6 +208,58 @@ ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
   }
 }
   
+ERROR_T BufferCache::PinBlock(const SIZE_T inblocknum, Block *&frame)
+{
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(inblocknum);
+
+  if (b!=blockmap.end()) {
+    // It's in cache, just update its lastaccessed and hand it out
+    frame=&((*b).second);
+  } else {
+    // It's not in cache, so time to allocate it
+    CheckDeleteOldest();
+    if (!(disk->IsBlockAllocated(inblocknum))) { 
+      if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
+	cerr << "BufferCache::PinBlock: Attempt to pin unallocated block " << inblocknum<<endl;
+      }
+    }
+    // read it from disk straight into its frame
+    double reqtime;
+    frame=&(blockmap[inblocknum]);
+    int rc = disk->Read(inblocknum,
+			*frame,
+			reqtime);
+    curtime+=reqtime;
+    diskreads++;
+    if (rc!=ERROR_NOERROR) { 
+      blockmap.erase(inblocknum);
+      frame=0;
+      return rc;
+    }
+    frame->dirty=false;
+  }
+  frame->lastaccessed=curtime;
+  frame->pincount++;
+  reads++;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::UnpinBlock(Block *frame, const bool dirty)
+{
+  if (frame==0 || frame->pincount==0) { 
+    return ERROR_GENERAL;
+  }
+  frame->pincount--;
+  frame->lastaccessed=curtime;
+  if (dirty) { 
+    frame->dirty=true;
+    writes++;
+  }
+  return ERROR_NOERROR;
+}
+  
 ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
 {
   // Not implemented yet
@@ -224,7 +287,11 @@ ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
 	return rc;
       }
     }
-    blockmap.erase(b);
+    (*b).second.dirty=false;
+    // A pinned frame is written back but stays resident
+    if ((*b).second.pincount==0) { 
+      blockmap.erase(b);
+    }
     return ERROR_NOERROR;
   }
 }
@@ -249,7 +316,7 @@ ostream & BufferCache::Print(ostream &os) const
     if (b!=blockmap.begin()) { 
       os << ", ";
     }
-    os << (*b).first << ((*b).second.dirty ? "(dirty)" : "");
+    os << (*b).first << ((*b).second.dirty ? "(dirty)" : "") << ((*b).second.pincount ? "(pinned)" : "");
   }
   os << "}, disk="<<*disk<<")";
   
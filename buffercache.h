@@ -70,6 +70,20 @@ class BufferCache {
   // ERROR_NOSUCHBLOCK
   // ERROR_WRONGSIZEBLOCK or other nonzero error codes
   ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock);
+
+  // Pin a block in the cache and return a pointer to its resident
+  // frame instead of a copy.  A pinned frame is never evicted, so the
+  // caller may read and modify frame->data in place until it calls
+  // UnpinBlock.  Pins nest.  If every frame is pinned, the cache grows
+  // past its size until some are released.
+  //
+  // returns one of ERROR_NOERROR  (zero)
+  // ERROR_NOSUCHBLOCK or other nonzero error codes
+  ERROR_T PinBlock(const SIZE_T inblocknum, Block *&frame);
+
+  // Release a pin taken by PinBlock.  Pass dirty=true if the frame
+  // was modified so it will be written back.
+  ERROR_T UnpinBlock(Block *frame, const bool dirty=false);
   
   // Request that a block be read into the cache
   // This returns immediately.
@@ -43,6 +43,16 @@ while ($line=<STDIN>) {
       print STDERR "Updated ($key, $value)\n" if $debug;
       print "OK\n";
     }
+  } elsif ($op eq "UPSERT") { 
+    ($key, $value) = split(/\s+/,$rest);
+    if (Bug()) { 
+      print STDERR "Upserting ($key, $value) failed\n" if $debug;
+      print "FAIL\n";
+    } else {
+      $content{$key}=$value;
+      print STDERR "Upserted ($key, $value)\n" if $debug;
+      print "OK\n";
+    }
   } elsif ($op eq "DELETE") { 
     ($key)=split(/\s+/,$rest);
     if (!(defined $content{$key}) || Bug() ) { 
@@ -11,7 +11,10 @@ using namespace std;
 
 void usage()
 {
-  cerr << "usage: sim filestem cachesize < specfile \n";
+  cerr << "usage: sim filestem cachesize [format] < specfile \n";
+  cerr << "  format is a comma separated list of node formats:\n";
+  cerr << "    plain, prefix, truncate, columnar, varlen, postings, counted\n";
+  cerr << "  used when INIT creates the index\n";
 }
 
 
@@ -20,13 +23,19 @@ int main(int argc, char *argv[])
 
   // CONFORMS to the interface of ref_impl.pl
 
-  if (argc != 3){
+  if (argc != 3 && argc != 4){
     usage();
     return 1;
   }
 
   char *filestem=argv[1];
   SIZE_T cachesize=atoi(argv[2]);
+  SIZE_T format=BTREE_FORMAT_PLAIN;
+
+  if (argc==4 && ParseNodeFormat(argv[3],format)) { 
+    usage();
+    return 1;
+  }
   SIZE_T superblocknum;
 
   FILE *file; 
@@ -59,7 +68,7 @@ int main(int argc, char *argv[])
     is >> action >> key >> value;
 
     if (action == "INIT") {
-      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
+      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache,true,format);
       if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
 	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
 	cout << "FAIL\n";
@@ -80,6 +89,13 @@ int main(int argc, char *argv[])
       } else {
         cout <<"OK\n";
       }
+    } else if (action == "UPSERT"){
+      if ((rc=btree->Upsert(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
+        cout <<"FAIL" <<endl;
+	cerr <<"Can't upsert due to error "<<rc<<"\n";
+      } else {
+        cout <<"OK\n";
+      }
     } else if (action == "DELETE"){
       if ((rc=btree->Delete(KEY_T(key.c_str())))!=ERROR_NOERROR) { 
         cout <<"FAIL"<<endl;